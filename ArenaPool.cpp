@@ -0,0 +1,148 @@
+#include "ArenaPool.h"
+
+extern "C"
+{
+    ArenaPool::ArenaPool(void* base, TVMMemorySize size, TVMMemoryPoolIDRef mid)
+        : BasePool(base, size, VM_MEMORY_POOL_GRANULE_MINIMUM, mid)
+    {
+        this->top   = (uint8_t*)base;
+        this->last  = NULL;
+        this->epoch = 0;
+    }
+
+    ArenaPool::~ArenaPool()
+    {
+    }
+
+    ArenaHeader* ArenaPool::header(void* base)
+    {
+        return (ArenaHeader*)((uint8_t*)base - ARENA_HEADER);
+    }
+
+    uint32_t ArenaPool::checkWord(void* base)
+    {
+        uint32_t offset = (uint8_t*)base - (uint8_t*)mem_base;
+
+        return (ARENA_MAGIC ^ offset ^ (epoch * 0x9E3779B1U)) & ~ARENA_FREED;
+    }
+
+    bool ArenaPool::allocate_memory(void** pointer, TVMMemorySize msize)
+    {
+        return allocate_aligned(pointer, msize, granuleSize);
+    }
+
+    bool ArenaPool::allocate_aligned(void** pointer, TVMMemorySize msize, TVMMemorySize alignment)
+    {
+        if(alignment < granuleSize)
+        {
+            alignment = granuleSize;
+        }
+
+        // Leave room for the header right before the block.
+        uintptr_t start  = ((uintptr_t)top + ARENA_HEADER + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        uintptr_t end    = (uintptr_t)mem_base + mem_size;
+
+        // Round the size up so the next block starts on a granule too.
+        uintptr_t length = ((uintptr_t)msize + granuleSize - 1) & ~(uintptr_t)(granuleSize - 1);
+
+        if(start > end || length > end - start)
+        {
+            return false;
+        }
+
+        ArenaHeader* block = header((void*)start);
+        block->check    = checkWord((void*)start);
+        block->length   = length;
+        block->previous = (last != NULL) ? last - (uint8_t*)mem_base : 0;
+
+        last = (uint8_t*)start;
+        top  = last + length;
+
+        mem_remaining = end - (uintptr_t)top;
+        *pointer = last;
+        return true;
+    }
+
+    ArenaHeader* ArenaPool::findBlock(void* base)
+    {
+        // Blocks are granule aligned and have their header in the pool, below top.
+        if((uint8_t*)base < (uint8_t*)mem_base + ARENA_HEADER || (uint8_t*)base >= top
+           || ((uintptr_t)base & (granuleSize - 1)) != 0)
+        {
+            return NULL;
+        }
+
+        ArenaHeader* block = header(base);
+        return (block->check == checkWord(base)) ? block : NULL;
+    }
+
+    bool ArenaPool::deallocate_memory(void* base)
+    {
+        ArenaHeader* block = findBlock(base);
+
+        // Only the start of a block still in use can be freed.
+        if(block == NULL)
+        {
+            return false;
+        }
+
+        block->check |= ARENA_FREED;
+
+        // Freeing the last block undoes it, along with any freed ones right before it.
+        while(last != NULL && (header(last)->check & ARENA_FREED))
+        {
+            block = header(last);
+            block->check = 0;
+            last = (block->previous != 0) ? (uint8_t*)mem_base + block->previous : NULL;
+        }
+
+        top = (last != NULL) ? last + header(last)->length : (uint8_t*)mem_base;
+
+        mem_remaining = (uint8_t*)mem_base + mem_size - top;
+        return true;
+    }
+
+    TVMMemorySize ArenaPool::block_size(void* base)
+    {
+        ArenaHeader* block = findBlock(base);
+
+        return (block != NULL) ? block->length : 0;
+    }
+
+    bool ArenaPool::resize_memory(void* base, TVMMemorySize msize)
+    {
+        uintptr_t length = ((uintptr_t)msize + granuleSize - 1) & ~(uintptr_t)(granuleSize - 1);
+
+        // The last block can just move top, anything older would run into its neighbour.
+        if(base == NULL || base != last || msize == 0 || length > (uintptr_t)((uint8_t*)mem_base + mem_size - last))
+        {
+            return false;
+        }
+
+        header(last)->length = length;
+        top = last + length;
+
+        mem_remaining = (uint8_t*)mem_base + mem_size - top;
+        return true;
+    }
+
+    void ArenaPool::freeSpace(TVMMemorySize* largest, unsigned int* segments)
+    {
+        uintptr_t start = ((uintptr_t)top + ARENA_HEADER + granuleSize - 1) & ~(uintptr_t)(granuleSize - 1);
+        uintptr_t end   = (uintptr_t)mem_base + mem_size;
+
+        *largest  = (start < end) ? end - start : 0;
+        *segments = (*largest != 0) ? 1 : 0;
+    }
+
+    bool ArenaPool::reset()
+    {
+        // Headers in the pool are left as they are, the new epoch stops them checking out.
+        top  = (uint8_t*)mem_base;
+        last = NULL;
+        epoch++;
+
+        mem_remaining = mem_size;
+        return true;
+    }
+}
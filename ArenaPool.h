@@ -0,0 +1,59 @@
+#include "BasePool.h"
+#include <cstddef>
+
+#ifndef ARENA_POOL_H
+#define ARENA_POOL_H
+
+extern "C"
+{
+
+// Written in the granule right before each block handed out, so frees can be
+// checked without keeping anything per block outside the pool. Costs a granule
+// per block.
+struct ArenaHeader
+{
+    uint32_t check;    // ARENA_MAGIC ^ the block's offset ^ the reset epoch, ARENA_FREED once freed.
+    uint32_t length;   // Rounded up to the granule.
+    uint32_t previous; // Offset of the block before it, 0 if it's the first.
+    uint32_t unused;
+};
+
+#define ARENA_MAGIC  0xA7E4A000U
+#define ARENA_FREED  0x1U
+#define ARENA_HEADER VM_MEMORY_POOL_GRANULE_MINIMUM
+
+// Bump pointer pool. Allocating moves top up, and only reset() (or freeing the
+// most recent block) moves it back down; other frees are accepted but the space
+// isn't reused until the blocks after it are freed too, or the next reset.
+class ArenaPool : public BasePool
+{
+    private:
+        uint8_t* top;   // First byte not handed out yet.
+        uint8_t* last;  // The most recent block, always still in use. NULL if there isn't one.
+        uint32_t epoch; // Bumped by reset() so headers left over from before don't check out.
+
+        ArenaHeader* header(void* base);
+        uint32_t checkWord(void* base);
+
+        // The header of the block in use starting at base, NULL if there isn't one.
+        ArenaHeader* findBlock(void* base);
+
+        void freeSpace(TVMMemorySize* largest, unsigned int* segments);
+
+    public:
+        ArenaPool(void* base, TVMMemorySize size, TVMMemoryPoolIDRef mid);
+        ~ArenaPool();
+
+        bool allocate_memory(void** pointer, TVMMemorySize msize);
+        bool allocate_aligned(void** pointer, TVMMemorySize msize, TVMMemorySize alignment);
+        bool deallocate_memory(void* base);
+
+        TVMMemorySize block_size(void* base);
+        bool resize_memory(void* base, TVMMemorySize msize);
+
+        bool reset();
+};
+
+}
+
+#endif
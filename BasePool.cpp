@@ -0,0 +1,142 @@
+#include "BasePool.h"
+#include <cstddef>
+#include <string.h>
+
+extern "C"
+{
+    static TVMMemoryPoolID nextMemID = 1;
+
+    BasePool::BasePool(void* base, TVMMemorySize size, TVMMemorySize granule, TVMMemoryPoolIDRef mid)
+    {
+        // Create Memory pool. Pools nobody can name don't take up an ID.
+        this->mem_id   = (mid != NULL) ? nextMemID++ : VM_MEMORY_POOL_ID_INVALID;
+        this->mem_base = base;
+        this->mem_size = size;
+
+        if(mid != NULL)
+        {
+            *mid = this->mem_id;
+        }
+
+        this->mem_remaining = size;
+        this->mem_cached    = 0;
+        this->granuleSize   = granule;
+
+        this->highWater         = 0;
+        this->allocations       = 0;
+        this->failedAllocations = 0;
+        memset(classAllocations, 0, sizeof(classAllocations));
+        memset(classBytes, 0, sizeof(classBytes));
+    }
+
+    BasePool::~BasePool()
+    {
+    }
+
+    TVMMemoryPoolID BasePool::getMemID()
+    {
+        return this->mem_id;
+    }
+
+    TVMMemorySize BasePool::getMemSize()
+    {
+        return this->mem_size;
+    }
+
+    void* BasePool::getMemBase()
+    {
+        return this->mem_base;
+    }
+
+    TVMMemorySize BasePool::getGranule()
+    {
+        return this->granuleSize;
+    }
+
+    TVMMemorySize BasePool::query_remaining()
+    {
+        return this->mem_remaining;
+    }
+
+    TVMMemorySize BasePool::query_free()
+    {
+        return this->mem_remaining + this->mem_cached;
+    }
+
+    void BasePool::countCached(TVMMemorySize bytes, bool cached)
+    {
+        if(cached)
+        {
+            mem_cached += bytes;
+        }
+        else
+        {
+            mem_cached -= bytes;
+        }
+    }
+
+    bool BasePool::resize_memory(void* base, TVMMemorySize msize)
+    {
+        return false;
+    }
+
+    void BasePool::countAllocation(TVMMemorySize size)
+    {
+        unsigned int sizeClass = (size <= 16) ? 0 : 32 - __builtin_clz(size - 1) - 4;
+
+        if(sizeClass >= VM_MEMORY_POOL_STATS_CLASSES)
+        {
+            sizeClass = VM_MEMORY_POOL_STATS_CLASSES - 1;
+        }
+
+        allocations++;
+        classAllocations[sizeClass]++;
+        classBytes[sizeClass] += size;
+
+        updateHighWater();
+    }
+
+    void BasePool::countFailure()
+    {
+        failedAllocations++;
+    }
+
+    void BasePool::updateHighWater()
+    {
+        if(mem_size - mem_remaining > highWater)
+        {
+            highWater = mem_size - mem_remaining;
+        }
+    }
+
+    void BasePool::getStats(SVMMemoryPoolStatsRef stats)
+    {
+        stats->DSize = mem_size;
+        stats->DFree = query_free();
+        freeSpace(&(stats->DLargestFree), &(stats->DFreeSegments));
+
+        stats->DHighWater         = highWater;
+        stats->DAllocations       = allocations;
+        stats->DFailedAllocations = failedAllocations;
+
+        for(unsigned int i = 0; i < VM_MEMORY_POOL_STATS_CLASSES; i++)
+        {
+            stats->DClassAllocations[i] = classAllocations[i];
+            stats->DClassBytes[i]       = classBytes[i];
+        }
+    }
+
+    uint32_t BasePool::block_length(void* base)
+    {
+        return 0;
+    }
+
+    void BasePool::set_cached(void* base, bool cached)
+    {
+    }
+
+    bool BasePool::reset()
+    {
+        return false;
+    }
+}
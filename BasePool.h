@@ -0,0 +1,73 @@
+#include "VirtualMachine.h"
+#include <stdint.h>
+
+#ifndef BASE_POOL_H
+#define BASE_POOL_H
+
+extern "C"
+{
+
+// What every kind of memory pool looks like to the MemoryManager.
+class BasePool
+{
+    protected:
+        TVMMemoryPoolID mem_id;
+        TVMMemorySize mem_size;
+        void* mem_base;
+
+        TVMMemorySize mem_remaining;
+        TVMMemorySize mem_cached;   // Freed into thread magazines, still out of mem_remaining.
+        TVMMemorySize granuleSize;  // Allocation unit, a power of two.
+
+        // Usage counters for VMMemoryPoolStats.
+        TVMMemorySize highWater;
+        unsigned int allocations;
+        unsigned int failedAllocations;
+        unsigned int classAllocations[VM_MEMORY_POOL_STATS_CLASSES];
+        TVMMemorySize classBytes[VM_MEMORY_POOL_STATS_CLASSES];
+
+        // Largest block that could be handed out now and the number of free runs.
+        virtual void freeSpace(TVMMemorySize* largest, unsigned int* segments) = 0;
+
+    public:
+        BasePool(void* base, TVMMemorySize size, TVMMemorySize granule, TVMMemoryPoolIDRef mid);
+        virtual ~BasePool();
+
+        TVMMemoryPoolID getMemID();
+        TVMMemorySize getMemSize();
+        void* getMemBase();
+        TVMMemorySize getGranule();
+
+        TVMMemorySize query_remaining();
+        TVMMemorySize query_free(); // Remaining plus what's sitting in magazines.
+
+        // Keeps mem_cached in step as blocks go into and come out of magazines.
+        void countCached(TVMMemorySize bytes, bool cached);
+
+        void countAllocation(TVMMemorySize size); // Also moves the high water mark.
+        void countFailure();
+        void updateHighWater();
+        void getStats(SVMMemoryPoolStatsRef stats);
+
+        virtual bool allocate_memory(void** pointer, TVMMemorySize msize) = 0;
+        virtual bool allocate_aligned(void** pointer, TVMMemorySize msize, TVMMemorySize alignment) = 0;
+        virtual bool deallocate_memory(void* base) = 0;
+
+        // Bytes available in the allocated block at base, 0 if it isn't one.
+        virtual TVMMemorySize block_size(void* base) = 0;
+
+        // Grow or shrink the block at base without moving it, if possible.
+        virtual bool resize_memory(void* base, TVMMemorySize msize);
+
+        // Length in granules of an allocated block that can go in a thread's
+        // magazine, 0 if it can't (the default).
+        virtual uint32_t block_length(void* base);
+        virtual void set_cached(void* base, bool cached);
+
+        // Free everything at once. Only some pools can.
+        virtual bool reset();
+};
+
+}
+
+#endif
@@ -0,0 +1,193 @@
+#include "Channel.h"
+
+extern "C"
+{
+    static ObjectSlab channelSlab(sizeof(Channel), SLAB_CHUNK_OBJECTS);
+
+    void* Channel::operator new(size_t size)
+    {
+        return channelSlab.allocate();
+    }
+
+    void Channel::operator delete(void* object)
+    {
+        channelSlab.deallocate(object);
+    }
+
+    Channel::Channel(TVMChannelID chid, unsigned int capacity)
+    {
+        this->chid = chid;
+
+        // Round the capacity up to a power of two so positions wrap with a mask.
+        this->capacity = MIN_CHANNEL_CAPACITY;
+        while(this->capacity < capacity)
+        {
+            this->capacity <<= 1;
+        }
+        this->mask = this->capacity - 1;
+
+        this->slots = new ChannelSlot[this->capacity];
+        for(unsigned int i = 0; i < this->capacity; i++)
+        {
+            this->slots[i].sequence = i;
+            this->slots[i].message  = NULL;
+        }
+
+        this->sendPos    = 0;
+        this->receivePos = 0;
+
+        this->waitingSenders   = 0;
+        this->waitingReceivers = 0;
+        this->deleted          = false;
+    }
+
+    Channel::~Channel()
+    {
+        delete[] slots;
+    }
+
+    bool Channel::trySend(void* message)
+    {
+        unsigned int pos = __atomic_load_n(&sendPos, __ATOMIC_RELAXED);
+
+        while(true)
+        {
+            ChannelSlot* slot = &slots[pos & mask];
+            unsigned int seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+            int diff = (int)(seq - pos);
+
+            if(diff == 0) // Slot is free for this position, try to claim it.
+            {
+                if(__atomic_compare_exchange_n(&sendPos, &pos, pos + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                    slot->message = message;
+                    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+                // pos now holds the current sendPos, retry.
+            }
+            else if(diff < 0) // Full.
+            {
+                return false;
+            }
+            else // Another sender got here first.
+            {
+                pos = __atomic_load_n(&sendPos, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    bool Channel::tryReceive(void** message)
+    {
+        unsigned int pos = __atomic_load_n(&receivePos, __ATOMIC_RELAXED);
+
+        while(true)
+        {
+            ChannelSlot* slot = &slots[pos & mask];
+            unsigned int seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+            int diff = (int)(seq - (pos + 1));
+
+            if(diff == 0) // Slot holds the message for this position, try to claim it.
+            {
+                if(__atomic_compare_exchange_n(&receivePos, &pos, pos + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                    *message = slot->message;
+                    __atomic_store_n(&slot->sequence, pos + mask + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+            }
+            else if(diff < 0) // Empty.
+            {
+                return false;
+            }
+            else // Another receiver got here first.
+            {
+                pos = __atomic_load_n(&receivePos, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    void Channel::wantsSend(ThreadControlBlock* thread)
+    {
+        thread->setWaitingOn(this->chid);
+        sendWaiting[thread->getPriority()].push_back(thread);
+        waitingSenders++;
+    }
+
+    void Channel::wantsReceive(ThreadControlBlock* thread)
+    {
+        thread->setWaitingOn(this->chid);
+        receiveWaiting[thread->getPriority()].push_back(thread);
+        waitingReceivers++;
+    }
+
+    ThreadControlBlock* Channel::getNextWaiter(std::vector<ThreadControlBlock*>* queues)
+    {
+        ThreadControlBlock* waiter = NULL;
+        for(int i = VM_THREAD_PRIORITY_HIGH; i >= 0; i--)
+        {
+            if(!(queues[i].empty()))
+            {
+                waiter = queues[i].front();
+                queues[i].erase(queues[i].begin());
+                waiter->setWaitingOn(0);
+                break;
+            }
+        }
+        return waiter;
+    }
+
+    ThreadControlBlock* Channel::getNextSender()
+    {
+        ThreadControlBlock* waiter = getNextWaiter(sendWaiting);
+        if(waiter != NULL)
+        {
+            waitingSenders--;
+        }
+        return waiter;
+    }
+
+    ThreadControlBlock* Channel::getNextReceiver()
+    {
+        ThreadControlBlock* waiter = getNextWaiter(receiveWaiting);
+        if(waiter != NULL)
+        {
+            waitingReceivers--;
+        }
+        return waiter;
+    }
+
+    bool Channel::stopWaiting(TVMThreadID tid)
+    {
+        for(unsigned int i = 0; i < NUM_PRIORITIES; i++)
+        {
+            for(unsigned int j = 0; j < sendWaiting[i].size(); j++)
+            {
+                if(sendWaiting[i][j]->getTID() == tid)
+                {
+                    sendWaiting[i][j]->setWaitingOn(0);
+                    sendWaiting[i].erase(sendWaiting[i].begin() + j);
+                    waitingSenders--;
+                    return true;
+                }
+            }
+
+            for(unsigned int j = 0; j < receiveWaiting[i].size(); j++)
+            {
+                if(receiveWaiting[i][j]->getTID() == tid)
+                {
+                    receiveWaiting[i][j]->setWaitingOn(0);
+                    receiveWaiting[i].erase(receiveWaiting[i].begin() + j);
+                    waitingReceivers--;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool Channel::hasWaiters()
+    {
+        return waitingSenders != 0 || waitingReceivers != 0;
+    }
+}
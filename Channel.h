@@ -0,0 +1,71 @@
+#include "ThreadControlBlock.h"
+#include "Mutex.h"
+#include <vector>
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+extern "C"
+{
+
+#define MIN_CHANNEL_CAPACITY 2
+
+// One ring slot. sequence tells producers and consumers whose turn the slot is.
+typedef struct
+{
+    volatile unsigned int sequence;
+    void* volatile message;
+} ChannelSlot;
+
+// Bounded multi-producer/multi-consumer ring. trySend and tryReceive are
+// lock-free and safe to call with signals enabled; everything else must be
+// called with signals suspended.
+class Channel
+{
+    public:
+        TVMChannelID chid;      // The Channel's ID.
+        unsigned int capacity;  // Number of slots (a power of two).
+
+        // Read on the fast path to decide whether a wakeup is needed.
+        volatile unsigned int waitingSenders;
+        volatile unsigned int waitingReceivers;
+
+        // Set when it's deleted, for threads that found it before then.
+        volatile bool deleted;
+
+        std::vector<ThreadControlBlock*> sendWaiting[NUM_PRIORITIES];
+        std::vector<ThreadControlBlock*> receiveWaiting[NUM_PRIORITIES];
+
+        Channel(TVMChannelID chid, unsigned int capacity);
+        ~Channel();
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
+
+        bool trySend(void* message);
+        bool tryReceive(void** message);
+
+        // Adds the thread specified to the appropriate waiting queue.
+        void wantsSend(ThreadControlBlock* thread);
+        void wantsReceive(ThreadControlBlock* thread);
+
+        // Removes and returns the highest priority waiter (NULL if none).
+        ThreadControlBlock* getNextSender();
+        ThreadControlBlock* getNextReceiver();
+
+        // Remove a thread from the waiting queues, returns true if it was waiting.
+        bool stopWaiting(TVMThreadID tid);
+
+        bool hasWaiters();
+
+    private:
+        ChannelSlot* slots;
+        unsigned int mask;
+
+        volatile unsigned int sendPos;
+        volatile unsigned int receivePos;
+
+        ThreadControlBlock* getNextWaiter(std::vector<ThreadControlBlock*>* queues);
+};
+}
+
+#endif
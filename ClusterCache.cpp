@@ -0,0 +1,259 @@
+#include "ClusterCache.h"
+#include "Journal.h"
+#include <algorithm>
+
+extern "C"
+{
+    static bool clusterOrder(Cluster* first, Cluster* second)
+    {
+        return first->clusterNum < second->clusterNum;
+    }
+
+    ClusterCache::ClusterCache(FileSystem* fileSystem, unsigned int budget)
+    {
+        this->fileSystem = fileSystem;
+
+        clusterSize = fileSystem->SectorsPerCluster * fileSystem->BytesPerSector;
+        numSlots    = budget / clusterSize;
+
+        if(numSlots < CLUSTER_CACHE_MIN_SLOTS)
+        {
+            numSlots = CLUSTER_CACHE_MIN_SLOTS;
+        }
+
+        buffer = new uint8_t[numSlots * clusterSize];
+        slots  = new Cluster*[numSlots];
+
+        for(unsigned int i = 0; i < numSlots; i++)
+        {
+            slots[i] = new Cluster;
+            slots[i]->data       = buffer + i * clusterSize;
+            slots[i]->clusterNum = NO_CLUSTER;
+            slots[i]->dirty      = false;
+            slots[i]->referenced = false;
+            slots[i]->hashNext   = NULL;
+        }
+
+        // Twice as many buckets as slots keeps the chains short.
+        unsigned int buckets = 1;
+        while(buckets < numSlots * 2)
+        {
+            buckets <<= 1;
+        }
+
+        hashMask  = buckets - 1;
+        hashTable = new Cluster*[buckets];
+
+        for(unsigned int i = 0; i < buckets; i++)
+        {
+            hashTable[i] = NULL;
+        }
+
+        clockHand = 0;
+        numDirty  = 0;
+    }
+
+    ClusterCache::~ClusterCache()
+    {
+        for(unsigned int i = 0; i < numSlots; i++)
+        {
+            delete slots[i];
+        }
+
+        delete[] slots;
+        delete[] hashTable;
+        delete[] buffer;
+    }
+
+    void ClusterCache::hashInsert(Cluster* cluster)
+    {
+        Cluster** bucket = &hashTable[cluster->clusterNum & hashMask];
+
+        cluster->hashNext = *bucket;
+        *bucket = cluster;
+    }
+
+    void ClusterCache::hashRemove(Cluster* cluster)
+    {
+        Cluster** link = &hashTable[cluster->clusterNum & hashMask];
+
+        while(*link != cluster)
+        {
+            link = &((*link)->hashNext);
+        }
+
+        *link = cluster->hashNext;
+        cluster->hashNext = NULL;
+    }
+
+    Cluster* ClusterCache::hashLookup(uint16_t clusterNum)
+    {
+        Cluster* cluster = hashTable[clusterNum & hashMask];
+
+        while(cluster != NULL && cluster->clusterNum != clusterNum)
+        {
+            cluster = cluster->hashNext;
+        }
+
+        return cluster;
+    }
+
+    Cluster* ClusterCache::evict()
+    {
+        // Give every recently used slot a second chance, at most one lap.
+        while(slots[clockHand]->referenced)
+        {
+            slots[clockHand]->referenced = false;
+            clockHand = (clockHand + 1) % numSlots;
+        }
+
+        Cluster* victim = slots[clockHand];
+        clockHand = (clockHand + 1) % numSlots;
+
+        if(victim->clusterNum != NO_CLUSTER)
+        {
+            if(victim->dirty)
+            {
+                fileSystem->journal->protect(victim->clusterNum);
+                fileSystem->writeCluster(victim->clusterNum, victim->data, true);
+                victim->dirty = false;
+                numDirty--;
+            }
+
+            hashRemove(victim);
+            victim->clusterNum = NO_CLUSTER;
+        }
+
+        return victim;
+    }
+
+    Cluster* ClusterCache::find(uint16_t clusterNum)
+    {
+        Cluster* cluster = hashLookup(clusterNum);
+
+        if(cluster != NULL)
+        {
+            cluster->referenced = true;
+        }
+
+        return cluster;
+    }
+
+    bool ClusterCache::contains(uint16_t clusterNum)
+    {
+        return hashLookup(clusterNum) != NULL;
+    }
+
+    Cluster* ClusterCache::load(uint16_t clusterNum)
+    {
+        Cluster* cluster = find(clusterNum);
+
+        if(cluster == NULL)
+        {
+            cluster = evict();
+
+            fileSystem->readCluster(clusterNum, cluster->data, true);
+
+            cluster->clusterNum = clusterNum;
+            cluster->referenced = true;
+            hashInsert(cluster);
+        }
+
+        return cluster;
+    }
+
+    Cluster* ClusterCache::zero(uint16_t clusterNum)
+    {
+        Cluster* cluster = hashLookup(clusterNum);
+
+        if(cluster == NULL)
+        {
+            cluster = evict();
+
+            cluster->clusterNum = clusterNum;
+            hashInsert(cluster);
+        }
+
+        memset(cluster->data, 0, clusterSize);
+        cluster->referenced = true;
+        markDirty(cluster);
+
+        return cluster;
+    }
+
+    void ClusterCache::prefetch(uint16_t clusterNum)
+    {
+        if(hashLookup(clusterNum) != NULL)
+        {
+            return;
+        }
+
+        Cluster* cluster = evict();
+
+        fileSystem->readCluster(clusterNum, cluster->data, true);
+
+        cluster->clusterNum = clusterNum;
+        cluster->referenced = false;
+        hashInsert(cluster);
+    }
+
+    void ClusterCache::discard(uint16_t clusterNum)
+    {
+        Cluster* cluster = hashLookup(clusterNum);
+
+        if(cluster != NULL)
+        {
+            if(cluster->dirty)
+            {
+                cluster->dirty = false;
+                numDirty--;
+            }
+
+            hashRemove(cluster);
+            cluster->clusterNum = NO_CLUSTER;
+            cluster->referenced = false;
+        }
+    }
+
+    void ClusterCache::markDirty(Cluster* cluster)
+    {
+        if(!cluster->dirty)
+        {
+            cluster->dirty = true;
+            numDirty++;
+        }
+    }
+
+    unsigned int ClusterCache::dirtyCount()
+    {
+        return numDirty;
+    }
+
+    void ClusterCache::flush()
+    {
+        std::vector<Cluster*> dirty;
+
+        for(unsigned int i = 0; i < numSlots; i++)
+        {
+            if(slots[i]->dirty)
+            {
+                dirty.push_back(slots[i]);
+            }
+        }
+
+        // In order, so runs of neighbouring clusters go out without seeking in between.
+        std::sort(dirty.begin(), dirty.end(), clusterOrder);
+
+        for(unsigned int i = 0; i < dirty.size(); i++)
+        {
+            bool seek = (i == 0 || dirty[i]->clusterNum != dirty[i - 1]->clusterNum + 1);
+
+            // The log is a separate file, committing doesn't move us off the image.
+            fileSystem->journal->protect(dirty[i]->clusterNum);
+            fileSystem->writeCluster(dirty[i]->clusterNum, dirty[i]->data, seek);
+            dirty[i]->dirty = false;
+        }
+
+        numDirty = 0;
+    }
+}
@@ -0,0 +1,82 @@
+#include "FileSystem.h"
+#include <cstddef>
+#include <vector>
+
+#ifndef CLUSTER_CACHE_H
+#define CLUSTER_CACHE_H
+
+extern "C"
+{
+
+// Host memory the cache may use for cluster data, and the fewest clusters
+// it holds whatever the cluster size.
+#define CLUSTER_CACHE_BYTES      (128 * 1024)
+#define CLUSTER_CACHE_MIN_SLOTS  8
+
+// Ticks between background writebacks of dirty clusters.
+#define CLUSTER_FLUSH_INTERVAL   100
+
+// Most clusters read ahead of a sequential reader.
+#define READ_AHEAD_MAX_CLUSTERS  8
+
+// Fixed size write-back cache of data clusters. Clusters are found through a
+// hash table on their number and the slot to reuse is picked with the clock
+// algorithm. Anything that can touch the device (load, flush) must be called
+// with the file system lock held exclusively; find only needs a shared hold.
+class ClusterCache
+{
+    private:
+        FileSystem* fileSystem;
+
+        unsigned int clusterSize;
+        unsigned int numSlots;
+        uint8_t* buffer; // numSlots clusters of data, carved up between the slots.
+        Cluster** slots;
+
+        Cluster** hashTable;
+        unsigned int hashMask; // Number of buckets - 1.
+
+        unsigned int clockHand;
+        unsigned int numDirty;
+
+        void hashInsert(Cluster* cluster);
+        void hashRemove(Cluster* cluster);
+        Cluster* hashLookup(uint16_t clusterNum);
+
+        // A slot free to be loaded into, written back first if it was dirty.
+        Cluster* evict();
+
+    public:
+        ClusterCache(FileSystem* fileSystem, unsigned int budget);
+        ~ClusterCache(); // Doesn't write anything back, flush first.
+
+        // The cached copy of clusterNum, or NULL.
+        Cluster* find(uint16_t clusterNum);
+
+        // Whether clusterNum is cached, without counting as a use of it.
+        bool contains(uint16_t clusterNum);
+
+        // The cached copy of clusterNum, read in if it isn't already.
+        Cluster* load(uint16_t clusterNum);
+
+        // A cached copy of clusterNum filled with zeros instead of read in, for
+        // clusters just allocated. It's dirty so the zeros make it to the disk.
+        Cluster* zero(uint16_t clusterNum);
+
+        // Reads in clusterNum if it isn't cached yet. It isn't marked as used,
+        // so if it never gets read it's among the first to go.
+        void prefetch(uint16_t clusterNum);
+
+        // Drops clusterNum without writing it back, for clusters that were freed.
+        void discard(uint16_t clusterNum);
+
+        void markDirty(Cluster* cluster);
+        unsigned int dirtyCount();
+
+        // Writes every dirty cluster back, in cluster order.
+        void flush();
+};
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include "Condition.h"
+
+extern "C"
+{
+    static ObjectSlab conditionSlab(sizeof(Condition), SLAB_CHUNK_OBJECTS);
+
+    void* Condition::operator new(size_t size)
+    {
+        return conditionSlab.allocate();
+    }
+
+    void Condition::operator delete(void* object)
+    {
+        conditionSlab.deallocate(object);
+    }
+
+    static TVMConditionID nextCID = 1;
+
+    Condition::Condition()
+    {
+        this->cid = nextCID;
+        nextCID++;
+    }
+
+    Condition::~Condition()
+    {
+    }
+
+    // Adds the thread specified to the appropriate waiting queue.
+    void Condition::wait(ThreadControlBlock* thread)
+    {
+        thread->setWaitingOn(this->cid);
+        waiting[thread->getPriority()].push_back(thread);
+    }
+
+    // Removes and returns the highest priority waiter (NULL if none).
+    ThreadControlBlock* Condition::getNextWaiter()
+    {
+        ThreadControlBlock* waiter = NULL;
+        for(int i = VM_THREAD_PRIORITY_HIGH; i >= 0; i--)
+        {
+            if(!(waiting[i].empty()))
+            {
+                waiter = waiting[i].front();
+                waiting[i].erase(waiting[i].begin());
+                waiter->setWaitingOn(0);
+                break;
+            }
+        }
+        return waiter;
+    }
+
+    // Remove a thread from the waiting queue.
+    bool Condition::stopWaiting(TVMThreadID tid)
+    {
+        for(unsigned int i = 0; i < NUM_PRIORITIES; i++)
+        {
+            for(unsigned int j = 0; j < waiting[i].size(); j++)
+            {
+                if(waiting[i][j]->getTID() == tid)
+                {
+                    waiting[i][j]->setWaitingOn(0);
+                    waiting[i].erase(waiting[i].begin() + j);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool Condition::hasWaiters()
+    {
+        for(unsigned int i = 0; i < NUM_PRIORITIES; i++)
+        {
+            if(!(waiting[i].empty()))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
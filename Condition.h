@@ -0,0 +1,36 @@
+#include "ThreadControlBlock.h"
+#include "Mutex.h"
+#include <vector>
+
+#ifndef CONDITION_H
+#define CONDITION_H
+
+extern "C"
+{
+
+class Condition
+{
+    public:
+        TVMConditionID cid; // The Condition's ID.
+
+        std::vector<ThreadControlBlock*> waiting[NUM_PRIORITIES];
+
+        Condition();
+        ~Condition();
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
+
+        // Adds the thread specified to the appropriate waiting queue.
+        void wait(ThreadControlBlock* thread);
+
+        // Removes and returns the highest priority waiter (NULL if none).
+        ThreadControlBlock* getNextWaiter();
+
+        // Remove a thread from the waiting queue, returns true if it was waiting.
+        bool stopWaiting(TVMThreadID tid);
+
+        bool hasWaiters();
+};
+}
+
+#endif
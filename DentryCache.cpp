@@ -0,0 +1,336 @@
+#include "DentryCache.h"
+#include "Journal.h"
+
+extern "C"
+{
+    DentryCache::DentryCache(FileSystem* fileSystem, ClusterCache* clusterCache)
+    {
+        this->fileSystem   = fileSystem;
+        this->clusterCache = clusterCache;
+    }
+
+    DentryCache::~DentryCache()
+    {
+        // Every dentry has exactly one short name key, long name keys are extra.
+        for(std::unordered_map<std::string, Dentry*>::iterator it = names.begin(); it != names.end(); it++)
+        {
+            if(it->first[2] == 'S')
+            {
+                delete it->second;
+            }
+        }
+    }
+
+    std::string DentryCache::longKey(uint16_t parent, const char* longName)
+    {
+        return std::string((const char*)&parent, sizeof(parent)) + 'L' + longName;
+    }
+
+    std::string DentryCache::shortKey(uint16_t parent, const uint8_t* shortName)
+    {
+        return std::string((const char*)&parent, sizeof(parent)) + 'S' + std::string((const char*)shortName, 11);
+    }
+
+    void DentryCache::add(Dentry* dentry)
+    {
+        if(!dentry->longName.empty())
+        {
+            names[longKey(dentry->parent, dentry->longName.c_str())] = dentry;
+        }
+
+        names[shortKey(dentry->parent, dentry->entry)] = dentry;
+    }
+
+    void DentryCache::loadDirectory(uint16_t parent)
+    {
+        uint16_t cluster = parent;
+        unsigned int offset = 0;
+        Dentry found;
+
+        while(nextEntry(&cluster, &offset, &found))
+        {
+            // "." and ".." never get looked up, paths are simplified first.
+            if(found.entry[0] == '.')
+            {
+                continue;
+            }
+
+            Dentry* dentry = new Dentry(found);
+            dentry->parent = parent;
+            add(dentry);
+        }
+
+        loaded.insert(parent);
+    }
+
+    bool DentryCache::nextEntry(uint16_t* cluster, unsigned int* offset, Dentry* dentry)
+    {
+        unsigned int clusterSize = fileSystem->SectorsPerCluster * fileSystem->BytesPerSector;
+
+        // The long name entries seen so far, followed by the short name one for getLFN.
+        uint8_t entries[(MAX_LFN_ENTRIES + 1) * BYTES_PER_ENTRY];
+        unsigned int count = 0;
+
+        while(*cluster >= 2 && *cluster < 0xFFF7)
+        {
+            if(*offset >= clusterSize)
+            {
+                *cluster = fileSystem->FatTable[*cluster];
+                *offset  = 0;
+                continue;
+            }
+
+            uint8_t* entry = clusterCache->load(*cluster)->data + *offset;
+
+            // Nothing is in use past here, stay put so later calls stop here too.
+            if(entry[0] == 0x00)
+            {
+                return false;
+            }
+
+            uint16_t entryCluster = *cluster;
+            uint16_t entryOffset  = *offset;
+            *offset += BYTES_PER_ENTRY;
+
+            if(entry[0] == 0xE5)
+            {
+                count = 0;
+                continue;
+            }
+
+            if(entry[DIR_ATTR] == ATTR_LONG_NAME)
+            {
+                // The last part of a name comes first, it starts a new name.
+                if((entry[0] & 0x40) == 0x40 || count == 0)
+                {
+                    count = 0;
+                    dentry->firstCluster = entryCluster;
+                    dentry->firstOffset  = entryOffset;
+                }
+
+                if(count < MAX_LFN_ENTRIES)
+                {
+                    memcpy(entries + count * BYTES_PER_ENTRY, entry, BYTES_PER_ENTRY);
+                    count++;
+                }
+                continue;
+            }
+
+            if((entry[DIR_ATTR] & ATTR_VOLUME_ID) != 0)
+            {
+                count = 0;
+                continue;
+            }
+
+            if(count == 0)
+            {
+                dentry->firstCluster = entryCluster;
+                dentry->firstOffset  = entryOffset;
+            }
+
+            memcpy(entries + count * BYTES_PER_ENTRY, entry, BYTES_PER_ENTRY);
+
+            char longName[MAX_LFN_ENTRIES * 13 + 1];
+            uint8_t* walk = entries;
+            getLFN(&walk, longName);
+
+            dentry->entryCluster = entryCluster;
+            dentry->entryOffset  = entryOffset;
+            dentry->numEntries   = count + 1;
+            dentry->longName     = longName;
+            memcpy(dentry->entry, entry, BYTES_PER_ENTRY);
+
+            return true;
+        }
+
+        return false;
+    }
+
+    Dentry* DentryCache::lookup(uint16_t parent, const char* longName, const char* shortName)
+    {
+        if(loaded.find(parent) == loaded.end())
+        {
+            loadDirectory(parent);
+        }
+
+        std::unordered_map<std::string, Dentry*>::iterator it = names.find(longKey(parent, longName));
+        if(it != names.end())
+        {
+            return it->second;
+        }
+
+        if(shortName != NULL)
+        {
+            it = names.find(shortKey(parent, (const uint8_t*)shortName));
+            if(it != names.end())
+            {
+                return it->second;
+            }
+        }
+
+        return NULL;
+    }
+
+    Dentry* DentryCache::insert(uint16_t parent, const char* longName, const uint8_t* entries, unsigned int count)
+    {
+        unsigned int clusterSize = fileSystem->SectorsPerCluster * fileSystem->BytesPerSector;
+
+        if(count * BYTES_PER_ENTRY > clusterSize)
+        {
+            return NULL;
+        }
+
+        if(loaded.find(parent) == loaded.end())
+        {
+            loadDirectory(parent);
+        }
+
+        // A long name has to come right before its short name entry, so look for
+        // count free slots in a row. Keeping them in one cluster keeps this simple.
+        uint16_t cluster = parent;
+        uint16_t lastCluster = parent;
+        unsigned int runOffset = 0;
+        unsigned int run = 0;
+
+        // Where the end of the directory (the first 0x00 entry) was, if it's in a
+        // cluster too full to take the new entries.
+        uint16_t endCluster = NO_CLUSTER;
+        unsigned int endOffset = 0;
+
+        while(cluster >= 2 && cluster < 0xFFF7)
+        {
+            uint8_t* data = clusterCache->load(cluster)->data;
+            run = 0;
+
+            for(unsigned int offset = 0; offset < clusterSize && run < count; offset += BYTES_PER_ENTRY)
+            {
+                if(data[offset] == 0x00 || data[offset] == 0xE5)
+                {
+                    if(run == 0)
+                    {
+                        runOffset = offset;
+                    }
+                    run++;
+
+                    if(data[offset] == 0x00 && endCluster == NO_CLUSTER)
+                    {
+                        endCluster = cluster;
+                        endOffset  = offset;
+                    }
+                }
+                else
+                {
+                    run = 0;
+                }
+            }
+
+            if(run == count)
+            {
+                break;
+            }
+
+            lastCluster = cluster;
+            cluster = fileSystem->FatTable[cluster];
+        }
+
+        if(run < count)
+        {
+            cluster = fileSystem->allocateClusters(lastCluster, 1);
+
+            if(cluster >= 0xFFF7)
+            {
+                return NULL;
+            }
+
+            clusterCache->zero(cluster);
+            fileSystem->journal->logZero(cluster);
+            runOffset = 0;
+        }
+
+        // Going past the end means the free entries left before it mustn't end the directory any more.
+        if(endCluster != NO_CLUSTER && endCluster != cluster)
+        {
+            Cluster* end = clusterCache->load(endCluster);
+
+            for(unsigned int offset = endOffset; offset < clusterSize; offset += BYTES_PER_ENTRY)
+            {
+                end->data[offset] = 0xE5;
+            }
+
+            clusterCache->markDirty(end);
+            fileSystem->journal->logEntries(endCluster, endOffset, end->data + endOffset, (clusterSize - endOffset) / BYTES_PER_ENTRY);
+        }
+
+        Cluster* target = clusterCache->load(cluster);
+        memcpy(target->data + runOffset, entries, count * BYTES_PER_ENTRY);
+        clusterCache->markDirty(target);
+        fileSystem->journal->logEntries(cluster, runOffset, target->data + runOffset, count);
+
+        Dentry* dentry = new Dentry;
+
+        dentry->parent       = parent;
+        dentry->entryCluster = cluster;
+        dentry->entryOffset  = runOffset + (count - 1) * BYTES_PER_ENTRY;
+        dentry->firstCluster = cluster;
+        dentry->firstOffset  = runOffset;
+        dentry->numEntries   = count;
+        dentry->longName     = (longName != NULL) ? longName : "";
+        memcpy(dentry->entry, entries + (count - 1) * BYTES_PER_ENTRY, BYTES_PER_ENTRY);
+
+        add(dentry);
+
+        return dentry;
+    }
+
+    void DentryCache::sync(Dentry* dentry)
+    {
+        Cluster* cluster = clusterCache->load(dentry->entryCluster);
+
+        memcpy(cluster->data + dentry->entryOffset, dentry->entry, BYTES_PER_ENTRY);
+        clusterCache->markDirty(cluster);
+        fileSystem->journal->logEntries(dentry->entryCluster, dentry->entryOffset, dentry->entry, 1);
+    }
+
+    void DentryCache::remove(Dentry* dentry)
+    {
+        unsigned int clusterSize = fileSystem->SectorsPerCluster * fileSystem->BytesPerSector;
+        uint16_t cluster = dentry->firstCluster;
+        unsigned int offset = dentry->firstOffset;
+
+        // Entries made elsewhere can run over into the directory's next cluster.
+        for(unsigned int i = 0; i < dentry->numEntries; i++)
+        {
+            if(offset >= clusterSize)
+            {
+                cluster = fileSystem->FatTable[cluster];
+                offset  = 0;
+            }
+
+            Cluster* entries = clusterCache->load(cluster);
+            entries->data[offset] = 0xE5;
+            clusterCache->markDirty(entries);
+            fileSystem->journal->logEntries(cluster, offset, entries->data + offset, 1);
+
+            offset += BYTES_PER_ENTRY;
+        }
+
+        if(!dentry->longName.empty())
+        {
+            std::unordered_map<std::string, Dentry*>::iterator it = names.find(longKey(dentry->parent, dentry->longName.c_str()));
+            if(it != names.end() && it->second == dentry)
+            {
+                names.erase(it);
+            }
+        }
+
+        names.erase(shortKey(dentry->parent, dentry->entry));
+
+        // Its clusters can be handed out again, maybe to another directory.
+        if((dentry->entry[DIR_ATTR] & ATTR_DIRECTORY) != 0)
+        {
+            loaded.erase(*(uint16_t*)(dentry->entry + DIR_FIRST_CLUS_LO));
+        }
+
+        delete dentry;
+    }
+}
@@ -0,0 +1,58 @@
+#include "FileSystem.h"
+#include "ClusterCache.h"
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+extern "C"
+{
+
+// Entries of subdirectories, keyed by the directory's first cluster and the
+// file's long or short name. The first lookup in a directory reads all of it
+// in, after that lookups (found or not) never go back to its clusters.
+// Everything here can go through the cluster cache, so the file system lock
+// must be held exclusively.
+class DentryCache
+{
+    private:
+        FileSystem* fileSystem;
+        ClusterCache* clusterCache;
+
+        std::unordered_map<std::string, Dentry*> names;
+        std::unordered_set<uint16_t> loaded; // Directories all of whose entries are in names.
+
+        static std::string longKey(uint16_t parent, const char* longName);
+        static std::string shortKey(uint16_t parent, const uint8_t* shortName);
+
+        void add(Dentry* dentry);
+        void loadDirectory(uint16_t parent);
+
+    public:
+        DentryCache(FileSystem* fileSystem, ClusterCache* clusterCache);
+        ~DentryCache();
+
+        // Reads the next file of a directory from cluster/offset on, which are
+        // moved past it. Fills in dentry (not its parent) and returns false at the end.
+        bool nextEntry(uint16_t* cluster, unsigned int* offset, Dentry* dentry);
+
+        // The file called longName in the directory starting at parent, or failing
+        // that the one whose short name is shortName (if it isn't NULL). NULL if none.
+        Dentry* lookup(uint16_t parent, const char* longName, const char* shortName);
+
+        // Puts count entries (long names first, short name last) for a new file
+        // into the directory, growing it by a cluster if there's no room.
+        Dentry* insert(uint16_t parent, const char* longName, const uint8_t* entries, unsigned int count);
+
+        // Writes dentry's copy of its short name entry back to the directory.
+        void sync(Dentry* dentry);
+
+        // Frees dentry's entries in its directory and forgets it. Its clusters are the caller's to free.
+        void remove(Dentry* dentry);
+};
+
+}
+
+#endif
@@ -1,7 +1,53 @@
 #include "FileSystem.h"
+#include "Journal.h"
 
 extern "C"
 {
+	static ObjectSlab directorySlab(sizeof(Directory), SLAB_CHUNK_OBJECTS);
+	static ObjectSlab fileSlab(sizeof(File), SLAB_CHUNK_OBJECTS);
+	static ObjectSlab clusterSlab(sizeof(Cluster), SLAB_CHUNK_OBJECTS);
+	static ObjectSlab dentrySlab(sizeof(Dentry), SLAB_CHUNK_OBJECTS);
+
+	void* Directory::operator new(size_t size)
+	{
+		return directorySlab.allocate();
+	}
+
+	void Directory::operator delete(void* object)
+	{
+		directorySlab.deallocate(object);
+	}
+
+	void* File::operator new(size_t size)
+	{
+		return fileSlab.allocate();
+	}
+
+	void File::operator delete(void* object)
+	{
+		fileSlab.deallocate(object);
+	}
+
+	void* Cluster::operator new(size_t size)
+	{
+		return clusterSlab.allocate();
+	}
+
+	void Cluster::operator delete(void* object)
+	{
+		clusterSlab.deallocate(object);
+	}
+
+	void* Dentry::operator new(size_t size)
+	{
+		return dentrySlab.allocate();
+	}
+
+	void Dentry::operator delete(void* object)
+	{
+		dentrySlab.deallocate(object);
+	}
+
 	FileSystem::FileSystem(char* mount, int fileDescriptor, void* base, Scheduler* myScheduler)
 	{
                 this->myScheduler = myScheduler;
@@ -19,44 +65,29 @@ extern "C"
 
 		FirstRootSector = ReservedSectorCount + NumFATs * FATSize16;
 		FirstDataSector = FirstRootSector + (RootEntryCount * BYTES_PER_ENTRY / SECTOR_SIZE);
-	}
 
-	FileSystem::~FileSystem()
-	{
-		uint16_t* fat = this->FatTable;
+		DirtyFATSectors.assign(FATSize16, false);
+		DirtyRootSectors.assign(FirstDataSector - FirstRootSector, false);
 
-		// Write back FAT table and duplicate.
-		grabMutex();
+		// Brings the FAT and root up to date with whatever was committed before we last went down.
+		journal = new Journal(this, myScheduler);
 
-		for(int i = 0; i < this->FATSize16; i++)
-		{
-			memcpy(base, (void*)fat, MAX_WRITE_SIZE);
-			fat += this->BytesPerSector / 2;
+		buildFreeMap();
+		indexRoot();
+	}
 
-			writeSector(this->ReservedSectorCount + i, base, MAX_WRITE_SIZE);
-			writeSector(this->ReservedSectorCount + 17 + i, base, MAX_WRITE_SIZE);
-		}
+	FileSystem::~FileSystem()
+	{
+		// Write back just the FAT (every copy) and root sectors that changed.
+		grabExclusive();
+		journal->checkpoint();
+		releaseLock();
 
-		releaseMutex();
+		delete journal;
 
 		// Delete the FAT table.
 		delete[] FatTable;
-
-		// Write back all the entires.
-		grabMutex();
-
-		uint8_t* root = RootEntries;
-
-		int RootDirectorySectors = (this->RootEntryCount * BYTES_PER_ENTRY) / this->BytesPerSector;
-		for(int i = 0; i < RootDirectorySectors; i++)
-		{
-			memcpy(base, (void*)root, MAX_WRITE_SIZE);
-			root += SECTOR_SIZE;
-
-			writeSector(this->ReservedSectorCount + (this->NumFATs * this->FATSize16) + i, base, MAX_WRITE_SIZE);
-		}
-
-		releaseMutex();
+		delete[] FreeMap;
 
 		// Delete the root entries.
 		delete[] RootEntries;
@@ -74,7 +105,7 @@ extern "C"
 
 	void FileSystem::processBPB()
 	{
-		grabMutex();
+		grabExclusive();
 
 		ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
 		MachineFileRead(this->fileDescriptor, this->base, MAX_READ_SIZE, fileHandler, (void*)currentThread);
@@ -101,21 +132,21 @@ extern "C"
 		cout << "Hidden Sectors: " << this->HiddenSectors << endl;
 		cout << "Total Sector 32: " << this->TotalSector32 << endl;*/
 
-		releaseMutex();
+		releaseLock();
 	}
 
 	void FileSystem::processFAT()
 	{
 		FatTable = new uint16_t[this->FATSize16 * this->BytesPerSector / 2];
 
-		grabMutex();
+		grabExclusive();
 
 		for(int i = 0; i < this->FATSize16; i++)
 		{
 			readSector(this->ReservedSectorCount + i, (uint8_t*)(FatTable + (i * this->BytesPerSector / 2)), MAX_READ_SIZE);
 		}
 
-		releaseMutex();
+		releaseLock();
 
 		/*for(int i = 0; i < this->FATSize16 * this->BytesPerSector / WORD_SIZE_16; i++)
 		{
@@ -129,11 +160,312 @@ extern "C"
 		}*/
 	}
 
+	void FileSystem::buildFreeMap()
+	{
+		uint32_t totalSectors = (this->TotalSector16 != 0) ? this->TotalSector16 : this->TotalSector32;
+		uint32_t fatEntries   = this->FATSize16 * this->BytesPerSector / 2;
+
+		// Only clusters that are both in the data area and in the FAT exist.
+		NumClusters = (totalSectors - FirstDataSector) / this->SectorsPerCluster + 2;
+		if(NumClusters > fatEntries)
+		{
+			NumClusters = fatEntries;
+		}
+
+		FreeMap = new uint32_t[(NumClusters + 31) / 32];
+		memset(FreeMap, 0, ((NumClusters + 31) / 32) * sizeof(uint32_t));
+
+		FreeCount = 0;
+		FreeHint  = 2;
+
+		for(uint32_t i = 2; i < NumClusters; i++)
+		{
+			if(FatTable[i] == 0x0000)
+			{
+				setClusterFree(i, true);
+			}
+		}
+	}
+
+	bool FileSystem::clusterFree(uint32_t cluster)
+	{
+		return (FreeMap[cluster / 32] & (1U << (cluster % 32))) != 0;
+	}
+
+	void FileSystem::setClusterFree(uint32_t cluster, bool free)
+	{
+		if(free)
+		{
+			FreeMap[cluster / 32] |= (1U << (cluster % 32));
+			FreeCount++;
+		}
+		else
+		{
+			FreeMap[cluster / 32] &= ~(1U << (cluster % 32));
+			FreeCount--;
+		}
+	}
+
+	uint32_t FileSystem::findFreeRun(uint32_t from, uint32_t count, uint32_t* length)
+	{
+		uint32_t firstStart  = 0;
+		uint32_t firstLength = 0;
+
+		if(from < 2 || from >= NumClusters)
+		{
+			from = 2;
+		}
+
+		uint32_t cluster = from;
+		uint32_t scanned = 0;
+
+		while(scanned < NumClusters - 2)
+		{
+			// Skip over words with nothing free in them.
+			if(cluster % 32 == 0 && FreeMap[cluster / 32] == 0)
+			{
+				uint32_t skip = (cluster + 32 <= NumClusters) ? 32 : NumClusters - cluster;
+				cluster += skip;
+				scanned += skip;
+			}
+			else if(!clusterFree(cluster))
+			{
+				cluster++;
+				scanned++;
+			}
+			else
+			{
+				// Measure the run, stopping at the end of the disk rather than wrapping.
+				uint32_t start = cluster;
+				while(cluster < NumClusters && clusterFree(cluster) && cluster - start < count)
+				{
+					cluster++;
+				}
+				scanned += cluster - start;
+
+				if(cluster - start == count)
+				{
+					*length = count;
+					return start;
+				}
+
+				if(firstLength == 0)
+				{
+					firstStart  = start;
+					firstLength = cluster - start;
+				}
+			}
+
+			if(cluster >= NumClusters)
+			{
+				cluster = 2;
+			}
+		}
+
+		*length = firstLength;
+		return firstStart;
+	}
+
+	uint16_t FileSystem::allocateClusters(uint16_t prevCluster, uint32_t count)
+	{
+		if(count == 0 || count > FreeCount)
+		{
+			return 0xFFFF;
+		}
+
+		uint16_t firstCluster = 0xFFFF;
+
+		while(count > 0)
+		{
+			// Carrying on right after the previous cluster keeps the file in one piece.
+			uint32_t from = (prevCluster != NO_CLUSTER) ? prevCluster + 1 : FreeHint;
+			uint32_t length;
+			uint32_t start;
+
+			if(from < NumClusters && clusterFree(from))
+			{
+				start  = from;
+				length = 0;
+				while(start + length < NumClusters && length < count && clusterFree(start + length))
+				{
+					length++;
+				}
+			}
+			else
+			{
+				start = findFreeRun(FreeHint, count, &length);
+			}
+
+			for(uint32_t i = start; i < start + length; i++)
+			{
+				setClusterFree(i, false);
+				FatTable[i] = (i + 1 < start + length) ? i + 1 : 0xFFFF;
+				markFATDirty(i);
+			}
+
+			if(prevCluster != NO_CLUSTER)
+			{
+				FatTable[prevCluster] = start;
+				markFATDirty(prevCluster);
+			}
+
+			if(firstCluster == 0xFFFF)
+			{
+				firstCluster = start;
+			}
+
+			prevCluster = start + length - 1;
+			count      -= length;
+			FreeHint    = start + length;
+		}
+
+		return firstCluster;
+	}
+
+	void FileSystem::freeChain(uint16_t cluster)
+	{
+		while(cluster >= 2 && cluster < NumClusters)
+		{
+			uint16_t next = FatTable[cluster];
+
+			FatTable[cluster] = 0x0000;
+			markFATDirty(cluster);
+			setClusterFree(cluster, true);
+
+			cluster = next;
+		}
+	}
+
+	void FileSystem::indexRoot()
+	{
+		char longName[VM_FILE_SYSTEM_LFN_SIZE];
+		uint8_t* end = RootEntries + this->RootEntryCount * BYTES_PER_ENTRY;
+
+		for(uint8_t* entry = RootEntries; entry < end && entry[0] != 0x00; entry += BYTES_PER_ENTRY)
+		{
+			if(entry[0] == 0xE5)
+			{
+				continue;
+			}
+
+			if(entry[DIR_ATTR] == ATTR_LONG_NAME)
+			{
+				if((entry[0] & 0x40) == 0x40)
+				{
+					// Leaves entry on the short name entry the long name belongs to.
+					getLFN(&entry, longName);
+
+					if(entry < end && entry[0] != 0x00 && entry[0] != 0xE5)
+					{
+						indexEntry(longName, entry);
+					}
+				}
+			}
+			else
+			{
+				indexEntry(NULL, entry);
+			}
+		}
+	}
+
+	void FileSystem::indexEntry(const char* longName, uint8_t* entry)
+	{
+		if(longName != NULL)
+		{
+			LongNames[longName] = entry;
+		}
+
+		ShortNames[std::string((char*)entry, 11)] = entry;
+	}
+
+	void FileSystem::unindexEntry(const char* longName, uint8_t* entry)
+	{
+		if(longName != NULL)
+		{
+			std::unordered_map<std::string, uint8_t*>::iterator it = LongNames.find(longName);
+			if(it != LongNames.end() && it->second == entry)
+			{
+				LongNames.erase(it);
+			}
+		}
+
+		std::unordered_map<std::string, uint8_t*>::iterator it = ShortNames.find(std::string((char*)entry, 11));
+		if(it != ShortNames.end() && it->second == entry)
+		{
+			ShortNames.erase(it);
+		}
+	}
+
+	uint8_t* FileSystem::findEntry(const char* longName, const char* shortName)
+	{
+		std::unordered_map<std::string, uint8_t*>::iterator it = LongNames.find(longName);
+		if(it != LongNames.end())
+		{
+			return it->second;
+		}
+
+		if(shortName != NULL)
+		{
+			it = ShortNames.find(std::string(shortName, 11));
+			if(it != ShortNames.end())
+			{
+				return it->second;
+			}
+		}
+
+		return NULL;
+	}
+
+	void FileSystem::removeRootEntry(uint8_t* entry)
+	{
+		// Its long name entries are the ones right before it, back to the one that starts the name.
+		uint8_t* first = entry;
+
+		while(first > RootEntries && first[DIR_ATTR - BYTES_PER_ENTRY] == ATTR_LONG_NAME && first[-BYTES_PER_ENTRY] != 0xE5)
+		{
+			first -= BYTES_PER_ENTRY;
+
+			if((first[0] & 0x40) == 0x40)
+			{
+				break;
+			}
+		}
+
+		char longName[MAX_LFN_ENTRIES * 13 + 1];
+		uint8_t* walk = first;
+		getLFN(&walk, longName);
+
+		unindexEntry((first != entry) ? longName : NULL, entry);
+
+		markRootDirty(first, (entry - first) / BYTES_PER_ENTRY + 1);
+
+		for(; first <= entry; first += BYTES_PER_ENTRY)
+		{
+			first[0] = 0xE5;
+		}
+	}
+
+	void FileSystem::markFATDirty(uint16_t cluster)
+	{
+		DirtyFATSectors[cluster * 2 / BytesPerSector] = true;
+	}
+
+	void FileSystem::markRootDirty(uint8_t* entry, unsigned int count)
+	{
+		unsigned int first = (entry - RootEntries) / BytesPerSector;
+		unsigned int last  = (entry - RootEntries + count * BYTES_PER_ENTRY - 1) / BytesPerSector;
+
+		for(unsigned int s = first; s <= last; s++)
+		{
+			DirtyRootSectors[s] = true;
+		}
+	}
+
 	void FileSystem::processRoot()
 	{
 		RootEntries = new uint8_t[this->RootEntryCount * BYTES_PER_ENTRY];
 
-		grabMutex();
+		grabExclusive();
 
 		int RootDirectorySectors = (this->RootEntryCount * BYTES_PER_ENTRY) / this->BytesPerSector;
 		for(int i = 0; i < RootDirectorySectors; i++)
@@ -141,7 +473,7 @@ extern "C"
 			readSector(this->ReservedSectorCount + (this->NumFATs * this->FATSize16) + i, RootEntries + (i * this->BytesPerSector), MAX_READ_SIZE);
 		}
 
-		releaseMutex();
+		releaseLock();
 
 		/*for(int i = 0; i < this->BytesPerSector * BYTES_PER_ENTRY; i += 32)
 		{
@@ -191,4 +523,48 @@ extern "C"
 		MachineFileWrite(this->fileDescriptor, this->base, size, fileHandler, (void*)currentThread);
 		waitForIO();
 	}
+
+	void FileSystem::readCluster(uint16_t clusterNum, uint8_t* data, bool seek)
+	{
+		ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+
+		if(seek)
+		{
+			unsigned int sector = this->FirstDataSector + (clusterNum - 2) * this->SectorsPerCluster;
+
+			MachineFileSeek(this->fileDescriptor, sector * this->BytesPerSector, 0, fileHandler, (void*)currentThread);
+			waitForIO();
+		}
+
+		for(unsigned int i = 0; i < this->SectorsPerCluster; i++)
+		{
+			MachineFileRead(this->fileDescriptor, this->base, MAX_READ_SIZE, fileHandler, (void*)currentThread);
+			waitForIO();
+
+			memcpy(data, this->base, MAX_READ_SIZE);
+			data += MAX_READ_SIZE;
+		}
+	}
+
+	void FileSystem::writeCluster(uint16_t clusterNum, uint8_t* data, bool seek)
+	{
+		ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+
+		if(seek)
+		{
+			unsigned int sector = this->FirstDataSector + (clusterNum - 2) * this->SectorsPerCluster;
+
+			MachineFileSeek(this->fileDescriptor, sector * this->BytesPerSector, 0, fileHandler, (void*)currentThread);
+			waitForIO();
+		}
+
+		for(unsigned int i = 0; i < this->SectorsPerCluster; i++)
+		{
+			memcpy(this->base, data, MAX_WRITE_SIZE);
+			data += MAX_WRITE_SIZE;
+
+			MachineFileWrite(this->fileDescriptor, this->base, MAX_WRITE_SIZE, fileHandler, (void*)currentThread);
+			waitForIO();
+		}
+	}
 }
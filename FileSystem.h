@@ -7,6 +7,9 @@
 #include "string.h"
 #include <iostream>
 #include <iomanip>
+#include <vector>
+#include <string>
+#include <unordered_map>
 using namespace std;
 
 #ifndef FILE_SYSTEM_H
@@ -21,6 +24,11 @@ extern "C"
     #define BYTES_PER_ENTRY 32
     #define SECTOR_SIZE     512
 
+    // Most long name entries a single file can have (255 characters, 13 per entry).
+    #define MAX_LFN_ENTRIES 20
+
+    #define NO_CLUSTER      0x0000 // Data clusters are numbered from 2.
+
     #define DIR_ATTR           11
     #define DIR_NTRES          12
     #define DIR_CRT_TIME_TENTH 13
@@ -41,16 +49,22 @@ extern "C"
     #define ATTR_ARCHIVE    0x20
     #define ATTR_LONG_NAME  (ATTR_READ_ONLY | ATTR_HIDDEN | ATTR_SYSTEM | ATTR_VOLUME_ID)
 
-    #define grabMutex()     VMMutexAcquire(FILE_SYSTEM_MUTEX, VM_TIMEOUT_INFINITE)
-    #define releaseMutex()  VMMutexRelease(FILE_SYSTEM_MUTEX)
+    // Cached data and metadata are read under a shared hold; device I/O,
+    // allocation and writeback need an exclusive one.
+    #define grabShared()    VMRWLockAcquireRead(FILE_SYSTEM_LOCK, VM_TIMEOUT_INFINITE)
+    #define grabExclusive() VMRWLockAcquireWrite(FILE_SYSTEM_LOCK, VM_TIMEOUT_INFINITE)
+    #define releaseLock()   VMRWLockRelease(FILE_SYSTEM_LOCK)
 
     extern ThreadControlBlock* currentThread;
-    extern TVMMutexID FILE_SYSTEM_MUTEX;
+    extern TVMRWLockID FILE_SYSTEM_LOCK;
 
     extern void waitForIO();
+    extern void getLFN(uint8_t** entry, char* outputBuffer);
     extern void fileHandler(void* calldata, int result);
 
-    typedef struct
+    class Journal;
+
+    typedef struct Directory
     {
         int dirdescriptor;  // Descriptor associated with the file.
         bool isRoot;        // Is it the root direcotry?
@@ -58,22 +72,69 @@ extern "C"
 
         uint16_t startingCluster; // Starting cluster of the directory.
         uint16_t currentCluster;  // Current cluster that we're reading fro
-        int currentSector;
+        unsigned int currentOffset; // Where in currentCluster the next entry is (subdirectories).
+
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
     } Directory;
 
-    typedef struct
+    // A file or directory inside a subdirectory, see DentryCache. entry is our copy
+    // of its short name entry, written back to the directory when it changes.
+    typedef struct Dentry
+    {
+        uint16_t parent;          // First cluster of the directory it's in.
+        uint16_t entryCluster;    // Directory cluster holding the short name entry,
+        uint16_t entryOffset;     // and where in it.
+        uint16_t firstCluster;    // Where its first entry (long name or short) is,
+        uint16_t firstOffset;
+        uint16_t numEntries;      // and how many entries it takes up in all.
+        uint8_t entry[BYTES_PER_ENTRY];
+        std::string longName;
+
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
+    } Dentry;
+
+    // A run of length clusters, contiguous on disk from firstCluster, holding
+    // the file's clusters from fileCluster on.
+    typedef struct FileExtent
+    {
+        uint32_t fileCluster;
+        uint16_t firstCluster;
+        uint32_t length;
+    } FileExtent;
+
+    typedef struct File
     {
         int filedescriptor;    // Descriptor associated with the file.
         unsigned int filePtr;  // The file pointer which keeps track of where in the file we are.
         int flags;             // The flags the file was opened with.
         int mode;              // The mode the file was opened with.
         uint8_t* entry;        // The entry for the file.
+        Dentry* dentry;        // Where entry came from outside the root, NULL in it.
+
+        unsigned int nextReadPtr;     // Where a read carrying on from the last one would start.
+        unsigned int readAheadWindow; // Clusters to read ahead, grows while reads stay sequential.
+
+        // The part of the file's cluster chain walked so far, see fileCluster.
+        std::vector<FileExtent> extents;
+        unsigned int extentHint; // Extent the last lookup landed in.
+
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
     } File;
 
-    typedef struct
+    // A slot in the cluster cache, see ClusterCache.
+    typedef struct Cluster
     {
         uint8_t* data;
-        uint16_t clusterNum;
+        uint16_t clusterNum;      // NO_CLUSTER while the slot is unused.
+        bool dirty;               // Changed since it was last written back.
+        bool referenced;          // Used since the clock hand last passed it.
+        struct Cluster* hashNext; // Next slot in the same hash bucket.
+
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
     } Cluster;
 
     class FileSystem
@@ -107,9 +168,29 @@ extern "C"
             // Fat Table.
             uint16_t* FatTable;
 
+            // Clusters the FAT can hand out (entries 0 and 1 are reserved), a bit
+            // per cluster that's set while it's free, and where the next search starts.
+            uint32_t NumClusters;
+            uint32_t* FreeMap;
+            uint32_t FreeCount;
+            uint32_t FreeHint;
+
             // All Entries in root.
             uint8_t* RootEntries;
 
+            // FAT and root sectors changed since the journal last committed, a bit per
+            // sector, so a commit only looks at (and a checkpoint only writes) those.
+            std::vector<bool> DirtyFATSectors;
+            std::vector<bool> DirtyRootSectors;
+
+            // Log of the FAT and directory changes not yet written back, see Journal.
+            Journal* journal;
+
+            // Root entries by long and by short (11 character, padded) name. Both point
+            // at the short name entry, the one with the file's cluster and size.
+            std::unordered_map<std::string, uint8_t*> LongNames;
+            std::unordered_map<std::string, uint8_t*> ShortNames;
+
         public:
             FileSystem(char* mount, int fileDescriptor, void* base, Scheduler* myScheduler);
             ~FileSystem();
@@ -120,9 +201,51 @@ extern "C"
             void processBPB();
             void processFAT();
             void processRoot();
+            void buildFreeMap();
+            void indexRoot();
+
+            // Adds or removes the names of the file whose short name entry is entry.
+            // longName can be NULL for a file without one.
+            void indexEntry(const char* longName, uint8_t* entry);
+            void unindexEntry(const char* longName, uint8_t* entry);
+
+            // Short name entry of the file called longName, or failing that whose short
+            // name is shortName (if it isn't NULL). NULL if there's no such file.
+            uint8_t* findEntry(const char* longName, const char* shortName);
+
+            // Frees the root entries of the file whose short name entry is entry, its
+            // long name ones too, and drops its names from the index.
+            void removeRootEntry(uint8_t* entry);
+
+            // Marks the FAT sector holding cluster's entry, or the root sectors holding
+            // the count entries starting at entry, dirty. Whatever changes either has
+            // to say so, or the change never reaches the image.
+            void markFATDirty(uint16_t cluster);
+            void markRootDirty(uint8_t* entry, unsigned int count);
+
+            bool clusterFree(uint32_t cluster);
+            void setClusterFree(uint32_t cluster, bool free);
+
+            // Start of the free run at or after from (wrapping around) that's at
+            // least count long, or failing that the first free run found. Its
+            // length, up to count, goes in length. 0 if nothing is free.
+            uint32_t findFreeRun(uint32_t from, uint32_t count, uint32_t* length);
+
+            // Allocates count clusters, as few runs as possible, and chains them on
+            // after prevCluster (unless it's NO_CLUSTER). Returns the first one, or
+            // 0xFFFF if there aren't count free clusters.
+            uint16_t allocateClusters(uint16_t prevCluster, uint32_t count);
+
+            // Frees the chain starting at cluster.
+            void freeChain(uint16_t cluster);
 
             void readSector(int sector, uint8_t* base, int size);
             void writeSector(int sector, uint8_t* base, int size);
+
+            // Whole cluster I/O. The seek can be skipped when the device is
+            // already positioned at the cluster (right after the one before it).
+            void readCluster(uint16_t clusterNum, uint8_t* data, bool seek);
+            void writeCluster(uint16_t clusterNum, uint8_t* data, bool seek);
     };
 }
 
@@ -0,0 +1,179 @@
+#include "FixedPool.h"
+#include <string.h>
+
+extern "C"
+{
+    FixedPool::FixedPool(void* base, TVMMemorySize size, TVMMemorySize objectSize, TVMMemoryPoolIDRef mid)
+        : BasePool(base, size, VM_MEMORY_POOL_GRANULE_MINIMUM, mid)
+    {
+        this->stride   = (objectSize + granuleSize - 1) & ~(granuleSize - 1);
+        this->numSlots = size / stride;
+
+        this->freeStack = new uint32_t[numSlots];
+        this->usedMap   = new uint64_t[(numSlots + 63) / 64];
+        memset(usedMap, 0, ((numSlots + 63) / 64) * sizeof(uint64_t));
+
+        // Lowest slot on top.
+        for(uint32_t i = 0; i < numSlots; i++)
+        {
+            freeStack[i] = numSlots - 1 - i;
+        }
+        this->freeCount = numSlots;
+    }
+
+    FixedPool::~FixedPool()
+    {
+        delete[] freeStack;
+        delete[] usedMap;
+    }
+
+    bool FixedPool::full()
+    {
+        return freeCount == 0;
+    }
+
+    bool FixedPool::contains(void* base)
+    {
+        return base >= mem_base && (uint8_t*)base < (uint8_t*)mem_base + (size_t)numSlots * stride;
+    }
+
+    bool FixedPool::allocate_memory(void** pointer, TVMMemorySize msize)
+    {
+        if(msize > stride || freeCount == 0)
+        {
+            return false;
+        }
+
+        uint32_t slot = freeStack[--freeCount];
+        usedMap[slot / 64] |= (1ULL << (slot % 64));
+
+        mem_remaining -= stride;
+        *pointer = (uint8_t*)mem_base + (size_t)slot * stride;
+        return true;
+    }
+
+    bool FixedPool::allocate_aligned(void** pointer, TVMMemorySize msize, TVMMemorySize alignment)
+    {
+        // Either every slot is aligned or we can't promise anything.
+        if(((uintptr_t)mem_base & (alignment - 1)) != 0 || (stride & (alignment - 1)) != 0)
+        {
+            return false;
+        }
+        return allocate_memory(pointer, msize);
+    }
+
+    void FixedPool::freeSpace(TVMMemorySize* largest, unsigned int* segments)
+    {
+        *largest  = (freeCount != 0) ? stride : 0;
+        *segments = freeCount;
+    }
+
+    uint32_t FixedPool::usedSlot(void* base)
+    {
+        if(!contains(base))
+        {
+            return numSlots;
+        }
+
+        size_t offset = (uint8_t*)base - (uint8_t*)mem_base;
+        uint32_t slot = offset / stride;
+
+        // Has to be the start of a slot that's actually handed out.
+        if(offset % stride != 0 || !(usedMap[slot / 64] & (1ULL << (slot % 64))))
+        {
+            return numSlots;
+        }
+        return slot;
+    }
+
+    bool FixedPool::deallocate_memory(void* base)
+    {
+        uint32_t slot = usedSlot(base);
+
+        if(slot == numSlots)
+        {
+            return false;
+        }
+
+        usedMap[slot / 64] &= ~(1ULL << (slot % 64));
+        freeStack[freeCount++] = slot;
+
+        mem_remaining += stride;
+        return true;
+    }
+
+    TVMMemorySize FixedPool::block_size(void* base)
+    {
+        return (usedSlot(base) == numSlots) ? 0 : stride;
+    }
+
+    bool FixedPool::resize_memory(void* base, TVMMemorySize msize)
+    {
+        return usedSlot(base) != numSlots && msize != 0 && msize <= stride;
+    }
+
+    ObjectSlab::ObjectSlab(TVMMemorySize objectSize, unsigned int chunkObjects)
+    {
+        this->objectSize   = objectSize;
+        this->chunkObjects = chunkObjects;
+        this->current      = 0;
+    }
+
+    ObjectSlab::~ObjectSlab()
+    {
+        for(unsigned int i = 0; i < chunks.size(); i++)
+        {
+            delete chunks[i];
+            delete[] chunkMemory[i];
+        }
+    }
+
+    void* ObjectSlab::allocate()
+    {
+        void* object;
+
+        if(current < chunks.size() && chunks[current]->allocate_memory(&object, objectSize))
+        {
+            return object;
+        }
+
+        for(current = 0; current < chunks.size(); current++)
+        {
+            if(!chunks[current]->full())
+            {
+                chunks[current]->allocate_memory(&object, objectSize);
+                return object;
+            }
+        }
+
+        // Everything's in use, add another chunk.
+        TVMMemorySize stride = (objectSize + VM_MEMORY_POOL_GRANULE_MINIMUM - 1) & ~(VM_MEMORY_POOL_GRANULE_MINIMUM - 1);
+        uint8_t* memory = new uint8_t[stride * chunkObjects];
+
+        chunkMemory.push_back(memory);
+        chunks.push_back(new FixedPool(memory, stride * chunkObjects, objectSize, NULL));
+        current = chunks.size() - 1;
+
+        chunks[current]->allocate_memory(&object, objectSize);
+        return object;
+    }
+
+    void ObjectSlab::deallocate(void* object)
+    {
+        if(object == NULL)
+        {
+            return;
+        }
+
+        // There are only ever a handful of chunks.
+        for(unsigned int i = 0; i < chunks.size(); i++)
+        {
+            if(chunks[i]->contains(object))
+            {
+                chunks[i]->deallocate_memory(object);
+                current = i;
+                return;
+            }
+        }
+    }
+}
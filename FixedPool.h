@@ -0,0 +1,68 @@
+#include "BasePool.h"
+#include <cstddef>
+#include <vector>
+
+#ifndef FIXED_POOL_H
+#define FIXED_POOL_H
+
+extern "C"
+{
+
+// Slab of equally sized slots. Free slots are kept on a stack so the most
+// recently freed (and most likely still cached) one is handed out first.
+class FixedPool : public BasePool
+{
+    private:
+        TVMMemorySize stride;   // Object size rounded up to the granule.
+        uint32_t numSlots;
+
+        uint32_t* freeStack;
+        uint32_t freeCount;
+        uint64_t* usedMap;      // Bit set for every slot that's handed out.
+
+        void freeSpace(TVMMemorySize* largest, unsigned int* segments);
+
+        // Slot that base is the start of, if it's handed out, otherwise numSlots.
+        uint32_t usedSlot(void* base);
+
+    public:
+        // mid may be NULL for slabs the VM keeps for itself (no pool ID is used up).
+        FixedPool(void* base, TVMMemorySize size, TVMMemorySize objectSize, TVMMemoryPoolIDRef mid);
+        ~FixedPool();
+
+        bool full();
+        bool contains(void* base);
+
+        bool allocate_memory(void** pointer, TVMMemorySize msize);
+        bool allocate_aligned(void** pointer, TVMMemorySize msize, TVMMemorySize alignment);
+        bool deallocate_memory(void* base);
+
+        TVMMemorySize block_size(void* base);
+        bool resize_memory(void* base, TVMMemorySize msize);
+};
+
+#define SLAB_CHUNK_OBJECTS 32
+
+// Grows a list of FixedPool chunks from the host heap so the VM's own objects
+// (threads, mutexes, open files...) come from slabs instead of malloc.
+class ObjectSlab
+{
+    private:
+        TVMMemorySize objectSize;
+        unsigned int chunkObjects;
+
+        std::vector<FixedPool*> chunks;
+        std::vector<uint8_t*> chunkMemory;
+        unsigned int current; // Chunk we last allocated from.
+
+    public:
+        ObjectSlab(TVMMemorySize objectSize, unsigned int chunkObjects);
+        ~ObjectSlab();
+
+        void* allocate();
+        void deallocate(void* object);
+};
+
+}
+
+#endif
@@ -0,0 +1,509 @@
+#include "Journal.h"
+#include <string>
+
+extern "C"
+{
+    static uint32_t checksum(const uint8_t* data, uint32_t length)
+    {
+        // FNV-1a, enough to tell a torn or stale transaction from a whole one.
+        uint32_t hash = 2166136261U;
+
+        for(uint32_t i = 0; i < length; i++)
+        {
+            hash = (hash ^ data[i]) * 16777619U;
+        }
+
+        return hash;
+    }
+
+    static void put16(std::vector<uint8_t>& records, uint16_t value)
+    {
+        records.push_back(value & 0xFF);
+        records.push_back(value >> 8);
+    }
+
+    Journal::Journal(FileSystem* fileSystem, Scheduler* myScheduler)
+    {
+        this->fileSystem  = fileSystem;
+        this->myScheduler = myScheduler;
+
+        unsigned int fatEntries  = fileSystem->FATSize16 * fileSystem->BytesPerSector / 2;
+        unsigned int rootBytes   = fileSystem->RootEntryCount * BYTES_PER_ENTRY;
+        unsigned int rootSectors = rootBytes / fileSystem->BytesPerSector;
+
+        committedFAT  = new uint16_t[fatEntries];
+        committedRoot = new uint8_t[rootBytes];
+
+        staleFATSectors.assign(fileSystem->FATSize16, false);
+        staleRootSectors.assign(rootSectors, false);
+
+        sequence = 1;
+        tail     = 0;
+
+        std::string name = std::string(fileSystem->mount) + ".journal";
+
+        grabExclusive();
+
+        ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+        MachineFileOpen(name.c_str(), O_RDWR | O_CREAT, 0600, fileHandler, (void*)currentThread);
+        waitForIO();
+
+        // Without a log the image is still written back at checkpoints, just not crash safe.
+        fileDescriptor = currentThread->getResult();
+
+        // Replay every whole transaction in sequence from the start of the log.
+        bool replayed = false;
+        uint32_t offset = 0;
+
+        while(fileDescriptor >= 0)
+        {
+            readBlock(offset);
+
+            JournalHeader header;
+            memcpy(&header, fileSystem->base, sizeof(header));
+
+            if(header.magic != JOURNAL_MAGIC || (offset != 0 && header.sequence != sequence) ||
+               header.length > JOURNAL_MAX_TRANSACTION_BYTES)
+            {
+                break;
+            }
+
+            std::vector<uint8_t> records(sizeof(header) + header.length);
+            uint32_t copied = 0;
+
+            while(copied < records.size())
+            {
+                if(copied != 0)
+                {
+                    readBlock(offset + copied);
+                }
+
+                uint32_t chunk = records.size() - copied;
+                if(chunk > SECTOR_SIZE)
+                {
+                    chunk = SECTOR_SIZE;
+                }
+
+                memcpy(&records[copied], fileSystem->base, chunk);
+                copied += chunk;
+            }
+
+            if(checksum(&records[sizeof(header)], header.length) != header.checksum ||
+               !replay(&records[sizeof(header)], header.length))
+            {
+                break;
+            }
+
+            replayed = replayed || (header.length != 0);
+            sequence = header.sequence + 1;
+            offset  += (records.size() + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        }
+
+        memcpy(committedFAT, fileSystem->FatTable, fatEntries * sizeof(uint16_t));
+        memcpy(committedRoot, fileSystem->RootEntries, rootBytes);
+
+        // Get what was replayed onto the image, and leave a log that starts after it.
+        if(replayed)
+        {
+            checkpoint();
+        }
+        else
+        {
+            reset();
+        }
+
+        releaseLock();
+    }
+
+    Journal::~Journal()
+    {
+        if(fileDescriptor >= 0)
+        {
+            grabExclusive();
+
+            MachineFileClose(fileDescriptor, fileHandler, (void*)myScheduler->getCurrentThread());
+            waitForIO();
+
+            releaseLock();
+        }
+
+        delete[] committedFAT;
+        delete[] committedRoot;
+    }
+
+    void Journal::readBlock(uint32_t offset)
+    {
+        ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+
+        // Past the end of the log reads as nothing, which no header matches.
+        memset(fileSystem->base, 0, SECTOR_SIZE);
+
+        MachineFileSeek(fileDescriptor, offset, 0, fileHandler, (void*)currentThread);
+        waitForIO();
+
+        MachineFileRead(fileDescriptor, fileSystem->base, SECTOR_SIZE, fileHandler, (void*)currentThread);
+        waitForIO();
+    }
+
+    void Journal::writeBlocks(uint32_t offset, const uint8_t* data, uint32_t length)
+    {
+        if(fileDescriptor < 0)
+        {
+            return;
+        }
+
+        ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+
+        // One seek, then the sectors go out back to back.
+        MachineFileSeek(fileDescriptor, offset, 0, fileHandler, (void*)currentThread);
+        waitForIO();
+
+        for(uint32_t done = 0; done < length; done += SECTOR_SIZE)
+        {
+            uint32_t chunk = (length - done < SECTOR_SIZE) ? length - done : SECTOR_SIZE;
+
+            memset(fileSystem->base, 0, SECTOR_SIZE);
+            memcpy(fileSystem->base, data + done, chunk);
+
+            MachineFileWrite(fileDescriptor, fileSystem->base, SECTOR_SIZE, fileHandler, (void*)currentThread);
+            waitForIO();
+        }
+    }
+
+    bool Journal::replay(const uint8_t* records, uint32_t length)
+    {
+        unsigned int clusterSize = fileSystem->SectorsPerCluster * fileSystem->BytesPerSector;
+        unsigned int fatEntries  = fileSystem->FATSize16 * fileSystem->BytesPerSector / 2;
+        const uint8_t* end = records + length;
+
+        while(records < end)
+        {
+            uint8_t type = records[0];
+
+            if(type == JOURNAL_FAT && end - records >= 5)
+            {
+                uint16_t first = records[1] | (records[2] << 8);
+                uint16_t count = records[3] | (records[4] << 8);
+                records += 5;
+
+                if(end - records < count * 2 || first + count > fatEntries)
+                {
+                    return false;
+                }
+
+                memcpy(fileSystem->FatTable + first, records, count * 2);
+                records += count * 2;
+
+                for(unsigned int i = first; i < (unsigned int)first + count; i++)
+                {
+                    staleFATSectors[i * 2 / fileSystem->BytesPerSector] = true;
+                }
+            }
+            else if(type == JOURNAL_ROOT && end - records >= 3 + BYTES_PER_ENTRY)
+            {
+                uint16_t index = records[1] | (records[2] << 8);
+                records += 3;
+
+                if(index >= fileSystem->RootEntryCount)
+                {
+                    return false;
+                }
+
+                memcpy(fileSystem->RootEntries + index * BYTES_PER_ENTRY, records, BYTES_PER_ENTRY);
+                records += BYTES_PER_ENTRY;
+
+                staleRootSectors[index * BYTES_PER_ENTRY / fileSystem->BytesPerSector] = true;
+            }
+            else if(type == JOURNAL_ENTRY && end - records >= 7)
+            {
+                uint16_t cluster = records[1] | (records[2] << 8);
+                uint16_t offset  = records[3] | (records[4] << 8);
+                uint16_t count   = records[5] | (records[6] << 8);
+                records += 7;
+
+                if(end - records < count * BYTES_PER_ENTRY || offset + count * BYTES_PER_ENTRY > (int)clusterSize || cluster < 2)
+                {
+                    return false;
+                }
+
+                // Straight onto the image, a sector at a time.
+                unsigned int sector = fileSystem->FirstDataSector + (cluster - 2) * fileSystem->SectorsPerCluster;
+                uint8_t data[SECTOR_SIZE];
+
+                for(unsigned int i = 0; i < count; i++)
+                {
+                    unsigned int at = offset + i * BYTES_PER_ENTRY;
+
+                    fileSystem->readSector(sector + at / SECTOR_SIZE, data, SECTOR_SIZE);
+                    memcpy(data + at % SECTOR_SIZE, records, BYTES_PER_ENTRY);
+                    fileSystem->writeSector(sector + at / SECTOR_SIZE, data, SECTOR_SIZE);
+
+                    records += BYTES_PER_ENTRY;
+                }
+            }
+            else if(type == JOURNAL_ZERO && end - records >= 3)
+            {
+                uint16_t cluster = records[1] | (records[2] << 8);
+                records += 3;
+
+                if(cluster < 2)
+                {
+                    return false;
+                }
+
+                uint8_t* zeros = new uint8_t[clusterSize];
+                memset(zeros, 0, clusterSize);
+                fileSystem->writeCluster(cluster, zeros, true);
+                delete[] zeros;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void Journal::reset()
+    {
+        JournalHeader header = {JOURNAL_MAGIC, sequence, 0, checksum(NULL, 0)};
+
+        writeBlocks(0, (const uint8_t*)&header, sizeof(header));
+
+        sequence++;
+        tail = SECTOR_SIZE;
+    }
+
+    void Journal::logEntries(uint16_t cluster, unsigned int offset, const uint8_t* entries, unsigned int count)
+    {
+        for(unsigned int i = 0; i < count; i++)
+        {
+            uint32_t key = (uint32_t)cluster << 16 | (offset + i * BYTES_PER_ENTRY);
+            std::map<uint32_t, uint32_t>::iterator it = pending.find(key);
+
+            if(it == pending.end())
+            {
+                it = pending.insert(std::make_pair(key, (uint32_t)pendingEntries.size())).first;
+                pendingEntries.resize(pendingEntries.size() + BYTES_PER_ENTRY);
+            }
+
+            memcpy(&pendingEntries[it->second], entries + i * BYTES_PER_ENTRY, BYTES_PER_ENTRY);
+        }
+
+        pendingClusters.insert(cluster);
+
+        commitIfFull();
+    }
+
+    void Journal::logZero(uint16_t cluster)
+    {
+        // Whatever was logged for it before is wiped out by the zeros, which replay first.
+        pending.erase(pending.lower_bound((uint32_t)cluster << 16), pending.lower_bound((uint32_t)(cluster + 1) << 16));
+
+        pendingZeros.push_back(cluster);
+        pendingClusters.insert(cluster);
+
+        commitIfFull();
+    }
+
+    void Journal::commitIfFull()
+    {
+        // At worst a record per entry. This can split an operation across two
+        // transactions, which only matters if we go down right between them.
+        if(pending.size() * (7 + BYTES_PER_ENTRY) + pendingZeros.size() * 3 >= JOURNAL_PENDING_BYTES)
+        {
+            commit();
+        }
+    }
+
+    void Journal::protect(uint16_t clusterNum)
+    {
+        if(pendingClusters.find(clusterNum) != pendingClusters.end())
+        {
+            commit();
+        }
+    }
+
+    void Journal::commit()
+    {
+        // Room for the header, filled in once the records are all there.
+        std::vector<uint8_t> records(sizeof(JournalHeader));
+
+        // Directory cluster records go first, zeroed clusters before the entries in them.
+        for(unsigned int i = 0; i < pendingZeros.size(); i++)
+        {
+            records.push_back(JOURNAL_ZERO);
+            put16(records, pendingZeros[i]);
+        }
+
+        // Then the entries, entries next to each other in a cluster as one record.
+        std::map<uint32_t, uint32_t>::iterator it = pending.begin();
+
+        while(it != pending.end())
+        {
+            uint16_t cluster = it->first >> 16;
+            uint16_t offset  = it->first & 0xFFFF;
+            uint16_t count   = 0;
+
+            records.push_back(JOURNAL_ENTRY);
+            put16(records, cluster);
+            put16(records, offset);
+
+            size_t countAt = records.size();
+            put16(records, 0);
+
+            do
+            {
+                records.insert(records.end(), &pendingEntries[it->second], &pendingEntries[it->second] + BYTES_PER_ENTRY);
+                count++;
+                it++;
+            }
+            while(it != pending.end() && it->first == ((uint32_t)cluster << 16 | (offset + count * BYTES_PER_ENTRY)));
+
+            records[countAt]     = count & 0xFF;
+            records[countAt + 1] = count >> 8;
+        }
+
+        // Then whatever differs from the last commit, only looking at the sectors marked dirty since.
+        unsigned int perSector = fileSystem->BytesPerSector / 2;
+
+        for(unsigned int s = 0; s < staleFATSectors.size(); s++)
+        {
+            if(!fileSystem->DirtyFATSectors[s])
+            {
+                continue;
+            }
+
+            fileSystem->DirtyFATSectors[s] = false;
+
+            uint16_t* live      = fileSystem->FatTable + s * perSector;
+            uint16_t* committed = committedFAT + s * perSector;
+
+            if(memcmp(live, committed, fileSystem->BytesPerSector) == 0)
+            {
+                continue;
+            }
+
+            staleFATSectors[s] = true;
+
+            // One run from the first changed entry to the last, so a sector never takes more than its size.
+            unsigned int first = 0;
+            unsigned int last  = perSector - 1;
+
+            while(live[first] == committed[first])
+            {
+                first++;
+            }
+
+            while(live[last] == committed[last])
+            {
+                last--;
+            }
+
+            records.push_back(JOURNAL_FAT);
+            put16(records, s * perSector + first);
+            put16(records, last - first + 1);
+
+            for(unsigned int j = first; j <= last; j++)
+            {
+                put16(records, live[j]);
+            }
+
+            memcpy(committed, live, fileSystem->BytesPerSector);
+        }
+
+        unsigned int perRootSector = fileSystem->BytesPerSector / BYTES_PER_ENTRY;
+
+        for(unsigned int s = 0; s < staleRootSectors.size(); s++)
+        {
+            if(!fileSystem->DirtyRootSectors[s])
+            {
+                continue;
+            }
+
+            fileSystem->DirtyRootSectors[s] = false;
+
+            uint8_t* live      = fileSystem->RootEntries + s * fileSystem->BytesPerSector;
+            uint8_t* committed = committedRoot + s * fileSystem->BytesPerSector;
+
+            if(memcmp(live, committed, fileSystem->BytesPerSector) == 0)
+            {
+                continue;
+            }
+
+            staleRootSectors[s] = true;
+
+            for(unsigned int i = 0; i < perRootSector; i++)
+            {
+                if(memcmp(live + i * BYTES_PER_ENTRY, committed + i * BYTES_PER_ENTRY, BYTES_PER_ENTRY) != 0)
+                {
+                    records.push_back(JOURNAL_ROOT);
+                    put16(records, s * perRootSector + i);
+                    records.insert(records.end(), live + i * BYTES_PER_ENTRY, live + (i + 1) * BYTES_PER_ENTRY);
+                }
+            }
+
+            memcpy(committed, live, fileSystem->BytesPerSector);
+        }
+
+        pending.clear();
+        pendingEntries.clear();
+        pendingZeros.clear();
+        pendingClusters.clear();
+
+        if(records.size() == sizeof(JournalHeader))
+        {
+            return;
+        }
+
+        JournalHeader header;
+        header.magic    = JOURNAL_MAGIC;
+        header.sequence = sequence;
+        header.length   = records.size() - sizeof(header);
+        header.checksum = checksum(&records[sizeof(header)], header.length);
+        memcpy(&records[0], &header, sizeof(header));
+
+        writeBlocks(tail, &records[0], records.size());
+
+        sequence++;
+        tail += (records.size() + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    }
+
+    uint32_t Journal::size()
+    {
+        return tail;
+    }
+
+    void Journal::checkpoint()
+    {
+        commit();
+
+        uint8_t* fat = (uint8_t*)committedFAT;
+
+        for(unsigned int s = 0; s < staleFATSectors.size(); s++)
+        {
+            if(staleFATSectors[s])
+            {
+                for(unsigned int copy = 0; copy < fileSystem->NumFATs; copy++)
+                {
+                    fileSystem->writeSector(fileSystem->ReservedSectorCount + copy * fileSystem->FATSize16 + s,
+                                            fat + s * fileSystem->BytesPerSector, MAX_WRITE_SIZE);
+                }
+
+                staleFATSectors[s] = false;
+            }
+        }
+
+        for(unsigned int s = 0; s < staleRootSectors.size(); s++)
+        {
+            if(staleRootSectors[s])
+            {
+                fileSystem->writeSector(fileSystem->FirstRootSector + s, committedRoot + s * fileSystem->BytesPerSector, MAX_WRITE_SIZE);
+                staleRootSectors[s] = false;
+            }
+        }
+
+        reset();
+    }
+}
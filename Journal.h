@@ -0,0 +1,115 @@
+#include "FileSystem.h"
+#include <vector>
+#include <map>
+#include <unordered_set>
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+extern "C"
+{
+
+// Every transaction in the log starts with a header, on a sector boundary.
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+
+// Size the log can grow to before the flusher checkpoints it.
+#define JOURNAL_CHECKPOINT_BYTES (64 * 1024)
+
+// Largest transaction replay accepts, anything bigger is taken to be garbage.
+#define JOURNAL_MAX_TRANSACTION_BYTES (4 * JOURNAL_CHECKPOINT_BYTES)
+
+// Directory records held before they're committed without waiting for the flusher.
+// With the FAT and root diffs (at most a run per sector each) a transaction stays
+// well under JOURNAL_MAX_TRANSACTION_BYTES.
+#define JOURNAL_PENDING_BYTES JOURNAL_CHECKPOINT_BYTES
+
+// Record types. Each is the type byte followed by its fields, packed.
+#define JOURNAL_FAT   'F' // uint16 first cluster, uint16 count, count FAT entries.
+#define JOURNAL_ROOT  'R' // uint16 root entry index, the entry.
+#define JOURNAL_ENTRY 'D' // uint16 directory cluster, uint16 offset, uint16 count, count entries.
+#define JOURNAL_ZERO  'Z' // uint16 cluster, a directory cluster that starts out as zeros.
+
+typedef struct JournalHeader
+{
+    uint32_t magic;
+    uint32_t sequence; // One more than the transaction before it.
+    uint32_t length;   // Bytes of records following the header.
+    uint32_t checksum; // Of the records.
+} JournalHeader;
+
+// Write-ahead redo log of the file system's metadata, kept in a file next to
+// the image. commit appends everything that changed in the FAT and root sectors
+// marked dirty since the last commit, along with the subdirectory entry changes logged
+// through logEntries, as one transaction written in a single sequential run.
+// checkpoint writes the committed FAT and root sectors back to the image and
+// starts the log over. Mounting replays whatever was committed but not yet
+// checkpointed. Everything here must be called with the file system lock held
+// exclusively.
+class Journal
+{
+    private:
+        FileSystem* fileSystem;
+        Scheduler* myScheduler;
+
+        int fileDescriptor;
+        uint32_t sequence; // Of the next transaction.
+        uint32_t tail;     // Where the next transaction goes.
+
+        // The FAT and root as of the last commit.
+        uint16_t* committedFAT;
+        uint8_t* committedRoot;
+
+        // Sectors whose committed contents haven't been checkpointed to the image yet.
+        std::vector<bool> staleFATSectors;
+        std::vector<bool> staleRootSectors;
+
+        // Directory entries logged since the last commit, latest contents only: the entry
+        // at offset in cluster, keyed by cluster << 16 | offset, is the BYTES_PER_ENTRY
+        // bytes at its value in pendingEntries. Clusters logged as zeroed go in pendingZeros.
+        std::map<uint32_t, uint32_t> pending;
+        std::vector<uint8_t> pendingEntries;
+        std::vector<uint16_t> pendingZeros;
+        std::unordered_set<uint16_t> pendingClusters;
+
+        // Commits once the directory records would make too big a transaction.
+        void commitIfFull();
+
+        void readBlock(uint32_t offset);
+        void writeBlocks(uint32_t offset, const uint8_t* data, uint32_t length);
+
+        // Applies a committed transaction's records while mounting. False if they don't parse.
+        bool replay(const uint8_t* records, uint32_t length);
+
+        // Starts the log over with an empty transaction.
+        void reset();
+
+    public:
+        // Opens (creating it if need be) the log for the image and replays it.
+        // Needs the FAT and root read in, and the data area located.
+        Journal(FileSystem* fileSystem, Scheduler* myScheduler);
+        ~Journal();
+
+        // Logs count directory entries, as they are now, at offset in cluster. Entries
+        // logged again before a commit replace what was logged for them before.
+        void logEntries(uint16_t cluster, unsigned int offset, const uint8_t* entries, unsigned int count);
+
+        // Logs that cluster was just filled with zeros to become part of a directory.
+        void logZero(uint16_t cluster);
+
+        // Commits if clusterNum has logged changes that aren't committed, so a
+        // directory cluster never reaches the image ahead of its records.
+        void protect(uint16_t clusterNum);
+
+        void commit();
+
+        // Committed but not checkpointed bytes.
+        uint32_t size();
+
+        // Commits, then writes back the FAT (every copy) and root sectors changed since
+        // the last checkpoint. Directory clusters must have been flushed in between.
+        void checkpoint();
+};
+
+}
+
+#endif
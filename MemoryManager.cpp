@@ -20,14 +20,24 @@ extern "C"
         waitingQueue[3].clear();
     }
 
-    void MemoryManager::add_pool(void* base, TVMMemorySize size, TVMMemoryPoolIDRef mid)
+    void MemoryManager::add_pool(void* base, TVMMemorySize size, TVMMemorySize granule, TVMMemoryPoolIDRef mid)
     {
-        pools.push_back(new MemoryPool(base, size, mid));
+        pools.push_back(new MemoryPool(base, size, granule, mid));
     }
 
-    MemoryPool* MemoryManager::find_pool(TVMMemoryPoolID mid)
+    void MemoryManager::add_arena(void* base, TVMMemorySize size, TVMMemoryPoolIDRef mid)
     {
-        MemoryPool* mpool = NULL;
+        pools.push_back(new ArenaPool(base, size, mid));
+    }
+
+    void MemoryManager::add_fixed(void* base, TVMMemorySize size, TVMMemorySize objectSize, TVMMemoryPoolIDRef mid)
+    {
+        pools.push_back(new FixedPool(base, size, objectSize, mid));
+    }
+
+    BasePool* MemoryManager::find_pool(TVMMemoryPoolID mid)
+    {
+        BasePool* mpool = NULL;
 
         for(auto it = pools.begin(); it != pools.end(); ++it)
         {
@@ -54,9 +64,172 @@ extern "C"
 
     }
 
-    void MemoryManager::addToMemoryQueue(ThreadControlBlock* thread)
+    bool MemoryManager::cache_allocate(ThreadControlBlock* thread, BasePool* pool, TVMMemorySize size, void** pointer)
+    {
+        TVMMemorySize granule = pool->getGranule();
+
+        if(thread == NULL || size > MAGAZINE_MAX_GRANULES * granule)
+        {
+            return false;
+        }
+
+        uint32_t length = (size + granule - 1) / granule;
+        std::vector<MemoryMagazine>& magazines = thread->getMagazines();
+
+        for(auto it = magazines.begin(); it != magazines.end(); ++it)
+        {
+            if(it->pool == pool->getMemID() && it->length == length)
+            {
+                if(it->count == 0)
+                {
+                    return false;
+                }
+
+                *pointer = it->blocks[--(it->count)];
+                pool->set_cached(*pointer, false);
+                pool->countCached((TVMMemorySize)length * granule, false);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool MemoryManager::cache_deallocate(ThreadControlBlock* thread, BasePool* pool, void* base)
+    {
+        if(thread == NULL)
+        {
+            return false;
+        }
+
+        uint32_t length = pool->block_length(base);
+
+        // Not a live block, or too big to be worth caching.
+        if(length == 0 || length > MAGAZINE_MAX_GRANULES)
+        {
+            return false;
+        }
+
+        std::vector<MemoryMagazine>& magazines = thread->getMagazines();
+        MemoryMagazine* magazine = NULL;
+
+        for(auto it = magazines.begin(); it != magazines.end(); ++it)
+        {
+            if(it->pool == pool->getMemID() && it->length == length)
+            {
+                magazine = &(*it);
+                break;
+            }
+        }
+
+        if(magazine == NULL)
+        {
+            MemoryMagazine empty;
+            empty.pool   = pool->getMemID();
+            empty.length = length;
+            empty.count  = 0;
+
+            if(magazines.empty())
+            {
+                cachingThreads.push_back(thread);
+            }
+            magazines.push_back(empty);
+            magazine = &magazines.back();
+        }
+
+        if(magazine->count == MAGAZINE_SIZE)
+        {
+            return false;
+        }
+
+        magazine->blocks[(magazine->count)++] = base;
+        pool->set_cached(base, true);
+        pool->countCached((TVMMemorySize)length * pool->getGranule(), true);
+        return true;
+    }
+
+    void MemoryManager::release_magazine(MemoryMagazine& magazine)
     {
-        waitingQueue[thread->getPriority()].push_back(thread);
+        BasePool* pool = find_pool(magazine.pool);
+
+        for(unsigned int i = 0; i < magazine.count; i++)
+        {
+            pool->set_cached(magazine.blocks[i], false);
+            pool->deallocate_memory(magazine.blocks[i]);
+        }
+        pool->countCached((TVMMemorySize)magazine.count * magazine.length * pool->getGranule(), false);
+        magazine.count = 0;
+    }
+
+    void MemoryManager::stop_caching(ThreadControlBlock* thread)
+    {
+        for(auto it = cachingThreads.begin(); it != cachingThreads.end(); ++it)
+        {
+            if((*it) == thread)
+            {
+                cachingThreads.erase(it);
+                return;
+            }
+        }
+    }
+
+    void MemoryManager::flush_thread(ThreadControlBlock* thread)
+    {
+        std::vector<MemoryMagazine>& magazines = thread->getMagazines();
+
+        if(magazines.empty())
+        {
+            return;
+        }
+
+        for(auto it = magazines.begin(); it != magazines.end(); ++it)
+        {
+            release_magazine(*it);
+        }
+        magazines.clear();
+        stop_caching(thread);
+    }
+
+    void MemoryManager::flush_pool(TVMMemoryPoolID mid)
+    {
+        for(unsigned int i = 0; i < cachingThreads.size(); )
+        {
+            ThreadControlBlock* thread = cachingThreads[i];
+            std::vector<MemoryMagazine>& magazines = thread->getMagazines();
+
+            for(auto it = magazines.begin(); it != magazines.end(); )
+            {
+                if(it->pool == mid)
+                {
+                    release_magazine(*it);
+                    it = magazines.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+
+            if(magazines.empty())
+            {
+                stop_caching(thread);
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    void MemoryManager::addToMemoryQueue(ThreadControlBlock* thread, TVMMemoryPoolID mid, TVMMemorySize size,
+                                         void** pointer)
+    {
+        MemoryWaiter waiter;
+        waiter.thread  = thread;
+        waiter.pool    = mid;
+        waiter.size    = size;
+        waiter.pointer = pointer;
+
+        waitingQueue[thread->getPriority()].push_back(waiter);
     }
 
     void MemoryManager::removeFromMemoryQueue(TVMThreadID tid)
@@ -65,28 +238,70 @@ extern "C"
         {
             for(unsigned int j = 0; j < waitingQueue[i].size(); j++)
             {
-                if(tid == waitingQueue[i][j]->getTID())
+                if(tid == waitingQueue[i][j].thread->getTID())
                 {
                     waitingQueue[i].erase(waitingQueue[i].begin() + j);
+                    return;
                 }
             }
         }
     }
 
-    ThreadControlBlock* MemoryManager::getNext()
+    void MemoryManager::grant_waiters(BasePool* pool, std::vector<ThreadControlBlock*>& granted)
     {
-        ThreadControlBlock* nextThread = NULL;
+        bool flushed = false;
 
         for(int i = VM_THREAD_PRIORITY_HIGH; i >= 0; i--)
         {
-            if(!(waitingQueue[i].empty()))
+            // A request that doesn't fit doesn't hold back smaller ones behind it.
+            for(auto it = waitingQueue[i].begin(); it != waitingQueue[i].end(); )
             {
-                nextThread = waitingQueue[i].front();
-                waitingQueue[i].erase(waitingQueue[i].begin());
-                break;
+                if(it->pool != pool->getMemID())
+                {
+                    ++it;
+                    continue;
+                }
+
+                bool allocated = pool->allocate_memory(it->pointer, it->size);
+
+                // The space might be sitting in someone's magazine.
+                if(!allocated && !flushed)
+                {
+                    flush_pool(pool->getMemID());
+                    flushed = true;
+                    allocated = pool->allocate_memory(it->pointer, it->size);
+                }
+
+                if(allocated)
+                {
+                    pool->countAllocation(it->size);
+                    granted.push_back(it->thread);
+                    it = waitingQueue[i].erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
             }
         }
+    }
 
-        return nextThread;
+    void MemoryManager::drop_waiters(TVMMemoryPoolID mid, std::vector<ThreadControlBlock*>& dropped)
+    {
+        for(int i = VM_THREAD_PRIORITY_HIGH; i >= 0; i--)
+        {
+            for(auto it = waitingQueue[i].begin(); it != waitingQueue[i].end(); )
+            {
+                if(it->pool == mid)
+                {
+                    dropped.push_back(it->thread);
+                    it = waitingQueue[i].erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
     }
 }
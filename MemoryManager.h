@@ -1,4 +1,6 @@
 #include "MemoryPool.h"
+#include "ArenaPool.h"
+#include "FixedPool.h"
 #include "ThreadControlBlock.h"
 #include <cstddef>
 #include <vector>
@@ -11,23 +13,54 @@ extern "C"
 
 #define NUM_MEMORY_QUEUES 4
 
+// A thread blocked until size bytes can be allocated from pool. The block is
+// allocated on its behalf and stored through pointer before it's woken.
+typedef struct
+{
+    ThreadControlBlock* thread;
+    TVMMemoryPoolID pool;
+    TVMMemorySize size;
+    void** pointer;
+} MemoryWaiter;
+
 class MemoryManager
 {
     private:
-        std::vector<MemoryPool*> pools;
-        std::vector<ThreadControlBlock*> waitingQueue[NUM_MEMORY_QUEUES];
+        std::vector<BasePool*> pools;
+        std::vector<MemoryWaiter> waitingQueue[NUM_MEMORY_QUEUES];
+        std::vector<ThreadControlBlock*> cachingThreads; // Threads with blocks in a magazine.
+
+        void release_magazine(MemoryMagazine& magazine);
+        void stop_caching(ThreadControlBlock* thread);
 
     public:
        MemoryManager();
        ~MemoryManager();
 
-       void add_pool(void* base, TVMMemorySize size, TVMMemoryPoolIDRef mid);
-       MemoryPool* find_pool(TVMMemoryPoolID mid);
+       void add_pool(void* base, TVMMemorySize size, TVMMemorySize granule, TVMMemoryPoolIDRef mid);
+       void add_arena(void* base, TVMMemorySize size, TVMMemoryPoolIDRef mid);
+       void add_fixed(void* base, TVMMemorySize size, TVMMemorySize objectSize, TVMMemoryPoolIDRef mid);
+       BasePool* find_pool(TVMMemoryPoolID mid);
        void delete_pool(TVMMemoryPoolID mid);
 
-       void addToMemoryQueue(ThreadControlBlock* thread);
+       // Per thread magazines of small freed blocks. Both return false when the
+       // request has to go to the pool itself.
+       bool cache_allocate(ThreadControlBlock* thread, BasePool* pool, TVMMemorySize size, void** pointer);
+       bool cache_deallocate(ThreadControlBlock* thread, BasePool* pool, void* base);
+
+       // Return cached blocks to their pools.
+       void flush_thread(ThreadControlBlock* thread);
+       void flush_pool(TVMMemoryPoolID mid);
+
+       void addToMemoryQueue(ThreadControlBlock* thread, TVMMemoryPoolID mid, TVMMemorySize size, void** pointer);
        void removeFromMemoryQueue(TVMThreadID tid);
-       ThreadControlBlock* getNext();
+
+       // Allocates for every waiter on the pool whose request fits now, in priority
+       // order, and appends them to granted (highest priority first).
+       void grant_waiters(BasePool* pool, std::vector<ThreadControlBlock*>& granted);
+
+       // Takes every waiter off a pool that's going away.
+       void drop_waiters(TVMMemoryPoolID mid, std::vector<ThreadControlBlock*>& dropped);
 };
 
 }
@@ -1,218 +1,487 @@
 #include "MemoryPool.h"
+#include <string.h>
 #include <iostream>
 using namespace std;
 
 extern "C"
 {
-    static TVMMemoryPoolID nextMemID = 1;
-
-    MemoryPool::MemoryPool(void* base, TVMMemorySize size, TVMMemoryPoolIDRef mid)
+    MemoryPool::MemoryPool(void* base, TVMMemorySize size, TVMMemorySize granule, TVMMemoryPoolIDRef mid)
+        : BasePool(base, size, granule, mid)
     {
-        // Create Memory pool.
-        this->mem_id   = nextMemID++;
-        this->mem_base = base;
-        this->mem_size = size;
+        // A tail shorter than a granule can never be handed out, but still
+        // counts as free space like it always has.
+        this->granuleShift  = __builtin_ctz(granule);
+        this->numGranules   = size >> granuleShift;
 
-        *mid = this->mem_id;
+        this->numLeaves = (numGranules + LEAF_GRANULES - 1) / LEAF_GRANULES;
+        this->leaves    = new TagLeaf*[numLeaves];
+        this->spareLeaf = NULL;
+        memset(leaves, 0, numLeaves * sizeof(TagLeaf*));
 
-        // Create new free segment (entire memory pool).
-        MemorySegment* segment = new MemorySegment;
-        segment->base = this->mem_base;
-        segment->size = this->mem_size;
-        segment->next = NEXT_BLOCK;
+        for(unsigned int i = 0; i < NUM_SIZE_CLASSES; i++)
+        {
+            binHead[i] = NO_GRANULE;
+        }
+        memset(binMap, 0, sizeof(binMap));
+        freeSegments = 0;
 
-        this->mem_free.push_back(segment);
+        // Create new free segment (entire memory pool).
+        if(numGranules != 0)
+        {
+            insertFree(0, numGranules);
+        }
     }
 
     MemoryPool::~MemoryPool()
     {
-        for(auto it = mem_free.begin(); it != mem_free.end(); ++it)
+        for(uint32_t i = 0; i < numLeaves; i++)
         {
-            delete (*it);
+            delete leaves[i];
         }
-        mem_free.clear();
-		
-        for(auto it = mem_alloc.begin(); it != mem_alloc.end(); ++it)
+        delete[] leaves;
+        delete spareLeaf;
+    }
+
+    uint32_t MemoryPool::getTag(uint32_t granule)
+    {
+        TagLeaf* leaf = leaves[granule >> LEAF_BITS];
+        return leaf ? leaf->tags[granule & LEAF_MASK] : 0;
+    }
+
+    void MemoryPool::setTag(uint32_t granule, uint32_t tag)
+    {
+        TagLeaf*& leaf = leaves[granule >> LEAF_BITS];
+
+        if(leaf == NULL)
+        {
+            if(tag == 0)
+            {
+                return;
+            }
+
+            if(spareLeaf != NULL)
+            {
+                leaf = spareLeaf;
+                spareLeaf = NULL;
+            }
+            else
+            {
+                leaf = new TagLeaf();
+            }
+        }
+
+        uint32_t& slot = leaf->tags[granule & LEAF_MASK];
+        if(slot == 0 && tag != 0)
         {
-            delete (*it);
+            leaf->used++;
+        }
+        else if(slot != 0 && tag == 0)
+        {
+            leaf->used--;
+        }
+        slot = tag;
+
+        // Nothing left in this leaf, give it back (the tags are all zero again).
+        if(leaf->used == 0)
+        {
+            delete spareLeaf;
+            spareLeaf = leaf;
+            leaf = NULL;
         }
-        mem_alloc.clear();
     }
 
-    TVMMemoryPoolID MemoryPool::getMemID()
+    uint32_t& MemoryPool::freePrev(uint32_t granule)
     {
-        return this->mem_id;
+        return leaves[granule >> LEAF_BITS]->freePrev[granule & LEAF_MASK];
     }
 
-    TVMMemorySize MemoryPool::getMemSize()
+    uint32_t& MemoryPool::freeNext(uint32_t granule)
     {
-        return this->mem_size;
+        return leaves[granule >> LEAF_BITS]->freeNext[granule & LEAF_MASK];
     }
 
-    void* MemoryPool::getMemBase()
+    unsigned int MemoryPool::sizeClass(uint32_t length)
     {
-        return this->mem_base;
+        if(length <= NUM_SMALL_CLASSES)
+        {
+            return length - 1;
+        }
+
+        unsigned int group = 31 - __builtin_clz(length);
+        unsigned int split = (length >> (group - LARGE_SPLIT_BITS)) & (LARGE_SPLIT - 1);
+        return NUM_SMALL_CLASSES + (group - SMALL_CLASS_BITS) * LARGE_SPLIT + split;
     }
 
-    TVMMemorySize MemoryPool::query_remaining()
+    unsigned int MemoryPool::nextBin(unsigned int sizeClass)
     {
-        TVMMemorySize msize = 0;
+        if(sizeClass >= NUM_SIZE_CLASSES)
+        {
+            return NUM_SIZE_CLASSES;
+        }
+
+        unsigned int word = sizeClass / 64;
+        uint64_t bits = binMap[word] & (~0ULL << (sizeClass % 64));
 
-       	for(auto it = mem_free.begin(); it != mem_free.end(); ++it)
+        while(bits == 0)
         {
-            msize += (*it)->size;
+            if(++word == NUM_CLASS_WORDS)
+            {
+                return NUM_SIZE_CLASSES;
+            }
+            bits = binMap[word];
         }
+        return word * 64 + __builtin_ctzll(bits);
+    }
 
-        return msize;
+    void MemoryPool::setTags(uint32_t granule, uint32_t length, uint32_t flags)
+    {
+        // Footer first so a one granule segment ends up with its header.
+        setTag(granule + length - 1, (length << TAG_SHIFT) | flags);
+        setTag(granule, (length << TAG_SHIFT) | flags | TAG_HEADER);
     }
 
-    bool MemoryPool::allocate_memory(void** pointer, TVMMemorySize msize)
+    void MemoryPool::clearTags(uint32_t granule, uint32_t length)
     {
+        setTag(granule, 0);
+        setTag(granule + length - 1, 0);
+    }
 
-        bool found = false;
+    void MemoryPool::insertFree(uint32_t granule, uint32_t length)
+    {
+        unsigned int bin = sizeClass(length);
 
-        msize = (msize + 0x3F) & (~0x3F);
+        setTags(granule, length, TAG_FREE);
 
-        unsigned int numSegments = mem_free.size();
+        // Small bins hold one size, push onto the front. Large bins stay sorted
+        // so their head is the biggest segment in them.
+        uint32_t prev = NO_GRANULE;
+        uint32_t next = binHead[bin];
 
-        // Find free space (if possible).
-        for(unsigned int i = 0; i < numSegments; i++)
+        if(length > NUM_SMALL_CLASSES)
         {
-            if(mem_free[i]->size >= msize)
+            while(next != NO_GRANULE && TAG_LENGTH(getTag(next)) > length)
             {
-                found = true;
-                *pointer = mem_free[i]->base;
-
-                // Allocate block.
-                MemorySegment* segment = new MemorySegment;
-                segment->base = mem_free[i]->base;
-                segment->size = msize;
-                segment->next = NEXT_BLOCK;
-                mem_alloc.push_back(segment);
-
-                // Update free blocks.
-                if(mem_free[i]->size == msize) // Remove free block.
-                {
-                    delete mem_free[i];
-                    mem_free.erase(mem_free.begin() + i);
-                }
-                else // Shrink free block.
-                {
-                    mem_free[i]->size -= msize;
-                    mem_free[i]->base = (uint8_t*)mem_free[i]->base + msize;
-                }
-                break;
+                prev = next;
+                next = freeNext(next);
             }
         }
 
-        return found;
+        freePrev(granule) = prev;
+        freeNext(granule) = next;
+        if(next != NO_GRANULE)
+        {
+            freePrev(next) = granule;
+        }
+        if(prev != NO_GRANULE)
+        {
+            freeNext(prev) = granule;
+        }
+        else
+        {
+            binHead[bin] = granule;
+        }
+        binMap[bin / 64] |= (1ULL << (bin % 64));
+        freeSegments++;
     }
 
-    bool MemoryPool::deallocate_memory(void* base)
+    void MemoryPool::removeFree(uint32_t granule)
     {
-        // Check that they aren't feeding us absolute garbage.
-        if(base < this->mem_base || (uint8_t*)base >= (uint8_t*)this->mem_base + this->mem_size)
+        unsigned int bin = sizeClass(TAG_LENGTH(getTag(granule)));
+
+        if(freePrev(granule) != NO_GRANULE)
         {
-            return false;
+            freeNext(freePrev(granule)) = freeNext(granule);
+        }
+        else
+        {
+            binHead[bin] = freeNext(granule);
         }
 
-        // Check if that base has actually been allocated.
-        bool found = false;
-        MemorySegment* segment;
+        if(freeNext(granule) != NO_GRANULE)
+        {
+            freePrev(freeNext(granule)) = freePrev(granule);
+        }
+
+        if(binHead[bin] == NO_GRANULE)
+        {
+            binMap[bin / 64] &= ~(1ULL << (bin % 64));
+        }
+        freeSegments--;
+    }
+
+    uint32_t MemoryPool::findFree(uint32_t length)
+    {
+        unsigned int bin = sizeClass(length);
+
+        // Small bins hold one exact size, so any bin from here up fits.
+        if(length <= NUM_SMALL_CLASSES)
+        {
+            bin = nextBin(bin);
+            return (bin == NUM_SIZE_CLASSES) ? NO_GRANULE : binHead[bin];
+        }
+
+        // A large bin covers a range of sizes, but if its head (the biggest)
+        // is too small nothing in it fits. Everything in the bins above does.
+        if(binHead[bin] != NO_GRANULE && TAG_LENGTH(getTag(binHead[bin])) >= length)
+        {
+            return binHead[bin];
+        }
+
+        bin = nextBin(bin + 1);
+        return (bin == NUM_SIZE_CLASSES) ? NO_GRANULE : binHead[bin];
+    }
 
-        unsigned int numSegments = mem_alloc.size();
+    void MemoryPool::freeSpace(TVMMemorySize* largest, unsigned int* segments)
+    {
+        *largest  = 0;
+        *segments = freeSegments;
 
-        for(unsigned int i = 0; i < numSegments; i++)
+        // The biggest segment heads the highest non-empty bin.
+        for(int word = NUM_CLASS_WORDS - 1; word >= 0; word--)
         {
-            if(mem_alloc[i]->base == base) // Found block
+            if(binMap[word] != 0)
             {
-                found = true;
-                segment = mem_alloc[i];
-                mem_alloc.erase(mem_alloc.begin() + i);
+                unsigned int bin = word * 64 + 63 - __builtin_clzll(binMap[word]);
+
+                *largest = (TVMMemorySize)TAG_LENGTH(getTag(binHead[bin])) << granuleShift;
+                return;
             }
         }
+    }
 
-        if(!found)
+    void MemoryPool::takeFree(uint32_t granule, uint32_t start, uint32_t length)
+    {
+        uint32_t freeLength = TAG_LENGTH(getTag(granule));
+        uint32_t end = granule + freeLength;
+        removeFree(granule);
+
+        // Whatever is left on either side stays free.
+        if(start > granule)
         {
-            return false;
+            insertFree(granule, start - granule);
         }
+        setTags(start, length, 0);
+        if(start + length < end)
+        {
+            insertFree(start + length, end - (start + length));
+        }
+
+        mem_remaining -= (TVMMemorySize)length << granuleShift;
+    }
 
-        // Free & Merge Blocks.
-        if(mem_free.size() == 0) // No blocks currently free.
+    bool MemoryPool::allocate_memory(void** pointer, TVMMemorySize msize)
+    {
+        if(msize > mem_remaining)
         {
-            mem_free.push_back(segment);
+            return false;
         }
-        else if(mem_free[0]->base > segment->base) // The block being freed is before everything else.
+
+        uint32_t length = (msize + granuleSize - 1) >> granuleShift;
+        uint32_t free = findFree(length);
+
+        if(free == NO_GRANULE)
         {
-            if(segment->next == mem_free[0]->base) // Right next to each other
-            {
-                mem_free[0]->base = segment->base;
-                mem_free[0]->size += segment->size;
+            return false;
+        }
 
-                delete segment;
-            }
-            else // Before everything
-            {
-                mem_free.insert(mem_free.begin(), segment);
-            }
+        // Allocate from the front.
+        takeFree(free, free, length);
+        *pointer = (uint8_t*)mem_base + ((size_t)free << granuleShift);
+        return true;
+    }
+
+    uint32_t MemoryPool::alignPadding(uint32_t granule, TVMMemorySize alignment)
+    {
+        uintptr_t address = (uintptr_t)mem_base + ((uintptr_t)granule << granuleShift);
+        uintptr_t aligned = (address + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+        return (aligned - address) >> granuleShift;
+    }
+
+    bool MemoryPool::allocate_aligned(void** pointer, TVMMemorySize msize, TVMMemorySize alignment)
+    {
+        uintptr_t base = (uintptr_t)mem_base;
+
+        // Every block is aligned to the granule at best, and only if the base is.
+        if(alignment <= granuleSize)
+        {
+            return (base & (alignment - 1)) == 0 && allocate_memory(pointer, msize);
         }
-        else if(mem_free[mem_free.size() - 1]->next <= segment->base) // The block being freed is after everything else.
+        if((base & (granuleSize - 1)) != 0 || msize > mem_remaining)
         {
-            if(mem_free[mem_free.size() - 1]->next == segment->base)  // Right after last block.
-            {
-                mem_free[mem_free.size() - 1]->next = segment->next;
-                mem_free[mem_free.size() - 1]->size += segment->size;
+            return false;
+        }
 
-                delete segment;
-            }
-            else
-            {
-                mem_free.push_back(segment);
-            }
+        uint32_t length = (msize + granuleSize - 1) >> granuleShift;
+        uint32_t slack  = (alignment >> granuleShift) - 1;
+
+        // A segment with room for the worst case padding always fits, otherwise
+        // look for one whose padding happens to be small enough.
+        uint32_t free = findFree(length + slack);
+        uint32_t start = NO_GRANULE;
+
+        if(free != NO_GRANULE)
+        {
+            start = free + alignPadding(free, alignment);
         }
         else
         {
-            unsigned int pos;
-            for(pos = 0; pos < mem_free.size(); pos++)
+            for(unsigned int bin = nextBin(sizeClass(length)); bin < NUM_SIZE_CLASSES && start == NO_GRANULE;
+                bin = nextBin(bin + 1))
             {
-                if(mem_free[pos]->base > segment->base)
+                for(free = binHead[bin]; free != NO_GRANULE; free = freeNext(free))
                 {
-                    break;
+                    uint32_t padding = alignPadding(free, alignment);
+
+                    if(padding + length <= TAG_LENGTH(getTag(free)))
+                    {
+                        start = free + padding;
+                        break;
+                    }
                 }
             }
+        }
 
-            // Gets position, we'll have to insert at.
-            // 0 1 x 2 ... where x's base is less than 2's base
-            if(mem_free[BEFORE]->next == segment->base
-               && mem_free[AFTER]->base == segment->next) // Touching both sides.
-            {
-                mem_free[BEFORE]->next = mem_free[AFTER]->next;
-                mem_free[BEFORE]->size += mem_free[AFTER]->size + segment->size;
+        if(start == NO_GRANULE)
+        {
+            return false;
+        }
 
-                delete segment;
-                delete mem_free[AFTER];
+        takeFree(free, start, length);
+        *pointer = (uint8_t*)mem_base + ((size_t)start << granuleShift);
+        return true;
+    }
 
-                mem_free.erase(mem_free.begin() + AFTER);
-            }
-            else if(mem_free[BEFORE]->next == segment->base) // Touching front.
-            {
-                mem_free[BEFORE]->next = segment->next;
-                mem_free[BEFORE]->size += segment->size;
+    uint32_t MemoryPool::allocatedGranule(void* base)
+    {
+        // Check that they aren't feeding us absolute garbage.
+        if(base < this->mem_base || (uint8_t*)base >= (uint8_t*)this->mem_base + this->mem_size)
+        {
+            return NO_GRANULE;
+        }
 
-                delete segment;
-            }
-            else if(mem_free[AFTER]->base == segment->next) // Touching back.
-            {
-                mem_free[AFTER]->base = segment->base;
-                mem_free[AFTER]->size += segment->size;
+        size_t offset = (uint8_t*)base - (uint8_t*)this->mem_base;
+        uint32_t index = offset >> granuleShift;
 
-                delete segment;
-            }
-            else     // Forever alone.
+        // Check if that base has actually been allocated.
+        if((offset & (granuleSize - 1)) != 0 || index >= numGranules
+           || (getTag(index) & (TAG_HEADER | TAG_FREE | TAG_CACHED)) != TAG_HEADER)
+        {
+            return NO_GRANULE;
+        }
+        return index;
+    }
+
+    uint32_t MemoryPool::block_length(void* base)
+    {
+        uint32_t granule = allocatedGranule(base);
+        return (granule == NO_GRANULE) ? 0 : TAG_LENGTH(getTag(granule));
+    }
+
+    void MemoryPool::set_cached(void* base, bool cached)
+    {
+        uint32_t index = ((uint8_t*)base - (uint8_t*)this->mem_base) >> granuleShift;
+        uint32_t tag = getTag(index);
+
+        setTag(index, cached ? (tag | TAG_CACHED) : (tag & ~TAG_CACHED));
+    }
+
+    void MemoryPool::freeSegment(uint32_t granule, uint32_t length)
+    {
+        mem_remaining += (TVMMemorySize)length << granuleShift;
+
+        // Merge with the free block right after (its header follows our footer).
+        uint32_t after = granule + length;
+        if(after < numGranules && (getTag(after) & TAG_FREE))
+        {
+            uint32_t afterLength = TAG_LENGTH(getTag(after));
+            removeFree(after);
+            clearTags(after, afterLength);
+            clearTags(granule, length);
+            length += afterLength;
+        }
+
+        // Merge with the free block right before (its footer precedes our header).
+        if(granule > 0 && (getTag(granule - 1) & TAG_FREE))
+        {
+            uint32_t beforeLength = TAG_LENGTH(getTag(granule - 1));
+            uint32_t before = granule - beforeLength;
+            removeFree(before);
+            clearTags(before, beforeLength);
+            clearTags(granule, length);
+            granule = before;
+            length += beforeLength;
+        }
+
+        insertFree(granule, length);
+    }
+
+    bool MemoryPool::deallocate_memory(void* base)
+    {
+        uint32_t granule = allocatedGranule(base);
+
+        if(granule == NO_GRANULE)
+        {
+            return false;
+        }
+
+        freeSegment(granule, TAG_LENGTH(getTag(granule)));
+        return true;
+    }
+
+    TVMMemorySize MemoryPool::block_size(void* base)
+    {
+        uint32_t granule = allocatedGranule(base);
+        return (granule == NO_GRANULE) ? 0 : (TVMMemorySize)TAG_LENGTH(getTag(granule)) << granuleShift;
+    }
+
+    bool MemoryPool::resize_memory(void* base, TVMMemorySize msize)
+    {
+        uint32_t granule = allocatedGranule(base);
+
+        if(granule == NO_GRANULE || msize == 0)
+        {
+            return false;
+        }
+
+        uint32_t length    = TAG_LENGTH(getTag(granule));
+        uint32_t newLength = ((uint64_t)msize + granuleSize - 1) >> granuleShift;
+
+        // Shrinking hands the tail back like a free would.
+        if(newLength <= length)
+        {
+            if(newLength < length)
             {
-                mem_free.insert(mem_free.begin() + pos, segment);
+                setTags(granule, newLength, 0);
+                freeSegment(granule + newLength, length - newLength);
             }
+            return true;
+        }
+
+        // Growing only works if the segment right after is free and big enough.
+        uint32_t after = granule + length;
+        if(after >= numGranules || !(getTag(after) & TAG_FREE))
+        {
+            return false;
+        }
+
+        uint32_t afterLength = TAG_LENGTH(getTag(after));
+        if(length + afterLength < newLength)
+        {
+            return false;
+        }
+
+        removeFree(after);
+        clearTags(after, afterLength);
+        clearTags(granule, length);
+
+        setTags(granule, newLength, 0);
+        if(length + afterLength > newLength)
+        {
+            insertFree(granule + newLength, length + afterLength - newLength);
         }
+
+        mem_remaining -= (TVMMemorySize)(newLength - length) << granuleShift;
         return true;
     }
 }
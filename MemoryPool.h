@@ -1,5 +1,4 @@
-#include "VirtualMachine.h"
-#include <stdint.h>
+#include "BasePool.h"
 #include <vector>
 
 #ifndef MEMORY_POOL_H
@@ -8,41 +7,117 @@
 extern "C"
 {
 
-#define MIN_SEGMENT_SIZE 64
-#define NEXT_BLOCK     (char*)segment->base + segment->size
+// Every segment, free or allocated, is a run of the pool's granules with a
+// boundary tag on its first granule (header) and its last granule (footer).
+// A tag holds the segment's length in granules and these flags.
+#define TAG_FREE        0x1
+#define TAG_HEADER      0x2
+#define TAG_CACHED      0x4 // Freed into a thread's magazine, not back to the pool yet.
+#define TAG_SHIFT       3
+#define TAG_LENGTH(tag) ((tag) >> TAG_SHIFT)
 
-#define BEFORE pos - 1
-#define AFTER  pos
+#define NO_GRANULE 0xFFFFFFFFU
 
-typedef struct
+// Tags are indexed by granule through a two level table. A leaf covers
+// LEAF_GRANULES granules and only exists while one of its tags is in use.
+#define LEAF_BITS     10
+#define LEAF_GRANULES (1 << LEAF_BITS)
+#define LEAF_MASK     (LEAF_GRANULES - 1)
+
+// Free segments of up to NUM_SMALL_CLASSES granules are kept in exact size bins.
+// Bigger ones are binned by their top bits: one group per power of two, split
+// into LARGE_SPLIT bins (log2 of LARGE_SPLIT_BITS), each sorted largest first.
+#define NUM_SMALL_CLASSES 32
+#define LARGE_SPLIT_BITS  2
+#define LARGE_SPLIT       (1 << LARGE_SPLIT_BITS)
+#define SMALL_CLASS_BITS  5  // log2(NUM_SMALL_CLASSES)
+#define NUM_SIZE_CLASSES  (NUM_SMALL_CLASSES + (32 - SMALL_CLASS_BITS) * LARGE_SPLIT)
+#define NUM_CLASS_WORDS   ((NUM_SIZE_CLASSES + 63) / 64)
+
+// Small blocks freed by a thread are kept in that thread's magazine for the
+// pool and size, up to MAGAZINE_SIZE of them, and handed straight back out.
+#define MAGAZINE_SIZE         16
+#define MAGAZINE_MAX_GRANULES 8
+
+struct MemoryMagazine
+{
+    TVMMemoryPoolID pool;
+    uint32_t length; // In granules.
+    unsigned int count;
+    void* blocks[MAGAZINE_SIZE];
+};
+
+struct TagLeaf
 {
-    void* base;
-    TVMMemorySize size;
-    void* next;
-} MemorySegment;
+    uint32_t used; // Non-zero tags in this leaf.
+    uint32_t tags[LEAF_GRANULES];
+    uint32_t freePrev[LEAF_GRANULES];
+    uint32_t freeNext[LEAF_GRANULES];
+};
 
-class MemoryPool
+class MemoryPool : public BasePool
 {
     private:
-        TVMMemoryPoolID mem_id;
-        TVMMemorySize mem_size;
-        void* mem_base;
+        unsigned int granuleShift;  // log2(granule)
+        uint32_t numGranules;
 
-        std::vector<MemorySegment*> mem_free;
-        std::vector<MemorySegment*> mem_alloc;
+        // Per granule boundary tags and free list links (only meaningful on the
+        // header granule of a free segment), looked up by address.
+        TagLeaf** leaves;
+        uint32_t numLeaves;
+        TagLeaf* spareLeaf; // Last emptied leaf, kept to avoid churn.
 
-    public:
-        MemoryPool(void* base, TVMMemorySize size, TVMMemoryPoolIDRef mid);
-        ~MemoryPool();
+        uint32_t binHead[NUM_SIZE_CLASSES];
+        uint64_t binMap[NUM_CLASS_WORDS]; // Bit set when the bin isn't empty.
+        uint32_t freeSegments;
+
+        uint32_t getTag(uint32_t granule);
+        void setTag(uint32_t granule, uint32_t tag);
+        uint32_t& freePrev(uint32_t granule);
+        uint32_t& freeNext(uint32_t granule);
+
+        static unsigned int sizeClass(uint32_t length);
+
+        // Lowest non-empty bin at or above sizeClass, or NUM_SIZE_CLASSES.
+        unsigned int nextBin(unsigned int sizeClass);
 
-        TVMMemoryPoolID getMemID();
-        TVMMemorySize getMemSize();
-        void* getMemBase();
+        void setTags(uint32_t granule, uint32_t length, uint32_t flags);
+        void clearTags(uint32_t granule, uint32_t length);
 
-        TVMMemorySize query_remaining();
+        void insertFree(uint32_t granule, uint32_t length);
+        void removeFree(uint32_t granule);
+
+        // A free segment of at least length granules, or NO_GRANULE.
+        uint32_t findFree(uint32_t length);
+
+        // Hand out length granules at start out of the free segment at granule.
+        void takeFree(uint32_t granule, uint32_t start, uint32_t length);
+
+        // Granules to skip from granule to reach an address aligned to alignment.
+        uint32_t alignPadding(uint32_t granule, TVMMemorySize alignment);
+
+        void freeSpace(TVMMemorySize* largest, unsigned int* segments);
+
+        // Give a run of granules back, merging it with free neighbours.
+        void freeSegment(uint32_t granule, uint32_t length);
+
+        // Header granule of the allocated block at base, or NO_GRANULE.
+        uint32_t allocatedGranule(void* base);
+
+    public:
+        MemoryPool(void* base, TVMMemorySize size, TVMMemorySize granule, TVMMemoryPoolIDRef mid);
+        ~MemoryPool();
 
         bool allocate_memory(void** pointer, TVMMemorySize msize);
+        bool allocate_aligned(void** pointer, TVMMemorySize msize, TVMMemorySize alignment);
         bool deallocate_memory(void* base);
+
+        TVMMemorySize block_size(void* base);
+        bool resize_memory(void* base, TVMMemorySize msize);
+
+        // Length in granules of an allocated block that isn't cached, 0 otherwise.
+        uint32_t block_length(void* base);
+        void set_cached(void* base, bool cached);
 };
 
 }
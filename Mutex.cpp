@@ -4,6 +4,18 @@ using namespace std;
 
 extern "C"
 {
+    static ObjectSlab mutexSlab(sizeof(Mutex), SLAB_CHUNK_OBJECTS);
+
+    void* Mutex::operator new(size_t size)
+    {
+        return mutexSlab.allocate();
+    }
+
+    void Mutex::operator delete(void* object)
+    {
+        mutexSlab.deallocate(object);
+    }
+
     static TVMMutexID nextMID = 1;
 
     Mutex::Mutex()
@@ -11,36 +23,56 @@ extern "C"
         this->mid = nextMID;
         nextMID++;
 
-        this->isLocked = false;
-
-        this->owner = NULL_MUTEX;
+        this->lockWord = 0;
     }
 
     Mutex::~Mutex()
     {
     }
 
+    bool Mutex::isLocked()
+    {
+        return this->lockWord != 0;
+    }
+
+    TVMThreadID Mutex::getOwner()
+    {
+        return this->lockWord & ~VM_MUTEX_LOCK_WAITERS;
+    }
+
+    bool Mutex::tryLock(TVMThreadID tid)
+    {
+        return __sync_bool_compare_and_swap(&this->lockWord, 0, tid);
+    }
+
     // Gets the next owner if someone is waiting for it.
     // Returns a pointer to that owner.
     ThreadControlBlock* Mutex::getNextOwner()
     {
         ThreadControlBlock* newOwner = NULL;
-        if(!(this->isLocked))
+        for(int i = VM_THREAD_PRIORITY_HIGH; i >= 0; i--)
         {
-            for(int i = VM_THREAD_PRIORITY_HIGH; i >= 0; i--)
+            if(!(waiting[i].empty()))
             {
-                if(!(waiting[i].empty()))
-                {
-                    newOwner = waiting[i].front();
-                    waiting[i].erase(waiting[i].begin());
-                    newOwner->mHeld.push_back(this->mid);
-                    newOwner->setMutexWants(NULL_MUTEX);
-                    this->owner = newOwner->getTID();
-                    this->isLocked = true;
-                    break;
-                }
+                newOwner = waiting[i].front();
+                waiting[i].erase(waiting[i].begin());
+                newOwner->setMutexWants(NULL_MUTEX);
+                break;
             }
         }
+
+        if(newOwner == NULL)
+        {
+            this->lockWord = 0;
+        }
+        else if(hasWaiters())
+        {
+            this->lockWord = newOwner->getTID() | VM_MUTEX_LOCK_WAITERS;
+        }
+        else
+        {
+            this->lockWord = newOwner->getTID();
+        }
         return newOwner;
     }
 
@@ -49,6 +81,9 @@ extern "C"
     {
         thread->setMutexWants(this->mid);
         waiting[thread->getPriority()].push_back(thread);
+
+        // Forces the owner's inline release into VMMutexRelease.
+        __sync_fetch_and_or(&this->lockWord, VM_MUTEX_LOCK_WAITERS);
     }
 
     // Remove a mutex from the waiting queue.
@@ -62,9 +97,26 @@ extern "C"
                 {
                     waiting[i][j]->setMutexWants(NULL_MUTEX);
                     waiting[i].erase(waiting[i].begin() + j);
+
+                    if(!hasWaiters())
+                    {
+                        __sync_fetch_and_and(&this->lockWord, ~VM_MUTEX_LOCK_WAITERS);
+                    }
                     return;
                 }
             }
         }
     }
+
+    bool Mutex::hasWaiters()
+    {
+        for(unsigned int i = 0; i < NUM_PRIORITIES; i++)
+        {
+            if(!(waiting[i].empty()))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
 }
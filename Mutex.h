@@ -1,7 +1,7 @@
 #include "ThreadControlBlock.h"
 #include <vector>
 
-#ifndef ARV_MNJ_MUTUX_H
+#ifndef ARV_MNJ_MUTEX_H
 #define ARV_MNJ_MUTEX_H
 
 extern "C"
@@ -14,22 +14,36 @@ class Mutex
 {
     public:
         TVMMutexID mid;    // The Mutex's ID.
-        bool isLocked;     // Is it locked?
-        TVMThreadID owner; // Current owner.
+
+        // Owner's TID (0 when unlocked), plus VM_MUTEX_LOCK_WAITERS while anyone
+        // is queued. Apps swap it directly on the uncontended path, so it is only
+        // changed with an atomic compare-and-swap or with signals suspended.
+        volatile unsigned int lockWord;
 
         std::vector<ThreadControlBlock*> waiting[NUM_PRIORITIES];
 
         Mutex();
         ~Mutex();
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
+
+        bool isLocked();
+        TVMThreadID getOwner();
 
-        // Gets the next owner if someone is waiting for it.
+        // Takes the mutex if it's unlocked.
+        bool tryLock(TVMThreadID tid);
+
+        // Hands the mutex to the next owner if someone is waiting for it,
+        // otherwise unlocks it. Returns the new owner (or NULL).
         ThreadControlBlock* getNextOwner();
 
         // Adds the thread specified to the appropriate waiting queue.
         void wantsMutex(ThreadControlBlock* thread);
 
-        // Remove a mutex from the waiting queue.
+        // Remove a thread from the waiting queue.
         void stopWaiting(TVMThreadID tid);
+
+        bool hasWaiters();
 };
 }
 
@@ -0,0 +1,160 @@
+#include "RWLock.h"
+
+extern "C"
+{
+    static ObjectSlab rwlockSlab(sizeof(RWLock), SLAB_CHUNK_OBJECTS);
+
+    void* RWLock::operator new(size_t size)
+    {
+        return rwlockSlab.allocate();
+    }
+
+    void RWLock::operator delete(void* object)
+    {
+        rwlockSlab.deallocate(object);
+    }
+
+    static TVMRWLockID nextRWID = 1;
+
+    RWLock::RWLock()
+    {
+        this->rwid = nextRWID;
+        nextRWID++;
+
+        this->writer = 0;
+    }
+
+    RWLock::~RWLock()
+    {
+    }
+
+    // Returns the priority of the highest priority waiter in queues.
+    int RWLock::highestWaiting(std::vector<ThreadControlBlock*>* queues)
+    {
+        for(int i = VM_THREAD_PRIORITY_HIGH; i >= 0; i--)
+        {
+            if(!(queues[i].empty()))
+            {
+                return i;
+            }
+        }
+        return NO_WAITING_PRIORITY;
+    }
+
+    bool RWLock::canRead(TVMThreadPriority prio)
+    {
+        return this->writer == 0 && highestWaiting(waitingWriters) < (int)prio;
+    }
+
+    bool RWLock::canWrite()
+    {
+        return this->writer == 0 && this->readers.empty();
+    }
+
+    bool RWLock::isLocked()
+    {
+        return this->writer != 0 || !(this->readers.empty());
+    }
+
+    bool RWLock::hasWaiters()
+    {
+        return highestWaiting(waitingReaders) != NO_WAITING_PRIORITY ||
+               highestWaiting(waitingWriters) != NO_WAITING_PRIORITY;
+    }
+
+    void RWLock::wantsRead(ThreadControlBlock* thread)
+    {
+        thread->setWaitingOn(this->rwid);
+        waitingReaders[thread->getPriority()].push_back(thread);
+    }
+
+    void RWLock::wantsWrite(ThreadControlBlock* thread)
+    {
+        thread->setWaitingOn(this->rwid);
+        waitingWriters[thread->getPriority()].push_back(thread);
+    }
+
+    bool RWLock::stopWaiting(TVMThreadID tid)
+    {
+        for(unsigned int i = 0; i < NUM_PRIORITIES; i++)
+        {
+            for(unsigned int j = 0; j < waitingReaders[i].size(); j++)
+            {
+                if(waitingReaders[i][j]->getTID() == tid)
+                {
+                    waitingReaders[i][j]->setWaitingOn(0);
+                    waitingReaders[i].erase(waitingReaders[i].begin() + j);
+                    return true;
+                }
+            }
+
+            for(unsigned int j = 0; j < waitingWriters[i].size(); j++)
+            {
+                if(waitingWriters[i][j]->getTID() == tid)
+                {
+                    waitingWriters[i][j]->setWaitingOn(0);
+                    waitingWriters[i].erase(waitingWriters[i].begin() + j);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool RWLock::release(TVMThreadID tid)
+    {
+        if(this->writer == tid)
+        {
+            this->writer = 0;
+            return true;
+        }
+
+        for(unsigned int i = 0; i < readers.size(); i++)
+        {
+            if(readers[i] == tid)
+            {
+                readers.erase(readers.begin() + i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void RWLock::grantWaiters(std::vector<ThreadControlBlock*>& granted)
+    {
+        if(this->writer != 0)
+        {
+            return;
+        }
+
+        int writerPrio = highestWaiting(waitingWriters);
+        int readerPrio = highestWaiting(waitingReaders);
+
+        // Writer wins ties with readers.
+        if(writerPrio != NO_WAITING_PRIORITY && writerPrio >= readerPrio)
+        {
+            if(readers.empty())
+            {
+                ThreadControlBlock* thread = waitingWriters[writerPrio].front();
+                waitingWriters[writerPrio].erase(waitingWriters[writerPrio].begin());
+                thread->setWaitingOn(0);
+
+                this->writer = thread->getTID();
+                granted.push_back(thread);
+            }
+            return;
+        }
+
+        // Admit every reader that outranks the best waiting writer.
+        for(int i = VM_THREAD_PRIORITY_HIGH; i > writerPrio; i--)
+        {
+            for(unsigned int j = 0; j < waitingReaders[i].size(); j++)
+            {
+                waitingReaders[i][j]->setWaitingOn(0);
+                readers.push_back(waitingReaders[i][j]->getTID());
+                granted.push_back(waitingReaders[i][j]);
+            }
+            waitingReaders[i].clear();
+        }
+    }
+}
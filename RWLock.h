@@ -0,0 +1,56 @@
+#include "ThreadControlBlock.h"
+#include "Mutex.h"
+#include <vector>
+
+#ifndef RW_LOCK_H
+#define RW_LOCK_H
+
+extern "C"
+{
+
+#define NO_WAITING_PRIORITY -1
+
+class RWLock
+{
+    public:
+        TVMRWLockID rwid;    // The lock's ID.
+        TVMThreadID writer;  // Thread holding it exclusively (0 if none).
+
+        std::vector<TVMThreadID> readers; // Threads holding it shared.
+
+        std::vector<ThreadControlBlock*> waitingReaders[NUM_PRIORITIES];
+        std::vector<ThreadControlBlock*> waitingWriters[NUM_PRIORITIES];
+
+        RWLock();
+        ~RWLock();
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
+
+        // A reader may enter while no writer holds the lock and no writer of
+        // equal or higher priority is waiting (writers are preferred).
+        bool canRead(TVMThreadPriority prio);
+        bool canWrite();
+
+        bool isLocked();
+        bool hasWaiters();
+
+        // Adds the thread specified to the appropriate waiting queue.
+        void wantsRead(ThreadControlBlock* thread);
+        void wantsWrite(ThreadControlBlock* thread);
+
+        // Remove a thread from the waiting queues, returns true if it was waiting.
+        bool stopWaiting(TVMThreadID tid);
+
+        // Drops one hold of thread tid, returns false if it held nothing.
+        bool release(TVMThreadID tid);
+
+        // Hands the lock to whichever waiters may now have it. Granted threads
+        // are removed from the waiting queues and appended to granted.
+        void grantWaiters(std::vector<ThreadControlBlock*>& granted);
+
+    private:
+        int highestWaiting(std::vector<ThreadControlBlock*>* queues);
+};
+}
+
+#endif
@@ -7,6 +7,19 @@ extern "C"
 {
     Scheduler::Scheduler()
     {
+        this->current = NULL;
+        this->memoryManager = NULL;
+
+        this->ticks = 0;
+        this->idleTicks = 0;
+        this->contextSwitches = 0;
+        this->preemptions = 0;
+
+        for(unsigned int i = 0; i < NUM_CHANNEL_CHUNKS; i++)
+        {
+            channelChunks[i] = NULL;
+        }
+        this->numRetiredChannels = 0;
     }
 
     Scheduler::~Scheduler()
@@ -22,6 +35,41 @@ extern "C"
             delete (*it);
         }
         mutexes.clear();
+
+        for(auto it = conditions.begin(); it != conditions.end(); ++it)
+        {
+            delete (*it);
+        }
+        conditions.clear();
+
+        for(auto it = semaphores.begin(); it != semaphores.end(); ++it)
+        {
+            delete (*it);
+        }
+        semaphores.clear();
+
+        for(auto it = rwlocks.begin(); it != rwlocks.end(); ++it)
+        {
+            delete (*it);
+        }
+        rwlocks.clear();
+
+        for(unsigned int i = 0; i < NUM_CHANNEL_CHUNKS; i++)
+        {
+            if(channelChunks[i] != NULL)
+            {
+                for(unsigned int j = 0; j < CHANNEL_CHUNK_SIZE; j++)
+                {
+                    delete channelChunks[i][j];
+                }
+                delete[] channelChunks[i];
+            }
+        }
+
+        for(unsigned int i = 0; i < retiredChannels.size(); i++)
+        {
+            delete retiredChannels[i];
+        }
     }
 
     ThreadControlBlock* Scheduler::findThread(TVMThreadID tid)
@@ -38,6 +86,11 @@ extern "C"
         return foundThread;
     }
 
+    void Scheduler::setMemoryManager(MemoryManager* manager)
+    {
+        this->memoryManager = manager;
+    }
+
     void Scheduler::addThread(ThreadControlBlock* thread)
     {
         all_threads.push_back(thread);
@@ -58,7 +111,7 @@ extern "C"
 
     void Scheduler::addToReady(ThreadControlBlock* thread)
     {
-        thread->setState(VM_THREAD_STATE_READY);
+        setThreadState(thread, VM_THREAD_STATE_READY);
         ready_queues[thread->getPriority()].push_back(thread);
     }
 
@@ -82,7 +135,7 @@ extern "C"
 
     void Scheduler::addToWaiting(ThreadControlBlock* thread)
     {
-        thread->setState(VM_THREAD_STATE_WAITING);
+        setThreadState(thread, VM_THREAD_STATE_WAITING);
         waiting_queues[thread->reasonForWaiting()].push_back(thread);
     }
 
@@ -97,6 +150,7 @@ extern "C"
             {
                 if(waiting_queues[i][j]->getTID() == tid)
                 {
+                    chargeState(waiting_queues[i][j]); // Still knows what it waited for.
                     waiting_queues[i][j]->setWaitingFor(NOTHING);
                     waiting_queues[i][j]->setTicks(0);
                     waiting_queues[i][j]->setInfiniteFlag(false);
@@ -107,6 +161,101 @@ extern "C"
         }
     }
 
+    void Scheduler::wakeThread(ThreadControlBlock* thread, int result)
+    {
+        removeFromWaiting(thread->getTID());
+        thread->setResult(result);
+        addToReady(thread);
+    }
+
+    void Scheduler::detachWaiter(ThreadControlBlock* thread)
+    {
+        if(thread->reasonForWaiting() == WAITING_MEMORY)
+        {
+            memoryManager->removeFromMemoryQueue(thread->getTID());
+        }
+        else if(thread->reasonForWaiting() == WAITING_MUTEX)
+        {
+            Mutex* mtx = findMutex(thread->getMutexWants());
+            if(mtx != NULL)
+            {
+                mtx->stopWaiting(thread->getTID());
+            }
+        }
+        else if(thread->reasonForWaiting() == WAITING_CONDITION)
+        {
+            Condition* cond = findCondition(thread->getWaitingOn());
+            if(cond != NULL)
+            {
+                cond->stopWaiting(thread->getTID());
+            }
+        }
+        else if(thread->reasonForWaiting() == WAITING_SEMAPHORE)
+        {
+            Semaphore* sem = findSemaphore(thread->getWaitingOn());
+            if(sem != NULL)
+            {
+                sem->stopWaiting(thread->getTID());
+            }
+        }
+        else if(thread->reasonForWaiting() == WAITING_RWLOCK)
+        {
+            RWLock* lock = findRWLock(thread->getWaitingOn());
+            if(lock != NULL)
+            {
+                lock->stopWaiting(thread->getTID());
+
+                // A timed out writer may have been holding back readers.
+                grantRWLock(lock);
+            }
+        }
+        else if(thread->reasonForWaiting() == WAITING_CHANNEL)
+        {
+            Channel* channel = findChannel(thread->getWaitingOn());
+            if(channel != NULL)
+            {
+                channel->stopWaiting(thread->getTID());
+            }
+        }
+    }
+
+    void Scheduler::preemptFor(ThreadControlBlock* thread)
+    {
+        if(thread->getPriority() > this->current->getPriority())
+        {
+            addToReady(this->current);
+            scheduleNext();
+        }
+    }
+
+    void Scheduler::processTimeouts(int reason)
+    {
+        std::vector<ThreadControlBlock*> expired;
+
+        for(unsigned int i = 0; i < waiting_queues[reason].size(); i++)
+        {
+            waiting_queues[reason][i]->decrementTicks();
+
+            if(waiting_queues[reason][i]->doneWaiting())
+            {
+                expired.push_back(waiting_queues[reason][i]);
+            }
+        }
+
+        for(unsigned int i = 0; i < expired.size(); i++)
+        {
+            // May have been granted what it waited for while handling an earlier timeout.
+            if(expired[i]->getState() != VM_THREAD_STATE_WAITING)
+            {
+                continue;
+            }
+
+            // Leave the object's queue so a later wakeup can't pick this thread.
+            detachWaiter(expired[i]);
+            wakeThread(expired[i], VM_STATUS_FAILURE);
+        }
+    }
+
     void Scheduler::processAllWaiting()
     {
         int counter = 0;
@@ -122,6 +271,7 @@ extern "C"
 
                 if(waiting_queues[WAITING_SLEEP][i]->doneWaiting())
                 {
+                    chargeState(waiting_queues[WAITING_SLEEP][i]);
                     waiting_queues[WAITING_SLEEP][i]->setWaitingFor(NOTHING);
                     waiting_queues[WAITING_SLEEP][i]->setInfiniteFlag(false);
                     addToReady(waiting_queues[WAITING_SLEEP][i]);
@@ -132,30 +282,12 @@ extern "C"
             }
         }
 
-        i = 0;
-        if(!(waiting_queues[WAITING_MUTEX].empty()))
-        {
-            counter = waiting_queues[WAITING_MUTEX].size();
-            while(counter != 0)
-            {
-                counter--;
-
-                waiting_queues[WAITING_MUTEX][i]->decrementTicks();
-
-                if(waiting_queues[WAITING_MUTEX][i]->hasMutex() ||
-                   waiting_queues[WAITING_MUTEX][i]->doneWaiting())
-                {
-                    waiting_queues[WAITING_MUTEX][i]->setWaitingFor(NOTHING);
-                    waiting_queues[WAITING_MUTEX][i]->setTicks(0);
-                    waiting_queues[WAITING_MUTEX][i]->setInfiniteFlag(false);
-                    addToReady(waiting_queues[WAITING_MUTEX][i]);
-                    waiting_queues[WAITING_MUTEX][i]->setMutexWants(0);
-                    waiting_queues[WAITING_MUTEX].erase(waiting_queues[WAITING_MUTEX].begin() + i);
-                    continue;
-                }
-                i++;
-            }
-        }
+        processTimeouts(WAITING_MEMORY);
+        processTimeouts(WAITING_MUTEX);
+        processTimeouts(WAITING_CONDITION);
+        processTimeouts(WAITING_SEMAPHORE);
+        processTimeouts(WAITING_RWLOCK);
+        processTimeouts(WAITING_CHANNEL);
     }
 
     void Scheduler::scheduleNext()
@@ -171,10 +303,23 @@ extern "C"
                 break;
             }
         }
-        newThread->setState(VM_THREAD_STATE_RUNNING);
+        setThreadState(newThread, VM_THREAD_STATE_RUNNING);
 
         if(newThread != this->current)
         {
+           // Still ready means it was preempted rather than blocking or exiting.
+           if(current->getState() == VM_THREAD_STATE_READY)
+           {
+               current->getStats()->DInvoluntarySwitches++;
+               preemptions++;
+           }
+           else
+           {
+               current->getStats()->DVoluntarySwitches++;
+           }
+           newThread->getStats()->DDispatches++;
+           contextSwitches++;
+
            SMachineContextRef oldContext = (current)->getContext();
            this->setCurrentThread(newThread);
            MachineContextSwitch(oldContext, newThread->getContext());
@@ -184,6 +329,7 @@ extern "C"
     void Scheduler::setCurrentThread(ThreadControlBlock* thread)
     {
         this->current = thread;
+        VMCurrentThreadID = thread->getTID();
     }
 
     ThreadControlBlock* Scheduler::getCurrentThread()
@@ -191,6 +337,91 @@ extern "C"
         return this->current;
     }
 
+    void Scheduler::addStateTime(ThreadControlBlock* thread, SVMThreadStatsRef stats)
+    {
+        TVMTick elapsed = ticks - thread->getStateSince();
+
+        switch(thread->getState())
+        {
+            case VM_THREAD_STATE_RUNNING:
+                stats->DRunTicks += elapsed;
+                break;
+
+            case VM_THREAD_STATE_READY:
+                stats->DReadyTicks += elapsed;
+                if(elapsed > stats->DMaxReadyLatency)
+                {
+                    stats->DMaxReadyLatency = elapsed;
+                }
+                break;
+
+            case VM_THREAD_STATE_WAITING:
+                if(thread->reasonForWaiting() < NUM_WAITING_QUEUES)
+                {
+                    stats->DWaitTicks[thread->reasonForWaiting()] += elapsed;
+                }
+                break;
+        }
+    }
+
+    void Scheduler::chargeState(ThreadControlBlock* thread)
+    {
+        addStateTime(thread, thread->getStats());
+        thread->setStateSince(ticks);
+    }
+
+    void Scheduler::setThreadState(ThreadControlBlock* thread, TVMThreadState state)
+    {
+        chargeState(thread);
+        thread->setState(state);
+    }
+
+    void Scheduler::tick()
+    {
+        ticks++;
+
+        if(current->getPriority() == VM_THREAD_PRIORITY_NONE)
+        {
+            idleTicks++;
+        }
+    }
+
+    void Scheduler::getThreadStats(ThreadControlBlock* thread, SVMThreadStatsRef stats)
+    {
+        // Include the time spent in the current state so far without charging it,
+        // so a long ready wait still counts as one when it ends.
+        *stats = *(thread->getStats());
+        addStateTime(thread, stats);
+    }
+
+    void Scheduler::getStats(SVMSchedulerStatsRef stats)
+    {
+        stats->DTicks = ticks;
+        stats->DIdleTicks = idleTicks;
+        stats->DContextSwitches = contextSwitches;
+        stats->DPreemptions = preemptions;
+
+        stats->DThreads = 0;
+        for(auto it = all_threads.begin(); it != all_threads.end(); ++it)
+        {
+            if((*it)->getState() != VM_THREAD_STATE_DEAD)
+            {
+                stats->DThreads++;
+            }
+        }
+
+        stats->DReadyThreads = 0;
+        for(unsigned int i = 0; i < NUM_READY_QUEUES; i++)
+        {
+            stats->DReadyThreads += ready_queues[i].size();
+        }
+
+        for(unsigned int i = 0; i < NUM_WAITING_QUEUES; i++)
+        {
+            stats->DWaitingThreads[i] = waiting_queues[i].size();
+        }
+    }
+
     TVMMutexID Scheduler::createMutex()
     {
         Mutex* mutex = new Mutex();
@@ -224,4 +455,263 @@ extern "C"
             }
         }
     }
+
+    ThreadControlBlock* Scheduler::handOffMutex(Mutex* mtx)
+    {
+        ThreadControlBlock* newOwner = mtx->getNextOwner();
+        if(newOwner != NULL) // Someone got the mutex.
+        {
+            wakeThread(newOwner, VM_STATUS_SUCCESS); // That thread is ready to run.
+        }
+        return newOwner;
+    }
+
+    bool Scheduler::releaseMutexes(TVMThreadID tid)
+    {
+        bool needScheduler = false;
+
+        for(auto it = mutexes.begin(); it != mutexes.end(); ++it)
+        {
+            if((*it)->getOwner() == tid)
+            {
+                ThreadControlBlock* newOwner = handOffMutex(*it);
+                if(newOwner != NULL && newOwner->getPriority() > current->getPriority())
+                {
+                    needScheduler = true;
+                }
+            }
+        }
+        return needScheduler;
+    }
+
+    TVMConditionID Scheduler::createCondition()
+    {
+        Condition* cond = new Condition();
+        conditions.push_back(cond);
+        return cond->cid;
+    }
+
+    Condition* Scheduler::findCondition(TVMConditionID conditionID)
+    {
+        Condition* cond = NULL;
+        for(auto it = conditions.begin(); it != conditions.end(); ++it)
+        {
+            if((*it)->cid == conditionID)
+            {
+                cond = (*it);
+                break;
+            }
+        }
+        return cond;
+    }
+
+    void Scheduler::deleteCondition(TVMConditionID conditionID)
+    {
+        for(auto it = conditions.begin(); it != conditions.end(); ++it)
+        {
+            if((*it)->cid == conditionID)
+            {
+                delete (*it);
+                conditions.erase(it);
+                break;
+            }
+        }
+    }
+
+    TVMSemaphoreID Scheduler::createSemaphore(unsigned int count)
+    {
+        Semaphore* sem = new Semaphore(count);
+        semaphores.push_back(sem);
+        return sem->sid;
+    }
+
+    Semaphore* Scheduler::findSemaphore(TVMSemaphoreID semaphoreID)
+    {
+        Semaphore* sem = NULL;
+        for(auto it = semaphores.begin(); it != semaphores.end(); ++it)
+        {
+            if((*it)->sid == semaphoreID)
+            {
+                sem = (*it);
+                break;
+            }
+        }
+        return sem;
+    }
+
+    void Scheduler::deleteSemaphore(TVMSemaphoreID semaphoreID)
+    {
+        for(auto it = semaphores.begin(); it != semaphores.end(); ++it)
+        {
+            if((*it)->sid == semaphoreID)
+            {
+                delete (*it);
+                semaphores.erase(it);
+                break;
+            }
+        }
+    }
+
+    TVMRWLockID Scheduler::createRWLock()
+    {
+        RWLock* lock = new RWLock();
+        rwlocks.push_back(lock);
+        return lock->rwid;
+    }
+
+    RWLock* Scheduler::findRWLock(TVMRWLockID rwlockID)
+    {
+        RWLock* lock = NULL;
+        for(auto it = rwlocks.begin(); it != rwlocks.end(); ++it)
+        {
+            if((*it)->rwid == rwlockID)
+            {
+                lock = (*it);
+                break;
+            }
+        }
+        return lock;
+    }
+
+    void Scheduler::deleteRWLock(TVMRWLockID rwlockID)
+    {
+        for(auto it = rwlocks.begin(); it != rwlocks.end(); ++it)
+        {
+            if((*it)->rwid == rwlockID)
+            {
+                delete (*it);
+                rwlocks.erase(it);
+                break;
+            }
+        }
+    }
+
+    ThreadControlBlock* Scheduler::grantRWLock(RWLock* lock)
+    {
+        std::vector<ThreadControlBlock*> granted;
+        lock->grantWaiters(granted);
+
+        ThreadControlBlock* highest = NULL;
+        for(unsigned int i = 0; i < granted.size(); i++)
+        {
+            wakeThread(granted[i], VM_STATUS_SUCCESS);
+            if(highest == NULL || granted[i]->getPriority() > highest->getPriority())
+            {
+                highest = granted[i];
+            }
+        }
+        return highest;
+    }
+
+    bool Scheduler::releaseRWLocks(TVMThreadID tid)
+    {
+        bool needScheduler = false;
+
+        for(auto it = rwlocks.begin(); it != rwlocks.end(); ++it)
+        {
+            bool released = false;
+            while((*it)->release(tid))
+            {
+                released = true;
+            }
+
+            if(released)
+            {
+                ThreadControlBlock* woken = grantRWLock(*it);
+                if(woken != NULL && woken->getPriority() > current->getPriority())
+                {
+                    needScheduler = true;
+                }
+            }
+        }
+        return needScheduler;
+    }
+
+    TVMChannelID Scheduler::createChannel(unsigned int capacity)
+    {
+        for(unsigned int i = 0; i < NUM_CHANNEL_CHUNKS; i++)
+        {
+            if(channelChunks[i] == NULL)
+            {
+                // Filled in before it's published, findChannel can run at any point.
+                Channel** chunk = new Channel*[CHANNEL_CHUNK_SIZE];
+                for(unsigned int j = 0; j < CHANNEL_CHUNK_SIZE; j++)
+                {
+                    chunk[j] = NULL;
+                }
+
+                __atomic_store_n(&channelChunks[i], chunk, __ATOMIC_RELEASE);
+            }
+
+            for(unsigned int j = 0; j < CHANNEL_CHUNK_SIZE; j++)
+            {
+                if(channelChunks[i][j] == NULL)
+                {
+                    TVMChannelID channelID = i * CHANNEL_CHUNK_SIZE + j + 1;
+                    __atomic_store_n(&channelChunks[i][j], new Channel(channelID, capacity), __ATOMIC_RELEASE);
+                    return channelID;
+                }
+            }
+        }
+        return VM_CHANNEL_ID_INVALID;
+    }
+
+    Channel* Scheduler::findChannel(TVMChannelID channelID)
+    {
+        if(channelID == 0 || channelID > NUM_CHANNEL_CHUNKS * CHANNEL_CHUNK_SIZE)
+        {
+            return NULL;
+        }
+
+        Channel** chunk = __atomic_load_n(&channelChunks[(channelID - 1) / CHANNEL_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+        if(chunk == NULL)
+        {
+            return NULL;
+        }
+        return __atomic_load_n(&chunk[(channelID - 1) % CHANNEL_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+    }
+
+    void Scheduler::deleteChannel(TVMChannelID channelID)
+    {
+        Channel* channel = findChannel(channelID);
+        if(channel != NULL)
+        {
+            channelChunks[(channelID - 1) / CHANNEL_CHUNK_SIZE][(channelID - 1) % CHANNEL_CHUNK_SIZE] = NULL;
+
+            // A thread that found it before it left the table may still be using it.
+            channel->deleted = true;
+            retiredChannels.push_back(channel);
+            numRetiredChannels = retiredChannels.size();
+
+            reapChannels();
+        }
+    }
+
+    void Scheduler::reapChannels()
+    {
+        if(retiredChannels.empty())
+        {
+            return;
+        }
+
+        for(auto it = all_threads.begin(); it != all_threads.end(); ++it)
+        {
+            if((*it)->isInChannel())
+            {
+                return;
+            }
+        }
+
+        for(unsigned int i = 0; i < retiredChannels.size(); i++)
+        {
+            delete retiredChannels[i];
+        }
+        retiredChannels.clear();
+        numRetiredChannels = 0;
+    }
+
+    bool Scheduler::hasRetiredChannels()
+    {
+        return numRetiredChannels != 0;
+    }
 }
@@ -1,5 +1,10 @@
 #include "ThreadControlBlock.h"
 #include "Mutex.h"
+#include "Condition.h"
+#include "Semaphore.h"
+#include "RWLock.h"
+#include "Channel.h"
+#include "MemoryManager.h"
 #include <vector>
 
 #ifndef MY_SCHEDULER_H
@@ -9,9 +14,14 @@ extern "C"
 {
 
 #define VM_THREAD_PRIORITY_NONE 0
-#define NUM_WAITING_QUEUES	4
+#define NUM_WAITING_QUEUES	8
 #define NUM_READY_QUEUES        4
 
+// Channels live in a table of fixed size chunks that never move, so the
+// channel fast path can look one up without suspending signals.
+#define CHANNEL_CHUNK_SIZE      64
+#define NUM_CHANNEL_CHUNKS      64
+
 class Scheduler
 {
     private:
@@ -27,19 +37,84 @@ class Scheduler
         // Holds all mutexes.
         std::vector<Mutex*> mutexes; // All mutexes that have been created.
 
+        // Holds all condition variables, semaphores and reader-writer locks.
+        std::vector<Condition*> conditions;
+        std::vector<Semaphore*> semaphores;
+        std::vector<RWLock*> rwlocks;
+
+        // Holds all channels (indexed by ID - 1).
+        Channel** channelChunks[NUM_CHANNEL_CHUNKS];
+
+        // Deleted channels, kept until no thread is in a send or receive that
+        // could still be using one.
+        std::vector<Channel*> retiredChannels;
+        volatile unsigned int numRetiredChannels;
+
         // Currently running thread.
         ThreadControlBlock* current;
 
+        // Owns the queue of threads waiting on memory.
+        MemoryManager* memoryManager;
+
+        // Scheduler statistics.
+        volatile TVMTick ticks;
+        TVMTick idleTicks;
+        unsigned int contextSwitches;
+        unsigned int preemptions;
+
+        // Adds the time since the thread's last state change to stats.
+        void addStateTime(ThreadControlBlock* thread, SVMThreadStatsRef stats);
+
+        // Same, into the thread's own stats, and restarts its state clock.
+        void chargeState(ThreadControlBlock* thread);
+
     public:
        Scheduler();
        ~Scheduler();
 
        ThreadControlBlock* findThread(TVMThreadID tid); // Finds a thread.
 
+       void setMemoryManager(MemoryManager* manager);
+
        TVMMutexID createMutex();
        Mutex* findMutex(TVMMutexID mutexID);
        void deleteMutex(TVMMutexID mutexID);
 
+       // Releases a held mutex and hands it to the next waiter (which is made ready).
+       // Returns the new owner, or NULL if nobody was waiting. Does not reschedule.
+       ThreadControlBlock* handOffMutex(Mutex* mtx);
+
+       // Releases every mutex held by a thread being terminated.
+       bool releaseMutexes(TVMThreadID tid);
+
+       TVMConditionID createCondition();
+       Condition* findCondition(TVMConditionID conditionID);
+       void deleteCondition(TVMConditionID conditionID);
+
+       TVMSemaphoreID createSemaphore(unsigned int count);
+       Semaphore* findSemaphore(TVMSemaphoreID semaphoreID);
+       void deleteSemaphore(TVMSemaphoreID semaphoreID);
+
+       TVMRWLockID createRWLock();
+       RWLock* findRWLock(TVMRWLockID rwlockID);
+       void deleteRWLock(TVMRWLockID rwlockID);
+
+       // Wakes whoever can take the lock now, returns the highest priority one woken (or NULL).
+       ThreadControlBlock* grantRWLock(RWLock* lock);
+
+       // Drops every reader-writer lock hold of a thread being terminated.
+       bool releaseRWLocks(TVMThreadID tid);
+
+       TVMChannelID createChannel(unsigned int capacity); // VM_CHANNEL_ID_INVALID if the table is full.
+       Channel* findChannel(TVMChannelID channelID);      // Safe with signals enabled.
+
+       // Takes the channel out of the table. It's freed by reapChannels.
+       void deleteChannel(TVMChannelID channelID);
+
+       // Frees the deleted channels, unless a live thread is still in a send or receive.
+       void reapChannels();
+       bool hasRetiredChannels(); // Safe with signals enabled.
+
        void addThread(ThreadControlBlock* thread); // Adds a new thread to scheduler.
        void deleteThread(TVMThreadID tid);         // Removes a thread from the scheduler.
 
@@ -52,11 +127,29 @@ class Scheduler
        void addToWaiting(ThreadControlBlock* thread); // Adds a thread to the waiting queue.
        void removeFromWaiting(TVMThreadID tid);       // Removes a thread from the waiting queue.
 
+       // Moves a blocked thread to the ready queue, result is its wakeup status.
+       void wakeThread(ThreadControlBlock* thread, int result);
+
+       // Removes a blocked thread from the sync object it's queued on.
+       void detachWaiter(ThreadControlBlock* thread);
+
+       // Puts the current thread back to ready if thread has a higher priority.
+       void preemptFor(ThreadControlBlock* thread);
+
+       void processTimeouts(int reason); // Wakes threads in a queue whose timeout expired.
        void processAllWaiting(); // Process all the threads that are waiting.
        void scheduleNext();      // Scheduler next ready thread.
 
        void setCurrentThread(ThreadControlBlock* thread); // Set the current thread.
        ThreadControlBlock* getCurrentThread();            // Get the current thread.
+
+       // Changes a thread's state, accounting for the time spent in the old one.
+       void setThreadState(ThreadControlBlock* thread, TVMThreadState state);
+
+       void tick(); // Called once per alarm tick.
+
+       void getThreadStats(ThreadControlBlock* thread, SVMThreadStatsRef stats);
+       void getStats(SVMSchedulerStatsRef stats);
 };
 
 }
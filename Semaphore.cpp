@@ -0,0 +1,84 @@
+#include "Semaphore.h"
+
+extern "C"
+{
+    static ObjectSlab semaphoreSlab(sizeof(Semaphore), SLAB_CHUNK_OBJECTS);
+
+    void* Semaphore::operator new(size_t size)
+    {
+        return semaphoreSlab.allocate();
+    }
+
+    void Semaphore::operator delete(void* object)
+    {
+        semaphoreSlab.deallocate(object);
+    }
+
+    static TVMSemaphoreID nextSID = 1;
+
+    Semaphore::Semaphore(unsigned int count)
+    {
+        this->sid = nextSID;
+        nextSID++;
+
+        this->count = count;
+    }
+
+    Semaphore::~Semaphore()
+    {
+    }
+
+    // Adds the thread specified to the appropriate waiting queue.
+    void Semaphore::wantsSemaphore(ThreadControlBlock* thread)
+    {
+        thread->setWaitingOn(this->sid);
+        waiting[thread->getPriority()].push_back(thread);
+    }
+
+    // Removes and returns the highest priority waiter (NULL if none).
+    ThreadControlBlock* Semaphore::getNextWaiter()
+    {
+        ThreadControlBlock* waiter = NULL;
+        for(int i = VM_THREAD_PRIORITY_HIGH; i >= 0; i--)
+        {
+            if(!(waiting[i].empty()))
+            {
+                waiter = waiting[i].front();
+                waiting[i].erase(waiting[i].begin());
+                waiter->setWaitingOn(0);
+                break;
+            }
+        }
+        return waiter;
+    }
+
+    // Remove a thread from the waiting queue.
+    bool Semaphore::stopWaiting(TVMThreadID tid)
+    {
+        for(unsigned int i = 0; i < NUM_PRIORITIES; i++)
+        {
+            for(unsigned int j = 0; j < waiting[i].size(); j++)
+            {
+                if(waiting[i][j]->getTID() == tid)
+                {
+                    waiting[i][j]->setWaitingOn(0);
+                    waiting[i].erase(waiting[i].begin() + j);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool Semaphore::hasWaiters()
+    {
+        for(unsigned int i = 0; i < NUM_PRIORITIES; i++)
+        {
+            if(!(waiting[i].empty()))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
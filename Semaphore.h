@@ -0,0 +1,37 @@
+#include "ThreadControlBlock.h"
+#include "Mutex.h"
+#include <vector>
+
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+extern "C"
+{
+
+class Semaphore
+{
+    public:
+        TVMSemaphoreID sid;  // The Semaphore's ID.
+        unsigned int count;  // Units currently available.
+
+        std::vector<ThreadControlBlock*> waiting[NUM_PRIORITIES];
+
+        Semaphore(unsigned int count);
+        ~Semaphore();
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
+
+        // Adds the thread specified to the appropriate waiting queue.
+        void wantsSemaphore(ThreadControlBlock* thread);
+
+        // Removes and returns the highest priority waiter (NULL if none).
+        ThreadControlBlock* getNextWaiter();
+
+        // Remove a thread from the waiting queue, returns true if it was waiting.
+        bool stopWaiting(TVMThreadID tid);
+
+        bool hasWaiters();
+};
+}
+
+#endif
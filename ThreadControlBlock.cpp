@@ -1,7 +1,20 @@
 #include "ThreadControlBlock.h"
+#include <string.h>
 
 extern "C"
 {
+    static ObjectSlab threadSlab(sizeof(ThreadControlBlock), SLAB_CHUNK_OBJECTS);
+
+    void* ThreadControlBlock::operator new(size_t size)
+    {
+        return threadSlab.allocate();
+    }
+
+    void ThreadControlBlock::operator delete(void* object)
+    {
+        threadSlab.deallocate(object);
+    }
+
     static TVMThreadID nextTID = 1;
 
     ThreadControlBlock::ThreadControlBlock(TVMThreadEntry entry, void* parameters,
@@ -35,8 +48,13 @@ extern "C"
         this->state = VM_THREAD_STATE_DEAD;
         this->ticksLeft = 0;
         this->mWants    = 0;
+        this->waitingOn = 0;
 
         this->infiniteFlag = false;
+        this->inChannel    = false;
+
+        memset(&(this->stats), 0, sizeof(this->stats));
+        this->stateSince = 0;
     }
 
     ThreadControlBlock::~ThreadControlBlock()
@@ -127,16 +145,14 @@ extern "C"
         this->mWants = mtxid;
     }
 
-    bool ThreadControlBlock::hasMutex()
+    unsigned int ThreadControlBlock::getWaitingOn()
     {
-        for(unsigned int i = 0; i < mHeld.size(); i++)
-        {
-            if(mWants == mHeld[i])
-            {
-                return true;
-            }
-        }
-        return false;
+        return this->waitingOn;
+    }
+
+    void ThreadControlBlock::setWaitingOn(unsigned int id)
+    {
+        this->waitingOn = id;
     }
 
     void ThreadControlBlock::setInfiniteFlag(bool flag)
@@ -144,8 +160,38 @@ extern "C"
         this->infiniteFlag = flag;
     }
 
+    void ThreadControlBlock::setInChannel(bool flag)
+    {
+        this->inChannel = flag;
+    }
+
+    bool ThreadControlBlock::isInChannel()
+    {
+        return this->inChannel;
+    }
+
     void* ThreadControlBlock::getStackAddr()
     {
         return this->stackaddr;
     }
+
+    SVMThreadStatsRef ThreadControlBlock::getStats()
+    {
+        return &(this->stats);
+    }
+
+    TVMTick ThreadControlBlock::getStateSince()
+    {
+        return this->stateSince;
+    }
+
+    void ThreadControlBlock::setStateSince(TVMTick tick)
+    {
+        this->stateSince = tick;
+    }
+
+    std::vector<MemoryMagazine>& ThreadControlBlock::getMagazines()
+    {
+        return this->magazines;
+    }
 }
@@ -1,5 +1,7 @@
 #include "Machine.h"
 #include "VirtualMachine.h"
+#include "MemoryPool.h"
+#include "FixedPool.h"
 #include <vector>
 
 #ifndef THREAD_CONTROL_BLOCK_H
@@ -8,8 +10,12 @@
 extern "C"
 {
 
-#define NOTHING 4
+#define NOTHING 0xFF
 
+#define WAITING_CHANNEL   7
+#define WAITING_RWLOCK    6
+#define WAITING_SEMAPHORE 5
+#define WAITING_CONDITION 4
 #define WAITING_MEMORY 3
 #define WAITING_SLEEP  2
 #define WAITING_MUTEX  1
@@ -57,10 +63,14 @@ class ThreadControlBlock
         volatile TVMTick        ticksLeft;
         volatile int            result;
         volatile TVMMutexID     mWants;  // Mutex that thread wants.
+        volatile unsigned int   waitingOn; // Condition/semaphore/rwlock/channel the thread is blocked on.
         volatile bool           infiniteFlag;
+        volatile bool           inChannel; // In a channel send or receive, see Scheduler::reapChannels.
 
-    public:
-        std::vector<TVMMutexID> mHeld;   // Mutex that thread holds.
+        SVMThreadStats          stats;      // CPU accounting, kept up to date by the scheduler.
+        TVMTick                 stateSince; // Scheduler tick at which the thread entered its state.
+
+        std::vector<MemoryMagazine> magazines; // Small blocks this thread freed, by pool and size.
 
     public:
         // Default state is VM_THREAD_STATE_DEAD.
@@ -69,6 +79,8 @@ class ThreadControlBlock
                            TVMMemorySize memsize, TVMThreadIDRef tidref);
 
         ~ThreadControlBlock();
+        static void* operator new(size_t size);
+        static void operator delete(void* object);
 
         // Called in VMThreadActivate to create the context of the thread.
         void ThreadCreateContext();
@@ -97,9 +109,19 @@ class ThreadControlBlock
         TVMMutexID getMutexWants();           // Returns the mutex the thread is waiting for.
         void setMutexWants(TVMMutexID mtxid); // Sets the mutex the thread wants.
 
-        bool hasMutex();
+        unsigned int getWaitingOn();         // Returns the sync object being waited on.
+        void setWaitingOn(unsigned int id);  // Sets the sync object being waited on.
 
         void setInfiniteFlag(bool flag);
+
+        void setInChannel(bool flag);
+        bool isInChannel();
+
+        SVMThreadStatsRef getStats();
+        TVMTick getStateSince();
+        void setStateSince(TVMTick tick);
+
+        std::vector<MemoryMagazine>& getMagazines();
 };
 
 }
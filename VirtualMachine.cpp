@@ -2,6 +2,9 @@
 #include "MemoryManager.h"
 #include "Machine.h"
 #include "FileSystem.h"
+#include "ClusterCache.h"
+#include "DentryCache.h"
+#include "Journal.h"
 #include <sys/types.h>
 #include <fcntl.h>
 #include <math.h>
@@ -15,10 +18,13 @@ extern "C"
     TVMMainEntry VMLoadModule(const char* module);
     void VMUnloadModule();
     void fileHandler(void* calldata, int result);
+    uint8_t* createEntry(uint16_t parent, const char* name, uint8_t attributes, Dentry** dentry);
 
     Scheduler* myScheduler;
     MemoryManager* myMemoryManager;
     FileSystem* myFileSystem;
+    ClusterCache* myClusterCache;
+    DentryCache* myDentryCache;
 
     volatile TVMTick tickCount = 0;
     volatile int tickTime;
@@ -28,20 +34,144 @@ extern "C"
 
     const TVMMemoryPoolID VM_MEMORY_POOL_ID_SYSTEM = 1;
 
+    // Stack for the threads the VM runs for itself. It comes out of the application's
+    // heap, so it's only as big as their I/O needs: a machine call's message buffer,
+    // and another for a signal arriving during it.
+    const TVMMemorySize INTERNAL_THREAD_STACK_SIZE = 0x30000;
+
+    // Kept up to date by the scheduler for the inline mutex fast path.
+    volatile TVMThreadID VMCurrentThreadID = 0;
+
     TVMMemoryPoolID heapID;
     TVMMemoryPoolID stackID;
 
-    TVMMutexID FILE_SYSTEM_MUTEX;
+    TVMRWLockID FILE_SYSTEM_LOCK;
 
     vector<Directory*> openDirectories;
     vector<File*> openFiles;
-    vector<Cluster*> cachedClusters;
+    TVMThreadID flusherID;
+    TVMThreadID readAheadID;
+
+    // Clusters sequential readers will want soon, loaded by readAhead.
+    vector<uint16_t> readAheadQueue;
+    TVMSemaphoreID readAheadSemaphore;
 
     void idle(void* param)
     {
         while(1);
     }
 
+    // Brings the image fully up to date: the log is committed before the directory clusters it
+    // covers go out, and the FAT and root are written back after them. Needs the lock exclusively.
+    void checkpointMetadata()
+    {
+        myFileSystem->journal->commit();
+        myClusterCache->flush();
+        myFileSystem->journal->checkpoint();
+    }
+
+    // Commits the metadata changed since last time to the log as one transaction and
+    // writes dirty clusters back, checkpointing once the log is big enough. Needs the
+    // lock exclusively.
+    void writeBack()
+    {
+        myFileSystem->journal->commit();
+
+        if(myClusterCache->dirtyCount() != 0)
+        {
+            myClusterCache->flush();
+        }
+
+        if(myFileSystem->journal->size() >= JOURNAL_CHECKPOINT_BYTES)
+        {
+            myFileSystem->journal->checkpoint();
+        }
+    }
+
+    // Writes back every so often, so little is lost if we go down.
+    void clusterFlusher(void* param)
+    {
+        while(1)
+        {
+            VMThreadSleep(CLUSTER_FLUSH_INTERVAL);
+
+            grabExclusive();
+            writeBack();
+            releaseLock();
+        }
+    }
+
+    // Loads queued clusters while their readers get on with the ones already cached.
+    void readAhead(void* param)
+    {
+        while(1)
+        {
+            VMSemaphoreAcquire(readAheadSemaphore, VM_TIMEOUT_INFINITE);
+
+            TMachineSignalState sigstate;
+            MachineSuspendSignals(&sigstate);
+
+            vector<uint16_t> clusters;
+            clusters.swap(readAheadQueue);
+
+            MachineResumeSignals(&sigstate);
+
+            // A cluster at a time, so a reader after one that's cached only waits for one read.
+            for(unsigned int i = 0; i < clusters.size(); i++)
+            {
+                grabExclusive();
+                myClusterCache->prefetch(clusters[i]);
+                releaseLock();
+            }
+        }
+    }
+
+    // Queues the clusters among the window following clusterNum in its chain that
+    // aren't cached. Nothing is queued until less than half the window is left, so
+    // the reads go out in runs instead of a cluster at a time.
+    void queueReadAhead(uint16_t clusterNum, unsigned int window)
+    {
+        if(readAheadID == VM_THREAD_ID_INVALID)
+        {
+            return;
+        }
+
+        bool wasEmpty = readAheadQueue.empty();
+        unsigned int cachedAhead = 0;
+        vector<uint16_t> wanted;
+
+        for(unsigned int i = 0; i < window; i++)
+        {
+            clusterNum = myFileSystem->FatTable[clusterNum];
+
+            if(clusterNum < 2 || clusterNum >= 0xFFF7)
+            {
+                break;
+            }
+
+            if(!myClusterCache->contains(clusterNum))
+            {
+                wanted.push_back(clusterNum);
+            }
+            else if(wanted.empty())
+            {
+                cachedAhead++;
+            }
+        }
+
+        if(cachedAhead * 2 >= window)
+        {
+            return;
+        }
+
+        readAheadQueue.insert(readAheadQueue.end(), wanted.begin(), wanted.end());
+
+        if(wasEmpty && !readAheadQueue.empty())
+        {
+            VMSemaphoreRelease(readAheadSemaphore);
+        }
+    }
+
     void waitForIO()
     {
         ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
@@ -50,6 +180,42 @@ extern "C"
         myScheduler->scheduleNext();
     }
 
+    // Hands memory just freed in a pool to the threads blocked on it.
+    void wakeMemoryWaiters(BasePool* memPool)
+    {
+        vector<ThreadControlBlock*> granted;
+        myMemoryManager->grant_waiters(memPool, granted);
+
+        for(unsigned int i = 0; i < granted.size(); i++)
+        {
+            myScheduler->wakeThread(granted[i], VM_STATUS_SUCCESS);
+        }
+
+        if(!granted.empty())
+        {
+            myScheduler->preemptFor(granted[0]);
+        }
+    }
+
+    // Allocates from the current thread's magazine or the pool, taking back what the
+    // threads are holding on to if it's out of room. Counts successes, not failures.
+    bool tryAllocate(BasePool* memPool, TVMMemorySize size, void** pointer)
+    {
+        if(!myMemoryManager->cache_allocate(myScheduler->getCurrentThread(), memPool, size, pointer)
+           && !memPool->allocate_memory(pointer, size))
+        {
+            myMemoryManager->flush_pool(memPool->getMemID());
+
+            if(!memPool->allocate_memory(pointer, size))
+            {
+                return false;
+            }
+        }
+
+        memPool->countAllocation(size);
+        return true;
+    }
+
 /*******************************************************************************************************
                                         File Functions/Classes
 *******************************************************************************************************/
@@ -358,66 +524,6 @@ extern "C"
         }
     }
 	
-    Cluster* findCachedCluster(uint16_t clusterNum)
-    {
-       Cluster* cluster = NULL;
-
-       for(unsigned int i = 0; i < cachedClusters.size(); i++)
-       {
-           if(cachedClusters[i]->clusterNum == clusterNum)
-           {
-               cluster = cachedClusters[i];
-               break;
-           }
-       }
-       return cluster;
-
-    }
-
-    void createCachedCluster(Cluster* clus, uint16_t clusterNum)
-    {
-        clus->data = new uint8_t[myFileSystem->BytesPerSector * myFileSystem->SectorsPerCluster];
-        clus->clusterNum = clusterNum;
-
-        unsigned int seekPosition = myFileSystem->FirstDataSector * SECTOR_SIZE + (clusterNum - 2) * myFileSystem->SectorsPerCluster * myFileSystem->BytesPerSector;
-
-        MachineFileSeek(myFileSystem->fileDescriptor, seekPosition, 0, fileHandler, (void*)myScheduler->getCurrentThread());
-        waitForIO();
-
-        uint8_t* position = clus->data;
-
-        for(unsigned int i = 0; i < myFileSystem->SectorsPerCluster; i++)
-        {
-            MachineFileRead(myFileSystem->fileDescriptor, myFileSystem->base, MAX_READ_SIZE, fileHandler, (void*)myScheduler->getCurrentThread());
-            waitForIO();
-
-            memcpy(position, myFileSystem->base, MAX_READ_SIZE);
-            position += MAX_READ_SIZE;
-        }
-    }
-
-    void deleteCachedCluster(Cluster* clus)
-    {
-        unsigned int seekPosition = myFileSystem->FirstDataSector * SECTOR_SIZE + (clus->clusterNum - 2) * myFileSystem->SectorsPerCluster * myFileSystem->BytesPerSector;
-
-        MachineFileSeek(myFileSystem->fileDescriptor, seekPosition, 0, fileHandler, (void*)myScheduler->getCurrentThread());
-        waitForIO();
-
-        uint8_t* position = clus->data;
-
-        // Write cluster back.
-        for(unsigned int i = 0; i < myFileSystem->SectorsPerCluster; i++)
-        {
-            memcpy(myFileSystem->base, position, MAX_WRITE_SIZE);
-            position += MAX_WRITE_SIZE;
-
-            MachineFileWrite(myFileSystem->fileDescriptor, myFileSystem->base, MAX_WRITE_SIZE, fileHandler, (void*)myScheduler->getCurrentThread());
-            waitForIO();
-       	}
-
-        delete[] clus->data;
-    }
-
     Directory* findOpenDir(int dirdesc)
     {
        Directory* dir = NULL;
@@ -484,6 +590,7 @@ extern "C"
         MachineSuspendSignals(&sigstate);
 
         tickCount++;
+        myScheduler->tick();
         myScheduler->processAllWaiting();
         myScheduler->addToReady(myScheduler->getCurrentThread());
         myScheduler->scheduleNext();
@@ -510,13 +617,14 @@ extern "C"
 
         myScheduler = new Scheduler();
         myMemoryManager = new MemoryManager();
+        myScheduler->setMemoryManager(myMemoryManager);
 
         tickTime = tickms;
 
         uint8_t* systemHeap = new uint8_t[heapsize];
 
-        myMemoryManager->add_pool((void*)systemHeap, heapsize, &heapID);
-        myMemoryManager->add_pool(sharedmem, sharedsize, &stackID);
+        myMemoryManager->add_pool((void*)systemHeap, heapsize, VM_MEMORY_POOL_GRANULE_DEFAULT, &heapID);
+        myMemoryManager->add_pool(sharedmem, sharedsize, VM_MEMORY_POOL_GRANULE_DEFAULT, &stackID);
 
         // Create main thread & put it into scheduler.
         ThreadControlBlock* mainThread = new ThreadControlBlock(NULL, NULL, VM_THREAD_PRIORITY_NORMAL,
@@ -542,8 +650,8 @@ extern "C"
         myScheduler->addToReady(idleThread);
 
 
-        // Create a mutex for the file system.
-        VMMutexCreate(&FILE_SYSTEM_MUTEX);
+        // Create a reader-writer lock for the file system.
+        VMRWLockCreate(&FILE_SYSTEM_LOCK);
 
         // Allocate a 512 Byte block for the FileSystem in shared memory.
         void* fileSystemBase;
@@ -569,9 +677,33 @@ extern "C"
         }
 
         myFileSystem = new FileSystem((char*)mount, fileDescriptor, fileSystemBase, myScheduler);
+        myClusterCache = new ClusterCache(myFileSystem, CLUSTER_CACHE_BYTES);
+        myDentryCache = new DentryCache(myFileSystem, myClusterCache);
 
         MachineResumeSignals(&sigstate);
 
+        // Without room for the flusher, files are written back as they're closed instead.
+        if(VMThreadCreate(clusterFlusher, NULL, INTERNAL_THREAD_STACK_SIZE, VM_THREAD_PRIORITY_LOW, &flusherID) == VM_STATUS_SUCCESS)
+        {
+            VMThreadActivate(flusherID);
+        }
+        else
+        {
+            flusherID = VM_THREAD_ID_INVALID;
+        }
+
+        // High priority so its reads are under way as soon as they're queued.
+        VMSemaphoreCreate(&readAheadSemaphore, 0);
+        // Without room for it, reads just aren't read ahead.
+        if(VMThreadCreate(readAhead, NULL, INTERNAL_THREAD_STACK_SIZE, VM_THREAD_PRIORITY_HIGH, &readAheadID) == VM_STATUS_SUCCESS)
+        {
+            VMThreadActivate(readAheadID);
+        }
+        else
+        {
+            readAheadID = VM_THREAD_ID_INVALID;
+        }
+
         MachineEnableSignals();
         MachineRequestAlarm(tickTime * 1000, alarmHandler, NULL);
 
@@ -590,19 +722,32 @@ extern "C"
         }
         openFiles.clear();
 
-        for(unsigned int i = 0; i < cachedClusters.size(); i++)
+        // Stop the flusher and read ahead once they're not in the middle of any I/O, then do the last writeback.
+        grabExclusive();
+        if(flusherID != VM_THREAD_ID_INVALID)
+        {
+            VMThreadTerminate(flusherID);
+        }
+
+        if(readAheadID != VM_THREAD_ID_INVALID)
         {
-            deleteCachedCluster(cachedClusters[i]);
-            delete cachedClusters[i];
+            VMThreadTerminate(readAheadID);
         }
+        checkpointMetadata();
+        releaseLock();
 
-        // Delete the file system mutex.
-        VMMutexDelete(FILE_SYSTEM_MUTEX);
+        VMSemaphoreDelete(readAheadSemaphore);
 
-        VMMemoryPoolDeallocate(stackID, fileSystemBase);
+        delete myDentryCache;
+        delete myClusterCache;
 
+        // Write back the file system before deleting its lock.
         delete myFileSystem;
 
+        VMRWLockDelete(FILE_SYSTEM_LOCK);
+
+        VMMemoryPoolDeallocate(stackID, fileSystemBase);
+
         MachineFileClose(fileDescriptor, fileHandler, (void*)myScheduler->getCurrentThread());
         waitForIO();
 
@@ -667,6 +812,148 @@ extern "C"
         DTStruct->DHundredth = (unsigned char)timetenth;
     }
 
+    // Fills in everything about the file with short name entry entry but its long name.
+    void readDirectoryEntry(SVMDirectoryEntryRef dirent, uint8_t* entry)
+    {
+        SFN_to_Normal(dirent->DShortFileName, (char*)entry);
+
+        dirent->DSize = *(unsigned int*)(entry + DIR_FILE_SIZE);
+        dirent->DAttributes = *(unsigned char*)(entry + DIR_ATTR);
+
+        parseDate(*(uint16_t*)(entry + DIR_CRT_DATE), &dirent->DCreate);
+        parseTime(*(uint16_t*)(entry + DIR_CRT_TIME), 0, &dirent->DCreate);
+
+        parseDate(*(uint16_t*)(entry + DIR_LAST_ACC_DATE), &dirent->DAccess);
+        parseTime(0, 0, &dirent->DCreate);
+
+        parseDate(*(uint16_t*)(entry + DIR_WRITE_DATE), &dirent->DModify);
+        parseTime(*(uint16_t*)(entry + DIR_WRITE_TIME), 0, &dirent->DModify);
+    }
+
+    // Simplified absolute form of path, which is either absolute or relative to the working directory.
+    TVMStatus absolutePath(char* abspath, const char* path)
+    {
+        if(VMFileSystemIsAbsolutePath(path) != VM_STATUS_SUCCESS)
+        {
+            return VMFileSystemSimplifyPath(abspath, myFileSystem->getCWD(), path);
+        }
+
+        if(path[1] == '\0')
+        {
+            abspath[0] = VM_FILE_SYSTEM_DIRECTORY_DELIMETER; // '/'
+            abspath[1] = '\0';
+            return VM_STATUS_SUCCESS;
+        }
+
+        return VMFileSystemSimplifyPath(abspath, "/", path + 1);
+    }
+
+    // Splits path into the absolute path of the directory it's in and its last name.
+    TVMStatus splitPath(const char* path, char* dirname, char* name)
+    {
+        char abspath[VM_FILE_SYSTEM_MAX_PATH + 1];
+
+        if(absolutePath(abspath, path) != VM_STATUS_SUCCESS ||
+           VMFileSystemDirectoryFromFullPath(dirname, abspath) != VM_STATUS_SUCCESS ||
+           VMFileSystemFileFromFullPath(name, abspath) != VM_STATUS_SUCCESS || name[0] == '\0')
+        {
+            return VM_STATUS_FAILURE;
+        }
+
+        return VM_STATUS_SUCCESS;
+    }
+
+    // Short name entry of the file called name in the directory starting at parent
+    // (NO_CLUSTER for the root), or NULL if there's none. Outside the root dentry is set
+    // to where the entry came from, in it to NULL. Needs the file system lock exclusively.
+    uint8_t* lookupEntry(uint16_t parent, const char* name, Dentry** dentry)
+    {
+        char sfname[VM_FILE_SYSTEM_SFN_SIZE + 1];
+        Normal_to_SFN(sfname, name, false);
+
+        unsigned int namesize = 0;
+
+        // Finds how long the name is (not including extension).
+        while(name[namesize] != '.' && namesize < strlen(name))
+        {
+            namesize++;
+        }
+
+        // Only names that fit in 8.3 can be looked up by their short name.
+        const char* shortName = (namesize <= 8) ? sfname : NULL;
+
+        *dentry = NULL;
+
+        if(parent == NO_CLUSTER)
+        {
+            return myFileSystem->findEntry(name, shortName);
+        }
+
+        *dentry = myDentryCache->lookup(parent, name, shortName);
+
+        return (*dentry != NULL) ? (*dentry)->entry : NULL;
+    }
+
+    // Sends a changed entry found by lookupEntry back toward the image: through its directory's
+    // cluster if it's in a subdirectory, by marking its sector dirty if it's in the root. Needs
+    // the file system lock exclusively.
+    void syncEntry(uint8_t* entry, Dentry* dentry)
+    {
+        if(dentry != NULL)
+        {
+            myDentryCache->sync(dentry);
+        }
+        else
+        {
+            myFileSystem->markRootDirty(entry, 1);
+        }
+    }
+
+    // Finds the first cluster of the directory at abspath (NO_CLUSTER for the root), walking
+    // it a name at a time. False if any part of it isn't a directory. Needs the file system
+    // lock exclusively, directories not seen yet are read into the dentry cache.
+    bool resolveDirectory(const char* abspath, uint16_t* cluster)
+    {
+        char name[VM_FILE_SYSTEM_MAX_PATH + 1];
+        uint16_t parent = NO_CLUSTER;
+
+        while(*abspath != '\0')
+        {
+            if(*abspath == VM_FILE_SYSTEM_DIRECTORY_DELIMETER)
+            {
+                abspath++;
+                continue;
+            }
+
+            unsigned int length = 0;
+            while(abspath[length] != '\0' && abspath[length] != VM_FILE_SYSTEM_DIRECTORY_DELIMETER)
+            {
+                name[length] = abspath[length];
+                length++;
+            }
+            name[length] = '\0';
+            abspath += length;
+
+            Dentry* dentry;
+            uint8_t* entry = lookupEntry(parent, name, &dentry);
+
+            if(entry == NULL || (entry[DIR_ATTR] & ATTR_DIRECTORY) == 0)
+            {
+                return false;
+            }
+
+            parent = *(uint16_t*)(entry + DIR_FIRST_CLUS_LO);
+
+            if(parent < 2 || parent >= 0xFFF7)
+            {
+                return false;
+            }
+        }
+
+        *cluster = parent;
+        return true;
+    }
+
     TVMStatus VMDirectoryOpen(const char* dirname, int* dirdescriptor)
     {
         TMachineSignalState sigstate;
@@ -678,8 +965,20 @@ extern "C"
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        // If dirname is not root return failure.
-        if(strcmp(dirname, "/") != 0)
+        char abspath[VM_FILE_SYSTEM_MAX_PATH + 1];
+        uint16_t cluster;
+
+        if(absolutePath(abspath, dirname) != VM_STATUS_SUCCESS)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+
+        grabExclusive();
+        bool found = resolveDirectory(abspath, &cluster);
+        releaseLock();
+
+        if(!found)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_FAILURE;
@@ -693,10 +992,15 @@ extern "C"
         *dirdescriptor = dir->dirdescriptor;
         nextDirDescriptor++;
 
-        dir->isRoot = true;
+        dir->isRoot = (cluster == NO_CLUSTER);
         dir->currEntry = myFileSystem->getRoot();
 
-        while(*dir->currEntry == 0xE5 || *dir->currEntry == 0x00 || dir->currEntry[DIR_ATTR] == ATTR_LONG_NAME)
+        // Subdirectories are read straight from their clusters.
+        dir->startingCluster = cluster;
+        dir->currentCluster  = cluster;
+        dir->currentOffset   = 0;
+
+        while(dir->isRoot && (*dir->currEntry == 0xE5 || *dir->currEntry == 0x00 || dir->currEntry[DIR_ATTR] == ATTR_LONG_NAME))
         {
             // No entries can be found.
             if(*dir->currEntry == 0x00 || dir->currEntry == myFileSystem->getRoot() + myFileSystem->RootEntryCount * BYTES_PER_ENTRY)
@@ -704,7 +1008,7 @@ extern "C"
                 dir->currEntry = myFileSystem->getRoot() + myFileSystem->RootEntryCount * BYTES_PER_ENTRY;
                 break;
             }
-            else if(dir->currEntry[DIR_ATTR] == ATTR_LONG_NAME && (dir->currEntry[0] & 0x40)  == 0x40)
+            else if(*dir->currEntry != 0xE5 && dir->currEntry[DIR_ATTR] == ATTR_LONG_NAME && (dir->currEntry[0] & 0x40) == 0x40)
             {
                 break;
             }
@@ -764,19 +1068,7 @@ extern "C"
         {
             // Read in next entry.
             getLFN(&dir->currEntry, dirent->DLongFileName);
-            SFN_to_Normal(dirent->DShortFileName, (char*)dir->currEntry);
-
-            dirent->DSize = *(unsigned int*)(dir->currEntry + DIR_FILE_SIZE);
-            dirent->DAttributes = *(unsigned char*)(dir->currEntry + DIR_ATTR);
-
-            parseDate(*(uint16_t*)(dir->currEntry + DIR_CRT_DATE), &dirent->DCreate);
-            parseTime(*(uint16_t*)(dir->currEntry + DIR_CRT_TIME), 0, &dirent->DCreate);
-
-            parseDate(*(uint16_t*)(dir->currEntry + DIR_LAST_ACC_DATE), &dirent->DAccess);
-            parseTime(0, 0, &dirent->DCreate);
-
-            parseDate(*(uint16_t*)(dir->currEntry + DIR_WRITE_DATE), &dirent->DModify);
-            parseTime(*(uint16_t*)(dir->currEntry + DIR_WRITE_TIME), 0, &dirent->DModify);
+            readDirectoryEntry(dirent, dir->currEntry);
 
             // Set the directories current entry to the next available one (if one exists)
             dir->currEntry += BYTES_PER_ENTRY;
@@ -788,7 +1080,7 @@ extern "C"
                     dir->currEntry = myFileSystem->getRoot() + myFileSystem->RootEntryCount * BYTES_PER_ENTRY;
                    break;
                 }
-                else if(dir->currEntry[DIR_ATTR] == ATTR_LONG_NAME && (dir->currEntry[0] & 0x40)  == 0x40)
+                else if(*dir->currEntry != 0xE5 && dir->currEntry[DIR_ATTR] == ATTR_LONG_NAME && (dir->currEntry[0] & 0x40) == 0x40)
                 {
                     break;
                 }
@@ -796,6 +1088,24 @@ extern "C"
                 dir->currEntry += BYTES_PER_ENTRY;
             }
         }
+        else if(!dir->isRoot)
+        {
+            Dentry found;
+
+            grabExclusive();
+            bool more = myDentryCache->nextEntry(&dir->currentCluster, &dir->currentOffset, &found);
+            releaseLock();
+
+            if(!more)
+            {
+                MachineResumeSignals(&sigstate);
+                return VM_STATUS_FAILURE;
+            }
+
+            strncpy(dirent->DLongFileName, found.longName.c_str(), VM_FILE_SYSTEM_MAX_PATH - 1);
+            dirent->DLongFileName[VM_FILE_SYSTEM_MAX_PATH - 1] = '\0';
+            readDirectoryEntry(dirent, found.entry);
+        }
         else
         {
             MachineResumeSignals(&sigstate);
@@ -834,7 +1144,7 @@ extern "C"
                     dir->currEntry = myFileSystem->getRoot() + myFileSystem->RootEntryCount * BYTES_PER_ENTRY;
                     break;
                 }
-                else if(dir->currEntry[DIR_ATTR] == ATTR_LONG_NAME && (dir->currEntry[0] & 0x40)  == 0x40)
+                else if(*dir->currEntry != 0xE5 && dir->currEntry[DIR_ATTR] == ATTR_LONG_NAME && (dir->currEntry[0] & 0x40) == 0x40)
                 {
                     break;
                 }
@@ -842,6 +1152,11 @@ extern "C"
                 dir->currEntry += BYTES_PER_ENTRY;
             }
         }
+        else
+        {
+            dir->currentCluster = dir->startingCluster;
+            dir->currentOffset  = 0;
+        }
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
@@ -877,1349 +1192,2740 @@ extern "C"
 
         char newCWD[VM_FILE_SYSTEM_MAX_PATH + 1];
 
-        TVMStatus status = VM_STATUS_SUCCESS;
+        uint16_t cluster;
 
-        if(VMFileSystemIsAbsolutePath(path) == VM_STATUS_SUCCESS && path[1] != '\0') // Dealing with an absolute path.
+        if(absolutePath(newCWD, path) != VM_STATUS_SUCCESS)
         {
-            status = VMFileSystemGetAbsolutePath(newCWD, myFileSystem->getCWD(), path + 1);
-        }
-        else
-        {
-            status = VMFileSystemGetAbsolutePath(newCWD, myFileSystem->getCWD(), path);
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
         }
 
-        if(status  == VM_STATUS_SUCCESS && strcmp(newCWD, "/") == 0)
-        {
-            char* currDir = myFileSystem->getCWD();
+        grabExclusive();
+        bool found = resolveDirectory(newCWD, &cluster);
+        releaseLock();
 
-            currDir[0] = VM_FILE_SYSTEM_DIRECTORY_DELIMETER; // '/'
-            currDir[1] = '\0';
-        }
-        else
+        if(!found)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_FAILURE;
         }
 
+        strcpy(myFileSystem->getCWD(), newCWD);
+
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    // Extra Credit
-    TVMStatus VMDirectoryCreate(const char* dirname)
+    // True if the directory starting at cluster has nothing in it but "." and "..".
+    bool directoryEmpty(uint16_t cluster)
     {
-        TMachineSignalState sigstate;
-        MachineSuspendSignals(&sigstate);
+        unsigned int offset = 0;
+        Dentry found;
 
-        MachineResumeSignals(&sigstate);
-        return VM_STATUS_SUCCESS;
+        while(myDentryCache->nextEntry(&cluster, &offset, &found))
+        {
+            if(found.entry[0] != '.')
+            {
+                return false;
+            }
+        }
+
+        return true;
     }
 
-    // Extra Credit
-    TVMStatus VMDirectoryUnlink(const char* path)
+    // Whether the file or directory whose short name entry is entry has to stay: it's
+    // open, it's the working directory, or it's a directory with something in it.
+    bool entryBusy(uint8_t* entry)
     {
-        TMachineSignalState sigstate;
-        MachineSuspendSignals(&sigstate);
-
-        MachineResumeSignals(&sigstate);
-        return VM_STATUS_SUCCESS;
-    }
+        uint16_t firstCluster = *(uint16_t*)(entry + DIR_FIRST_CLUS_LO);
 
+        if((entry[DIR_ATTR] & ATTR_VOLUME_ID) != 0)
+        {
+            return true;
+        }
 
-/*******************************************************************************************************
-                                       	Memory Pool Functions
-*******************************************************************************************************/
+        if((entry[DIR_ATTR] & ATTR_DIRECTORY) == 0)
+        {
+            for(unsigned int i = 0; i < openFiles.size(); i++)
+            {
+                if(openFiles[i]->entry == entry)
+                {
+                    return true;
+                }
+            }
 
-    TVMStatus VMMemoryPoolCreate(void* base, TVMMemorySize size, TVMMemoryPoolIDRef memory)
-    {
-        TMachineSignalState sigstate;
-        MachineSuspendSignals(&sigstate);
+            return false;
+        }
 
-        if(base == NULL || memory == NULL || size == 0)
+        for(unsigned int i = 0; i < openDirectories.size(); i++)
         {
-            MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_PARAMETER;
+            if(!openDirectories[i]->isRoot && openDirectories[i]->startingCluster == firstCluster)
+            {
+                return true;
+            }
         }
 
-        myMemoryManager->add_pool(base, size, memory);
+        uint16_t cwdCluster;
 
-        MachineResumeSignals(&sigstate);
-        return VM_STATUS_SUCCESS;
+        if(resolveDirectory(myFileSystem->getCWD(), &cwdCluster) && cwdCluster == firstCluster)
+        {
+            return true;
+        }
+
+        return !directoryEmpty(firstCluster);
     }
 
-    TVMStatus VMMemoryPoolDelete(TVMMemoryPoolID memory)
+    // Extra Credit
+    TVMStatus VMDirectoryCreate(const char* dirname)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        MemoryPool* memPool = myMemoryManager->find_pool(memory);
-
-        if(memPool == NULL)
+        if(dirname == NULL)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        // Check that it's fully deallocated.
-        if(memPool->query_remaining() != memPool->getMemSize())
+        char parentname[VM_FILE_SYSTEM_MAX_PATH + 1];
+        char name[VM_FILE_SYSTEM_MAX_PATH + 1];
+
+        if(splitPath(dirname, parentname, name) != VM_STATUS_SUCCESS)
         {
             MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_STATE;
+            return VM_STATUS_FAILURE;
         }
 
-        myMemoryManager->delete_pool(memory);
-
-        MachineResumeSignals(&sigstate);
-        return VM_STATUS_SUCCESS;
-    }
+        grabExclusive();
 
-    TVMStatus VMMemoryPoolQuery(TVMMemoryPoolID memory, TVMMemorySizeRef bytesleft)
-    {
-        TMachineSignalState sigstate;
-        MachineSuspendSignals(&sigstate);
+        uint16_t parent;
+        Dentry* dentry;
+        uint8_t* entry = NULL;
 
-        MemoryPool* memPool = myMemoryManager->find_pool(memory);
+        // A directory can't go without its first cluster, so don't start unless there's one for it.
+        if(resolveDirectory(parentname, &parent) && lookupEntry(parent, name, &dentry) == NULL && myFileSystem->FreeCount != 0)
+        {
+            entry = createEntry(parent, name, ATTR_DIRECTORY, &dentry);
+        }
 
-        if(bytesleft == NULL || memPool == NULL)
+        if(entry == NULL)
         {
+            releaseLock();
             MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_PARAMETER;
+            return VM_STATUS_FAILURE;
         }
 
-        *bytesleft = memPool->query_remaining();
+        // It starts out holding just "." and "..". Like the entry in its parent, the cluster is only
+        // dirtied in the cache, so everything goes to disk together on the next flush.
+        uint16_t cluster = *(uint16_t*)(entry + DIR_FIRST_CLUS_LO);
+        Cluster* contents = myClusterCache->zero(cluster);
+
+        memcpy(contents->data, entry, BYTES_PER_ENTRY);
+        memcpy(contents->data, ".          ", 11);
+
+        memcpy(contents->data + BYTES_PER_ENTRY, entry, BYTES_PER_ENTRY);
+        memcpy(contents->data + BYTES_PER_ENTRY, "..         ", 11);
+        *(uint16_t*)(contents->data + BYTES_PER_ENTRY + DIR_FIRST_CLUS_LO) = parent;
+
+        myFileSystem->journal->logZero(cluster);
+        myFileSystem->journal->logEntries(cluster, 0, contents->data, 2);
+
+        releaseLock();
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMMemoryPoolAllocate(TVMMemoryPoolID memory, TVMMemorySize size, void** pointer)
+    // Extra Credit
+    TVMStatus VMDirectoryUnlink(const char* path)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        MemoryPool* memPool = myMemoryManager->find_pool(memory);
-
-        if(pointer == NULL || size == 0 || memPool == NULL)
+        if(path == NULL)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        if(!memPool->allocate_memory(pointer, size))
+        char dirname[VM_FILE_SYSTEM_MAX_PATH + 1];
+        char name[VM_FILE_SYSTEM_MAX_PATH + 1];
+
+        if(splitPath(path, dirname, name) != VM_STATUS_SUCCESS)
         {
             MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+            return VM_STATUS_FAILURE;
         }
 
-        MachineResumeSignals(&sigstate);
-        return VM_STATUS_SUCCESS;
-    }
+        grabExclusive();
 
-    TVMStatus VMMemoryPoolDeallocate(TVMMemoryPoolID memory, void* pointer)
-    {
-        TMachineSignalState sigstate;
-        MachineSuspendSignals(&sigstate);
+        uint16_t parent;
+        Dentry* dentry;
+        uint8_t* entry = NULL;
 
-        MemoryPool* memPool = myMemoryManager->find_pool(memory);
+        if(resolveDirectory(dirname, &parent))
+        {
+            entry = lookupEntry(parent, name, &dentry);
+        }
 
-        if(memPool == NULL || pointer == NULL || !memPool->deallocate_memory(pointer))
+        if(entry == NULL || entryBusy(entry))
         {
+            releaseLock();
             MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_PARAMETER;
+            return VM_STATUS_FAILURE;
+        }
+
+        uint16_t firstCluster = *(uint16_t*)(entry + DIR_FIRST_CLUS_LO);
+        bool directory = (entry[DIR_ATTR] & ATTR_DIRECTORY) != 0;
+
+        // The entry goes first, so a commit in between never has it pointing at free clusters.
+        if(dentry != NULL)
+        {
+            myDentryCache->remove(dentry);
+        }
+        else
+        {
+            myFileSystem->removeRootEntry(entry);
+        }
+
+        // Its clusters go back to the free map, and whatever of them is cached goes without being written.
+        for(uint16_t cluster = firstCluster; cluster >= 2 && cluster < 0xFFF7; cluster = myFileSystem->FatTable[cluster])
+        {
+            myClusterCache->discard(cluster);
+        }
+
+        myFileSystem->freeChain(firstCluster);
+
+        // The log may still have records for the directory's clusters, which mustn't be
+        // replayed over whatever they get reused for, so start it over.
+        if(directory)
+        {
+            checkpointMetadata();
         }
 
+        releaseLock();
+
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
 
 /*******************************************************************************************************
-                                        Thread Functions
+                                       	Memory Pool Functions
 *******************************************************************************************************/
 
-    TVMStatus VMThreadCreate(TVMThreadEntry entry, void* param, TVMMemorySize memsize,
-                             TVMThreadPriority prio, TVMThreadIDRef tid)
+    TVMStatus VMMemoryPoolCreate(void* base, TVMMemorySize size, TVMMemoryPoolIDRef memory)
+    {
+        return VMMemoryPoolCreateGranule(base, size, VM_MEMORY_POOL_GRANULE_DEFAULT, memory);
+    }
+
+    TVMStatus VMMemoryPoolCreateGranule(void* base, TVMMemorySize size, TVMMemorySize granule,
+                                        TVMMemoryPoolIDRef memory)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        if(entry == NULL || tid == NULL)
+        // The granule has to be a power of two no smaller than the minimum.
+        if(base == NULL || memory == NULL || size == 0
+           || granule < VM_MEMORY_POOL_GRANULE_MINIMUM || (granule & (granule - 1)) != 0)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-
-        /********************************************/
-        void* stackaddr;
-
-        TVMStatus status = VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, memsize, &stackaddr);
-
-        // If memory for the thread's stack space was unable to be allocated.
-        if(status != VM_STATUS_SUCCESS)
-        {
-            MachineResumeSignals(&sigstate);
-            return status;
-        }
-
-        /********************************************/
-
-        // Constructor automatically assigns the thread's ID to tid.
-        myScheduler->addThread(new ThreadControlBlock(entry, param, prio, stackaddr, memsize, tid));
+        myMemoryManager->add_pool(base, size, granule, memory);
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMThreadDelete(TVMThreadID threadID)
+    TVMStatus VMMemoryPoolCreateArena(void* base, TVMMemorySize size, TVMMemoryPoolIDRef memory)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        ThreadControlBlock* thread = myScheduler->findThread(threadID);
-
-        if(thread == NULL)
-        {
-            MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_ID;
-        }
-        else if(thread->getState() != VM_THREAD_STATE_DEAD)
+        if(base == NULL || memory == NULL || size == 0)
         {
             MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_STATE;
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
+        myMemoryManager->add_arena(base, size, memory);
 
-       	/********************************************/
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-        TVMStatus status = VMMemoryPoolDeallocate(VM_MEMORY_POOL_ID_SYSTEM, thread->getStackAddr());
+    TVMStatus VMMemoryPoolCreateFixed(void* base, TVMMemorySize size, TVMMemorySize objectsize,
+                                      TVMMemoryPoolIDRef memory)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
 
-        // If memory for the thread's stack space was unable to be allocated.
-        if(status != VM_STATUS_SUCCESS)
+        if(base == NULL || memory == NULL || objectsize == 0 || objectsize > size)
         {
             MachineResumeSignals(&sigstate);
-            return status;
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        /********************************************/
-
-        myScheduler->deleteThread(threadID);
+        myMemoryManager->add_fixed(base, size, objectsize, memory);
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMThreadActivate(TVMThreadID threadID)
+    TVMStatus VMMemoryPoolReset(TVMMemoryPoolID memory)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        ThreadControlBlock* thread = myScheduler->findThread(threadID);
-        if(thread == NULL)
-        {
-            MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_ID;
-        }
-        else if(thread->getState() != VM_THREAD_STATE_DEAD)
+        BasePool* memPool = myMemoryManager->find_pool(memory);
+
+        // Only arenas can drop everything at once.
+        if(memPool == NULL || !memPool->reset())
         {
             MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_STATE;
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        thread->ThreadCreateContext(); // Create the threads context.
-
-        myScheduler->addToReady(thread); // Will put thread into ready state/queue.
-
-        if(thread->getPriority() > (myScheduler->getCurrentThread())->getPriority())
-        {
-            myScheduler->addToReady(myScheduler->getCurrentThread()); // Current goes to ready.
-            myScheduler->scheduleNext(); // Schedule the next thread.
-        }
+        wakeMemoryWaiters(memPool);
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMThreadTerminate(TVMThreadID threadID)
+    TVMStatus VMMemoryPoolDelete(TVMMemoryPoolID memory)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        ThreadControlBlock* thread = myScheduler->findThread(threadID);
+        BasePool* memPool = myMemoryManager->find_pool(memory);
 
-        if(thread == NULL)
+        if(memPool == NULL)
         {
             MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_ID;
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
-        else if(thread->getState() == VM_THREAD_STATE_DEAD)
+
+        // Blocks sitting in thread magazines don't count as allocated.
+        myMemoryManager->flush_pool(memory);
+
+        // Check that it's fully deallocated.
+        if(memPool->query_remaining() != memPool->getMemSize())
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_STATE;
         }
 
-        TVMThreadState state = thread->getState();
-        thread->setState(VM_THREAD_STATE_DEAD);
-
-        TVMThreadPriority prio = myScheduler->getCurrentThread()->getPriority();
-        ThreadControlBlock* newOwner;
-        bool needScheduler = false;
-
-        // Release all mutexes.
-        for(unsigned int i = 0; i < (thread->mHeld).size(); i++)
-        {
-            Mutex* mtx = myScheduler->findMutex(thread->mHeld[i]);
-            mtx->owner = 0;
-            mtx->isLocked = false;
-            newOwner = mtx->getNextOwner();
-            if(newOwner != NULL)
-            {
-                myScheduler->removeFromWaiting(newOwner->getTID());
-                myScheduler->addToReady(newOwner);
+        myMemoryManager->delete_pool(memory);
 
-                if(newOwner->getPriority() > prio)
-                {
-                    needScheduler = true;
-                }
-            }
-        }
-        thread->mHeld.clear();
+        // Whoever was still waiting on it never gets their memory.
+        vector<ThreadControlBlock*> dropped;
+        myMemoryManager->drop_waiters(memory, dropped);
 
-        if(state == VM_THREAD_STATE_READY)
+        for(unsigned int i = 0; i < dropped.size(); i++)
         {
-            myScheduler->removeFromReady(threadID);
-        }
-        else if(state == VM_THREAD_STATE_WAITING)
-        {
-            // If we were waiting for a mutex.
-            if(thread->reasonForWaiting() == WAITING_MUTEX)
-            {
-                Mutex* mtx = myScheduler->findMutex(thread->getMutexWants());
-
-                if(mtx != NULL)
-                {
-                    mtx->stopWaiting(thread->getTID());
-                }
-            }
-            else if(thread->reasonForWaiting() == WAITING_MEMORY)
-            {
-                myMemoryManager->removeFromMemoryQueue(thread->getTID());
-            }
-            myScheduler->removeFromWaiting(threadID);
+            myScheduler->wakeThread(dropped[i], VM_STATUS_FAILURE);
         }
 
-        if(state == VM_THREAD_STATE_RUNNING || needScheduler)
+        if(!dropped.empty())
         {
-            // Not terminating curren't running thread so we need to
-            // put it back into ready queue.
-            if(state != VM_THREAD_STATE_RUNNING)
-            {
-                myScheduler->addToReady(myScheduler->getCurrentThread());
-            }
-            myScheduler->scheduleNext();
+            myScheduler->preemptFor(dropped[0]);
         }
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMThreadID(TVMThreadIDRef threadref)
+    TVMStatus VMMemoryPoolQuery(TVMMemoryPoolID memory, TVMMemorySizeRef bytesleft)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        if(threadref == NULL)
+        BasePool* memPool = myMemoryManager->find_pool(memory);
+
+        if(bytesleft == NULL || memPool == NULL)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        *threadref = (myScheduler->getCurrentThread())->getTID();
+        // Blocks sitting in magazines count as free, without taking them back.
+        *bytesleft = memPool->query_free();
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMThreadState(TVMThreadID threadID, TVMThreadStateRef state)
+    TVMStatus VMMemoryPoolStats(TVMMemoryPoolID memory, SVMMemoryPoolStatsRef statsref)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
-        ThreadControlBlock* thread = myScheduler->findThread(threadID);
 
-        if(thread == NULL)
-        {
-            MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_ID;
-        }
-        else if(state == NULL)
+        BasePool* memPool = myMemoryManager->find_pool(memory);
+
+        if(statsref == NULL || memPool == NULL)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        *state = thread->getState();
+        memPool->getStats(statsref);
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMThreadSleep(TVMTick tick)
+    TVMStatus VMMemoryPoolAllocate(TVMMemoryPoolID memory, TVMMemorySize size, void** pointer)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        ThreadControlBlock* curr = myScheduler->getCurrentThread();
+        BasePool* memPool = myMemoryManager->find_pool(memory);
 
-        if(tick == VM_TIMEOUT_INFINITE)
+        if(pointer == NULL || size == 0 || memPool == NULL)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        if(tick == VM_TIMEOUT_IMMEDIATE)
-        {
-            myScheduler->addToReady(curr);
-        }
-        else
+        if(!tryAllocate(memPool, size, pointer))
         {
-            curr->setWaitingFor(WAITING_SLEEP);
-            curr->setTicks(tick);
-            myScheduler->addToWaiting(curr);
+            memPool->countFailure();
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
         }
 
-        myScheduler->scheduleNext();
-
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-
-/*******************************************************************************************************
-                                       	File Functions
-*******************************************************************************************************/
-
-    void fileHandler(void* calldata, int result)
+    TVMStatus VMMemoryPoolAllocateWait(TVMMemoryPoolID memory, TVMMemorySize size, TVMTick timeout, void** pointer)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        ThreadControlBlock* thread = (ThreadControlBlock*)calldata;
+        BasePool* memPool = myMemoryManager->find_pool(memory);
 
-        if(thread->getState() != VM_THREAD_STATE_DEAD) // Make sure thread wasn't terminated.
+        if(pointer == NULL || size == 0 || memPool == NULL)
         {
-            thread->setResult(result);
-            myScheduler->removeFromWaiting(thread->getTID());
-            myScheduler->addToReady(thread);
-            ThreadControlBlock* curr = myScheduler->getCurrentThread();
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
 
-            // Just awoke a higher priority thread.
-            if(thread->getPriority() > curr->getPriority())
-            {
-                myScheduler->addToReady(curr);
-                myScheduler->scheduleNext();
-            }
+        if(tryAllocate(memPool, size, pointer))
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_SUCCESS;
+        }
+        else if(timeout == VM_TIMEOUT_IMMEDIATE)
+        {
+            memPool->countFailure();
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
         }
-        MachineResumeSignals(&sigstate);
-    }
-
-    uint16_t FatSearch(uint16_t firstCluster, int clustersToHop)
-    {
-        uint16_t* table = myFileSystem->FatTable;
 
-        uint16_t currCluster = firstCluster;
+        ThreadControlBlock* curr = myScheduler->getCurrentThread();
+        curr->setWaitingFor(WAITING_MEMORY);
 
-        if(clustersToHop == 0)
+        if(timeout == VM_TIMEOUT_INFINITE)
         {
-            return firstCluster;
+            curr->setInfiniteFlag(true);
+            curr->setTicks(-1);
         }
         else
         {
-            for(int i = 0; i < clustersToHop; i++)
-            {
-                if(currCluster == 0x0000 || currCluster >= 0xFFF7)
-                {
-                    return -1;
-                }
-                currCluster = table[currCluster];
-            }
+            curr->setTicks(timeout);
         }
-        return currCluster;
-    }
-
-    uint16_t getCurrDate()
-    {
-        SVMDateTime DTStruct;
-        uint16_t date = 0;
-
-        VMDateTime(&DTStruct);
-
-        date |= (DTStruct.DYear - 1980) << 9;
-        date |= DTStruct.DMonth << 5;
-        date |= DTStruct.DDay;
 
-        return date;
-    }
+        // Records the size so frees only wake us once it fits.
+        myMemoryManager->addToMemoryQueue(curr, memory, size, pointer);
+        myScheduler->addToWaiting(curr);
 
-    uint16_t getCurrTime()
-    {
-        SVMDateTime DTStruct;
-        uint16_t time = 0;
+        myScheduler->scheduleNext();
 
-        VMDateTime(&DTStruct);
+        // Whoever freed the memory allocated it for us (and counted it), a timeout
+        // doesn't. A pool deleted under us has nothing left to count against.
+        if(curr->getResult() != VM_STATUS_SUCCESS)
+        {
+            memPool = myMemoryManager->find_pool(memory);
+            if(memPool != NULL)
+            {
+                memPool->countFailure();
+            }
 
-        time |= DTStruct.DHour << 11;
-        time |= DTStruct.DMinute << 5;
-        time |= (DTStruct.DSecond * 2);
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
 
-        return time;
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
     }
 
-    uint8_t* createRootEntry(uint8_t* entryPtr, const char* filename)
+    TVMStatus VMMemoryPoolAllocateAligned(TVMMemoryPoolID memory, TVMMemorySize size, TVMMemorySize alignment,
+                                          void** pointer)
     {
-        createLFN(&entryPtr, filename); // Generate it's long file name.
-
-        uint8_t sfn[VM_FILE_SYSTEM_SFN_SIZE + 1];
-        Normal_to_SFN((char*)sfn, filename, true);
-
-        memcpy(entryPtr, (void*)sfn, 11);
-        uint16_t date = getCurrDate();
-        uint16_t time = getCurrTime();
-
-        *(uint8_t*)(entryPtr + DIR_ATTR) = 0;
-
-        *(uint8_t*)(entryPtr + DIR_CRT_TIME_TENTH) = 0;
-
-        *(uint16_t*)(entryPtr + DIR_CRT_DATE) = date;
-        *(uint16_t*)(entryPtr + DIR_CRT_TIME) = time;
-
-        *(uint16_t*)(entryPtr + DIR_LAST_ACC_DATE) = date;
-
-        *(uint16_t*)(entryPtr + DIR_WRITE_DATE) = date;
-        *(uint16_t*)(entryPtr + DIR_WRITE_TIME) = time;
-
-        *(uint16_t*)(entryPtr + DIR_FIRST_CLUS_HI) = 0;
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
 
-        *(uint32_t*)(entryPtr + DIR_FILE_SIZE) = 0;
+        BasePool* memPool = myMemoryManager->find_pool(memory);
 
+        if(pointer == NULL || size == 0 || memPool == NULL || alignment == 0 || (alignment & (alignment - 1)) != 0)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
 
-        // Find first free cluster in FAT Table.
-        for(int i = 0; i < myFileSystem->FATSize16 * myFileSystem->BytesPerSector / 2; i ++)
+        if(!memPool->allocate_aligned(pointer, size, alignment))
         {
-            if(myFileSystem->FatTable[i] == 0x0000) // Free.
+            myMemoryManager->flush_pool(memory);
+
+            if(!memPool->allocate_aligned(pointer, size, alignment))
             {
-                *(uint32_t*)(entryPtr + DIR_FIRST_CLUS_LO) = i;
-                myFileSystem->FatTable[i] = 0xFFFF;
-                break;
+                memPool->countFailure();
+                MachineResumeSignals(&sigstate);
+                return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
             }
         }
-        return entryPtr;
-    }
 
+        memPool->countAllocation(size);
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-    TVMStatus VMFileOpen(const char* filename, int flags, int mode, int* filedescriptor)
+    TVMStatus VMMemoryPoolReallocate(TVMMemoryPoolID memory, void* pointer, TVMMemorySize size, void** newpointer)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        if(filename == NULL || filedescriptor == NULL)
+        BasePool* memPool = myMemoryManager->find_pool(memory);
+
+        if(memPool == NULL || pointer == NULL || newpointer == NULL || size == 0)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        // Attempt to locate the file inside the root.
-        char lfname[VM_FILE_SYSTEM_LFN_SIZE];
-
-        char sfname[VM_FILE_SYSTEM_SFN_SIZE + 1];
-        Normal_to_SFN(sfname, filename, false);
-
-        unsigned int namesize = 0;
+        TVMMemorySize oldSize = memPool->block_size(pointer);
 
-        // Finds how long the name is (not including extension).
-        while(filename[namesize] != '.' && namesize < strlen(filename))
+        if(oldSize == 0)
         {
-            namesize++;
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        bool found = false;
-        uint8_t* entry;
+        bool freed = size < oldSize;
 
-        for(uint8_t* rootPtr = myFileSystem->getRoot(); rootPtr < myFileSystem->getRoot() + myFileSystem->RootEntryCount * BYTES_PER_ENTRY; rootPtr += BYTES_PER_ENTRY)
+        // Stay put if we can, even if it takes getting the neighbours back from the magazines.
+        if(!memPool->resize_memory(pointer, size))
         {
-            if(rootPtr[0] == 0x00) // No more entries.
-            {
-                break;
-            }
-
+            void* moved;
 
-            if(rootPtr[DIR_ATTR] == ATTR_LONG_NAME && (rootPtr[0] & 0x40) == 0x40)
-            {
-                getLFN(&rootPtr, lfname);
-
-                if(strncmp(filename, lfname, strlen(filename)) == 0)
-                {
-                    found = true;
-                    entry = rootPtr;
-                    break;
-                }
-            }
-
-            if(namesize <= 8 && rootPtr[0] != 0xE5 && rootPtr[DIR_ATTR] != ATTR_LONG_NAME)
-            {
-                if(strncmp(sfname, (char*)rootPtr, 11) == 0)
-                {
-                    found = true;
-                    entry = rootPtr;
-                    break;
-                }
-            }
-        }
-        // If not found.
-        if(!found)
-        {
-            if((flags & O_CREAT) != 0) // If O_CREAT flag is set.
+            if(!memPool->allocate_memory(&moved, size))
             {
-                // Create a new entry for it (if there's space left in root).
-                entry = myFileSystem->getRoot();
+                myMemoryManager->flush_pool(memory);
 
-                while(entry[0] != 0x00 && entry < myFileSystem->getRoot() + myFileSystem->RootEntryCount * BYTES_PER_ENTRY)
+                if(memPool->resize_memory(pointer, size))
                 {
-                    entry += BYTES_PER_ENTRY;
+                    moved = pointer;
                 }
-
-                // Check if we stopped because we found a free entry or because we ran out of space.
-                if(entry == myFileSystem->getRoot() + myFileSystem->RootEntryCount * BYTES_PER_ENTRY)
+                else if(!memPool->allocate_memory(&moved, size))
                 {
+                    memPool->countFailure();
                     MachineResumeSignals(&sigstate);
-                    return VM_STATUS_FAILURE;
-                }
-                else // Found an space so we create entry for this new file.
-                {
-                    entry = createRootEntry(entry, filename);
+                    return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
                 }
             }
-            else
+
+            if(moved != pointer)
             {
-                MachineResumeSignals(&sigstate);
-                return VM_STATUS_FAILURE;
+                memcpy(moved, pointer, (oldSize < size) ? oldSize : size);
+                memPool->deallocate_memory(pointer);
+                pointer = moved;
+                freed = true;
             }
         }
 
-        // Create File pointer to this newly opened file.
-        File* file = new File;
-
-        file->filedescriptor = nextFileDescriptor;
-        *filedescriptor = file->filedescriptor;
-        nextFileDescriptor++;
-
-        // Set file pointer.
-        file->filePtr = 0;
-        if((flags & O_TRUNC) != 0)
-        {
-            *(uint32_t*)(entry + DIR_FILE_SIZE) = 0;
-        }
+        *newpointer = pointer;
+        memPool->updateHighWater();
 
-        if((flags & O_APPEND) != 0)
+        // Shrinking or moving may have freed enough for someone.
+        if(freed)
         {
-            file->filePtr = *(uint32_t*)(entry + DIR_FILE_SIZE);
+            wakeMemoryWaiters(memPool);
         }
 
-        file->flags = flags;
-        file->mode = mode;
-        file->entry = entry;
-
-        openFiles.push_back(file);
-
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMFileClose(int filedescriptor)
+    TVMStatus VMMemoryPoolDeallocate(TVMMemoryPoolID memory, void* pointer)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        // Locate the file associated with the filedescriptor.
-        File* file = findOpenFile(filedescriptor);
+        BasePool* memPool = myMemoryManager->find_pool(memory);
 
-        // If no such file has been opened, return failure.
-        if(file == NULL)
+        if(memPool == NULL || pointer == NULL)
         {
             MachineResumeSignals(&sigstate);
-            return VM_STATUS_FAILURE;
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        uint16_t date = getCurrDate();
-
-        *(uint16_t*)(file->entry + DIR_LAST_ACC_DATE) = date;
-
+        if(!myMemoryManager->cache_deallocate(myScheduler->getCurrentThread(), memPool, pointer)
+           && !memPool->deallocate_memory(pointer))
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
 
-        // Remove the directory from the vector of directories.
-        deleteOpenFile(filedescriptor);
+        wakeMemoryWaiters(memPool);
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMFileRead(int filedescriptor, void* data, int* length)
+
+/*******************************************************************************************************
+                                        Thread Functions
+*******************************************************************************************************/
+
+    TVMStatus VMThreadCreate(TVMThreadEntry entry, void* param, TVMMemorySize memsize,
+                             TVMThreadPriority prio, TVMThreadIDRef tid)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-      	if(data == NULL || length == NULL)
+        if(entry == NULL || tid == NULL)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
 
-        if(filedescriptor < 3) // Standard input.
-        {
-            ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+        /********************************************/
+        void* stackaddr;
 
-            void* read_base;
+        TVMStatus status = VMMemoryPoolAllocate(VM_MEMORY_POOL_ID_SYSTEM, memsize, &stackaddr);
 
-       	    // Try to allocate the 512 byte minimum.
-            TVMStatus status = VMMemoryPoolAllocate(stackID, MAX_READ_SIZE, &read_base);
+        // If memory for the thread's stack space was unable to be allocated.
+        if(status != VM_STATUS_SUCCESS)
+        {
+            MachineResumeSignals(&sigstate);
+            return status;
+        }
 
-            while(status  != VM_STATUS_SUCCESS)
-       	    {
-                 // Block until memory gets freed.
-                 currentThread->setWaitingFor(WAITING_MEMORY);
+        /********************************************/
 
-                 myMemoryManager->addToMemoryQueue(currentThread);
+        // Constructor automatically assigns the thread's ID to tid.
+        myScheduler->addThread(new ThreadControlBlock(entry, param, prio, stackaddr, memsize, tid));
 
-                 myScheduler->addToWaiting(currentThread);
-                 myScheduler->scheduleNext();
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-                 status = VMMemoryPoolAllocate(stackID, MAX_READ_SIZE, &read_base);
-            }
+    TVMStatus VMThreadDelete(TVMThreadID threadID)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
 
-            int bytesRead = 0;
-            int messageSize = *length;
-            int numIterations = (int)ceil((double)*length / (double)MAX_READ_SIZE);
+        ThreadControlBlock* thread = myScheduler->findThread(threadID);
 
-            for(int i = 0; i < numIterations; i++)
-            {
-                // Read up to 512 bytes of the message
-                if(messageSize >= MAX_READ_SIZE)
-                {
-                    MachineFileRead(filedescriptor, read_base, MAX_READ_SIZE, fileHandler, (void*)currentThread);
-                }
-                else
-                {
-                    MachineFileRead(filedescriptor, read_base, messageSize, fileHandler, (void*)currentThread);
-                }
+        if(thread == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(thread->getState() != VM_THREAD_STATE_DEAD)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
 
-                currentThread->setWaitingFor(WAITING_IO);
-                myScheduler->addToWaiting(currentThread);
-                myScheduler->scheduleNext();
 
-       	        if(currentThread->getResult() < 0)
-                {
-                    VMMemoryPoolDeallocate(stackID, read_base);
+       	/********************************************/
 
-                    // See if anyone is waiting for memory.
-                    ThreadControlBlock* nextThread = myMemoryManager->getNext();
+        TVMStatus status = VMMemoryPoolDeallocate(VM_MEMORY_POOL_ID_SYSTEM, thread->getStackAddr());
 
-                    if(nextThread != NULL) // There was a thread waiting for memory.
-                    {
-                        myScheduler->removeFromWaiting(nextThread->getTID());
-                        myScheduler->addToReady(nextThread);
-                    }
+        // If memory for the thread's stack space was unable to be allocated.
+        if(status != VM_STATUS_SUCCESS)
+        {
+            MachineResumeSignals(&sigstate);
+            return status;
+        }
 
-                    MachineResumeSignals(&sigstate);
-                    return VM_STATUS_FAILURE;
-                }
-                else
-                {
-                    memcpy(data, read_base, currentThread->getResult());
-                    data = (uint8_t*)data + currentThread->getResult();
-                    messageSize -= currentThread->getResult();
+        /********************************************/
 
-                    bytesRead += currentThread->getResult();
-                }
-            }
+        myScheduler->deleteThread(threadID);
 
-            *length = bytesRead;
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-            VMMemoryPoolDeallocate(stackID, read_base);
+    TVMStatus VMThreadActivate(TVMThreadID threadID)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        ThreadControlBlock* thread = myScheduler->findThread(threadID);
+        if(thread == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(thread->getState() != VM_THREAD_STATE_DEAD)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
+
+        thread->ThreadCreateContext(); // Create the threads context.
+
+        myScheduler->addToReady(thread); // Will put thread into ready state/queue.
+
+        if(thread->getPriority() > (myScheduler->getCurrentThread())->getPriority())
+        {
+            myScheduler->addToReady(myScheduler->getCurrentThread()); // Current goes to ready.
+            myScheduler->scheduleNext(); // Schedule the next thread.
+        }
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMThreadTerminate(TVMThreadID threadID)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        ThreadControlBlock* thread = myScheduler->findThread(threadID);
+
+        if(thread == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(thread->getState() == VM_THREAD_STATE_DEAD)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
+
+        TVMThreadState state = thread->getState();
+        myScheduler->setThreadState(thread, VM_THREAD_STATE_DEAD);
+
+        // Give back any small blocks the thread was caching.
+        myMemoryManager->flush_thread(thread);
+
+        bool needScheduler = false;
+
+        // Release all mutexes.
+        if(myScheduler->releaseMutexes(threadID))
+        {
+            needScheduler = true;
+        }
+
+        // Release all reader-writer locks.
+        if(myScheduler->releaseRWLocks(threadID))
+        {
+            needScheduler = true;
+        }
+
+        if(state == VM_THREAD_STATE_READY)
+        {
+            myScheduler->removeFromReady(threadID);
+        }
+        else if(state == VM_THREAD_STATE_WAITING)
+        {
+            myScheduler->detachWaiter(thread);
+            myScheduler->removeFromWaiting(threadID);
+        }
 
-            // See if anyone is waiting for memory.
-            ThreadControlBlock* nextThread = myMemoryManager->getNext();
+        // It won't get back to leave the channel it was sending or receiving on.
+        if(thread->isInChannel())
+        {
+            thread->setInChannel(false);
+            myScheduler->reapChannels();
+        }
 
-            if(nextThread != NULL) // There was a thread waiting for memory.
+        if(state == VM_THREAD_STATE_RUNNING || needScheduler)
+        {
+            // Not terminating curren't running thread so we need to
+            // put it back into ready queue.
+            if(state != VM_THREAD_STATE_RUNNING)
             {
-                myScheduler->removeFromWaiting(nextThread->getTID());
-                myScheduler->addToReady(nextThread);
-                if(nextThread->getPriority() > currentThread->getPriority())
-                {
-                    myScheduler->addToReady(myScheduler->getCurrentThread());
-                    myScheduler->scheduleNext();
-                }
+                myScheduler->addToReady(myScheduler->getCurrentThread());
             }
+            myScheduler->scheduleNext();
         }
-        else // File descriptor >= 3.
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMThreadID(TVMThreadIDRef threadref)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(threadref == NULL)
         {
-            File* file = findOpenFile(filedescriptor);
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
 
-            if(file == NULL)
+        *threadref = (myScheduler->getCurrentThread())->getTID();
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMThreadState(TVMThreadID threadID, TVMThreadStateRef state)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+        ThreadControlBlock* thread = myScheduler->findThread(threadID);
+
+        if(thread == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(state == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        *state = thread->getState();
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMThreadSleep(TVMTick tick)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        ThreadControlBlock* curr = myScheduler->getCurrentThread();
+
+        if(tick == VM_TIMEOUT_INFINITE)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        if(tick == VM_TIMEOUT_IMMEDIATE)
+        {
+            myScheduler->addToReady(curr);
+        }
+        else
+        {
+            curr->setWaitingFor(WAITING_SLEEP);
+            curr->setTicks(tick);
+            myScheduler->addToWaiting(curr);
+        }
+
+        myScheduler->scheduleNext();
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMThreadStats(TVMThreadID threadID, SVMThreadStatsRef statsref)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(statsref == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        ThreadControlBlock* thread = myScheduler->findThread(threadID);
+
+        if(thread == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+
+        myScheduler->getThreadStats(thread, statsref);
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMSchedulerStats(SVMSchedulerStatsRef statsref)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(statsref == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        myScheduler->getStats(statsref);
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+
+/*******************************************************************************************************
+                                       	File Functions
+*******************************************************************************************************/
+
+    void fileHandler(void* calldata, int result)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        ThreadControlBlock* thread = (ThreadControlBlock*)calldata;
+
+        if(thread->getState() != VM_THREAD_STATE_DEAD) // Make sure thread wasn't terminated.
+        {
+            thread->setResult(result);
+            myScheduler->removeFromWaiting(thread->getTID());
+            myScheduler->addToReady(thread);
+            ThreadControlBlock* curr = myScheduler->getCurrentThread();
+
+            // Just awoke a higher priority thread.
+            if(thread->getPriority() > curr->getPriority())
             {
-                MachineResumeSignals(&sigstate);
-                return VM_STATUS_FAILURE;
+                myScheduler->addToReady(curr);
+                myScheduler->scheduleNext();
             }
+        }
+        MachineResumeSignals(&sigstate);
+    }
 
-            uint16_t date = getCurrDate();
+    // Disk cluster holding cluster index of the file, or 0xFFFF past the end of
+    // its chain. The chain is mapped into extents as far as it's been asked for,
+    // so each FAT link is only followed once per open file.
+    uint16_t fileCluster(File* file, uint32_t index)
+    {
+        uint16_t firstCluster = *(uint16_t*)(file->entry + DIR_FIRST_CLUS_LO);
+        vector<FileExtent>& extents = file->extents;
 
-            *(uint16_t*)(file->entry + DIR_LAST_ACC_DATE) = date;
+        if(extents.empty() || extents[0].firstCluster != firstCluster)
+        {
+            extents.clear();
+            file->extentHint = 0;
 
-            if((file->flags & O_WRONLY) != 0) // Trying to read from a write-only file.
+            if(firstCluster < 2 || firstCluster >= 0xFFF7)
             {
-                MachineResumeSignals(&sigstate);
-                return VM_STATUS_FAILURE;
+                return 0xFFFF;
             }
 
-            uint16_t firstCluster = *(uint16_t*)(file->entry + DIR_FIRST_CLUS_LO);
-            uint32_t filesize = *(uint32_t*)(file->entry + DIR_FILE_SIZE);
-            uint16_t clusterSize = myFileSystem->SectorsPerCluster * myFileSystem->BytesPerSector;
+            FileExtent first = {0, firstCluster, 1};
+            extents.push_back(first);
+        }
 
-            uint16_t clusterNum = FatSearch(firstCluster, file->filePtr / clusterSize); // Get the cluster number we're reading from.
+        // Map more of the chain until it reaches index.
+        while(index >= extents.back().fileCluster + extents.back().length)
+        {
+            FileExtent& last = extents.back();
+            uint16_t tail = last.firstCluster + last.length - 1;
+            uint16_t next = myFileSystem->FatTable[tail];
 
-            unsigned int clusterOffset = file->filePtr % clusterSize;
-            unsigned int numReadIn = 0;
-            unsigned int amountLeftInCluster;
+            if(next < 2 || next >= 0xFFF7)
+            {
+                return 0xFFFF;
+            }
 
-            unsigned int messageLen = (unsigned int)*length;
-            Cluster* currCluster;
+            if(next == tail + 1)
+            {
+                last.length++;
+            }
+            else
+            {
+                FileExtent extent = {last.fileCluster + last.length, next, 1};
+                extents.push_back(extent);
+            }
+        }
 
-            grabMutex();
+        // Sequential access stays in the same extent or moves on to the next one.
+        unsigned int e = file->extentHint;
 
-            while(numReadIn < (unsigned int)*length && file->filePtr != filesize)
-            {
-                currCluster = findCachedCluster(clusterNum);
-                if(currCluster == NULL) // Not found.
-               	{
-                    currCluster = new Cluster; // Create a new cached cluster entry.
-                    createCachedCluster(currCluster, clusterNum);
-                    cachedClusters.push_back(currCluster);
-               	}
+        if(e >= extents.size() || index < extents[e].fileCluster)
+        {
+            e = 0;
+        }
 
-                amountLeftInCluster = clusterSize - clusterOffset;
+        if(index >= extents[e].fileCluster + extents[e].length)
+        {
+            if(e + 1 < extents.size() && index < extents[e + 1].fileCluster + extents[e + 1].length)
+            {
+                e++;
+            }
+            else
+            {
+                // Last extent starting at or before index.
+                unsigned int low = 0, high = extents.size() - 1;
+
+                while(low < high)
+                {
+                    unsigned int mid = (low + high + 1) / 2;
+
+                    if(extents[mid].fileCluster <= index)
+                    {
+                        low = mid;
+                    }
+                    else
+                    {
+                        high = mid - 1;
+                    }
+                }
+
+                e = low;
+            }
+        }
+
+        file->extentHint = e;
+        return extents[e].firstCluster + (index - extents[e].fileCluster);
+    }
+
+    // Grows the chain after lastCluster by enough clusters for bytes more, in one go so they
+    // come out contiguous. Returns the first new one, or 0xFFFF if the disk is too full.
+    uint16_t extendChain(uint16_t lastCluster, unsigned int bytes)
+    {
+        unsigned int clusterSize = myFileSystem->SectorsPerCluster * myFileSystem->BytesPerSector;
+        unsigned int count = (bytes + clusterSize - 1) / clusterSize;
+
+        // Nearly full, take what's left and write as much as fits.
+        if(count > myFileSystem->FreeCount)
+        {
+            count = myFileSystem->FreeCount;
+        }
+
+        return myFileSystem->allocateClusters(lastCluster, count);
+    }
+
+    uint16_t getCurrDate()
+    {
+        SVMDateTime DTStruct;
+        uint16_t date = 0;
+
+        VMDateTime(&DTStruct);
+
+        date |= (DTStruct.DYear - 1980) << 9;
+        date |= DTStruct.DMonth << 5;
+        date |= DTStruct.DDay;
+
+        return date;
+    }
+
+    uint16_t getCurrTime()
+    {
+        SVMDateTime DTStruct;
+        uint16_t time = 0;
+
+        VMDateTime(&DTStruct);
+
+        time |= DTStruct.DHour << 11;
+        time |= DTStruct.DMinute << 5;
+        time |= (DTStruct.DSecond * 2);
+
+        return time;
+    }
+
+    uint8_t* createRootEntry(uint8_t* entryPtr, const char* filename)
+    {
+        createLFN(&entryPtr, filename); // Generate it's long file name.
+
+        uint8_t sfn[VM_FILE_SYSTEM_SFN_SIZE + 1];
+        Normal_to_SFN((char*)sfn, filename, true);
+
+        memcpy(entryPtr, (void*)sfn, 11);
+        uint16_t date = getCurrDate();
+        uint16_t time = getCurrTime();
+
+        *(uint8_t*)(entryPtr + DIR_ATTR) = 0;
+
+        *(uint8_t*)(entryPtr + DIR_CRT_TIME_TENTH) = 0;
+
+        *(uint16_t*)(entryPtr + DIR_CRT_DATE) = date;
+        *(uint16_t*)(entryPtr + DIR_CRT_TIME) = time;
+
+        *(uint16_t*)(entryPtr + DIR_LAST_ACC_DATE) = date;
+
+        *(uint16_t*)(entryPtr + DIR_WRITE_DATE) = date;
+        *(uint16_t*)(entryPtr + DIR_WRITE_TIME) = time;
+
+        *(uint16_t*)(entryPtr + DIR_FIRST_CLUS_HI) = 0;
+
+        *(uint32_t*)(entryPtr + DIR_FILE_SIZE) = 0;
+
+
+        // Give it a first cluster.
+        uint16_t firstCluster = myFileSystem->allocateClusters(NO_CLUSTER, 1);
+        *(uint16_t*)(entryPtr + DIR_FIRST_CLUS_LO) = (firstCluster < 0xFFF7) ? firstCluster : 0;
+
+        return entryPtr;
+    }
+
+    // Makes the entries for a new file called name in the directory starting at parent
+    // (NO_CLUSTER for the root) and gives it a first cluster. Returns its short name entry,
+    // or NULL if the directory has no room. dentry is set as by lookupEntry. Needs the
+    // file system lock exclusively.
+    uint8_t* createEntry(uint16_t parent, const char* name, uint8_t attributes, Dentry** dentry)
+    {
+        *dentry = NULL;
+
+        if(parent == NO_CLUSTER)
+        {
+            uint8_t* end = myFileSystem->getRoot() + myFileSystem->RootEntryCount * BYTES_PER_ENTRY;
+            uint8_t* entry = myFileSystem->getRoot();
+
+            // Goes after the last entry in use, long name entries and all (if there's space left in root).
+            while(entry < end && entry[0] != 0x00)
+            {
+                entry += BYTES_PER_ENTRY;
+            }
+
+            if(entry + ((strlen(name) + 12) / 13 + 1) * BYTES_PER_ENTRY > end)
+            {
+                return NULL;
+            }
+
+            uint8_t* first = entry;
+
+            entry = createRootEntry(entry, name);
+            entry[DIR_ATTR] = attributes;
+            myFileSystem->indexEntry(name, entry);
+            myFileSystem->markRootDirty(first, (entry - first) / BYTES_PER_ENTRY + 1);
+
+            return entry;
+        }
+
+        uint8_t entries[(MAX_LFN_ENTRIES + 1) * BYTES_PER_ENTRY];
+        uint8_t* sfnEntry = createRootEntry(entries, name);
+        sfnEntry[DIR_ATTR] = attributes;
+
+        // createRootEntry only knows about the short names in root.
+        while(sfnEntry[6] == '~' && sfnEntry[7] < 0x7E && myDentryCache->lookup(parent, name, (char*)sfnEntry) != NULL)
+        {
+            sfnEntry[7]++;
+        }
+
+        *dentry = myDentryCache->insert(parent, name, entries, (sfnEntry - entries) / BYTES_PER_ENTRY + 1);
+
+        if(*dentry == NULL)
+        {
+            myFileSystem->freeChain(*(uint16_t*)(sfnEntry + DIR_FIRST_CLUS_LO));
+            return NULL;
+        }
+
+        return (*dentry)->entry;
+    }
+
+
+    TVMStatus VMFileOpen(const char* filename, int flags, int mode, int* filedescriptor)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(filename == NULL || filedescriptor == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        char dirname[VM_FILE_SYSTEM_MAX_PATH + 1];
+        char name[VM_FILE_SYSTEM_MAX_PATH + 1];
+
+        if(splitPath(filename, dirname, name) != VM_STATUS_SUCCESS)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+
+        grabExclusive();
+
+        uint16_t parent;
+
+        if(!resolveDirectory(dirname, &parent))
+        {
+            releaseLock();
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+
+        Dentry* dentry;
+        uint8_t* entry = lookupEntry(parent, name, &dentry);
+        bool found = (entry != NULL);
+
+        // If not found.
+        if(!found)
+        {
+            if((flags & O_CREAT) != 0) // If O_CREAT flag is set.
+            {
+                entry = createEntry(parent, name, 0, &dentry);
+            }
+
+            // Not asked to create it, or there was no room for it.
+            if(entry == NULL)
+            {
+                releaseLock();
+                MachineResumeSignals(&sigstate);
+                return VM_STATUS_FAILURE;
+            }
+        }
+        else if((entry[DIR_ATTR] & ATTR_DIRECTORY) != 0) // Directories are opened with VMDirectoryOpen.
+        {
+            releaseLock();
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+
+        // Create File pointer to this newly opened file.
+        File* file = new File;
+
+        file->filedescriptor = nextFileDescriptor;
+        *filedescriptor = file->filedescriptor;
+        nextFileDescriptor++;
+
+        // Set file pointer.
+        file->filePtr = 0;
+        if((flags & O_TRUNC) != 0)
+        {
+            *(uint32_t*)(entry + DIR_FILE_SIZE) = 0;
+
+            syncEntry(entry, dentry);
+        }
+
+        releaseLock();
+
+        if((flags & O_APPEND) != 0)
+        {
+            file->filePtr = *(uint32_t*)(entry + DIR_FILE_SIZE);
+        }
+
+        file->flags = flags;
+        file->mode = mode;
+        file->entry = entry;
+        file->dentry = dentry;
+
+        file->nextReadPtr     = file->filePtr;
+        file->readAheadWindow = 0;
+        file->extentHint      = 0;
+
+        openFiles.push_back(file);
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMFileClose(int filedescriptor)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        // Locate the file associated with the filedescriptor.
+        File* file = findOpenFile(filedescriptor);
+
+        // If no such file has been opened, return failure.
+        if(file == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+
+        uint16_t date = getCurrDate();
+
+        *(uint16_t*)(file->entry + DIR_LAST_ACC_DATE) = date;
+
+        grabExclusive();
+        syncEntry(file->entry, file->dentry);
+
+        if(flusherID == VM_THREAD_ID_INVALID)
+        {
+            writeBack();
+        }
+
+        releaseLock();
+
+        // Remove the directory from the vector of directories.
+        deleteOpenFile(filedescriptor);
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMFileRead(int filedescriptor, void* data, int* length)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+      	if(data == NULL || length == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+
+        if(filedescriptor < 3) // Standard input.
+        {
+            ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+
+            void* read_base;
+
+            // Get the 512 byte minimum, blocking until it gets freed if need be.
+            VMMemoryPoolAllocateWait(stackID, MAX_READ_SIZE, VM_TIMEOUT_INFINITE, &read_base);
+
+            int bytesRead = 0;
+            int messageSize = *length;
+            int numIterations = (int)ceil((double)*length / (double)MAX_READ_SIZE);
+
+            for(int i = 0; i < numIterations; i++)
+            {
+                // Read up to 512 bytes of the message
+                if(messageSize >= MAX_READ_SIZE)
+                {
+                    MachineFileRead(filedescriptor, read_base, MAX_READ_SIZE, fileHandler, (void*)currentThread);
+                }
+                else
+                {
+                    MachineFileRead(filedescriptor, read_base, messageSize, fileHandler, (void*)currentThread);
+                }
+
+                currentThread->setWaitingFor(WAITING_IO);
+                myScheduler->addToWaiting(currentThread);
+                myScheduler->scheduleNext();
+
+       	        if(currentThread->getResult() < 0)
+                {
+                    VMMemoryPoolDeallocate(stackID, read_base);
+
+                    MachineResumeSignals(&sigstate);
+                    return VM_STATUS_FAILURE;
+                }
+                else
+                {
+                    memcpy(data, read_base, currentThread->getResult());
+                    data = (uint8_t*)data + currentThread->getResult();
+                    messageSize -= currentThread->getResult();
+
+                    bytesRead += currentThread->getResult();
+                }
+            }
+
+            *length = bytesRead;
+
+            // Wakes anyone waiting for memory.
+            VMMemoryPoolDeallocate(stackID, read_base);
+        }
+        else // File descriptor >= 3.
+        {
+            File* file = findOpenFile(filedescriptor);
+
+            if(file == NULL)
+            {
+                MachineResumeSignals(&sigstate);
+                return VM_STATUS_FAILURE;
+            }
+
+            uint16_t date = getCurrDate();
+
+            *(uint16_t*)(file->entry + DIR_LAST_ACC_DATE) = date;
+
+            if((file->flags & O_WRONLY) != 0) // Trying to read from a write-only file.
+            {
+                MachineResumeSignals(&sigstate);
+                return VM_STATUS_FAILURE;
+            }
+
+            uint32_t filesize = *(uint32_t*)(file->entry + DIR_FILE_SIZE);
+            uint16_t clusterSize = myFileSystem->SectorsPerCluster * myFileSystem->BytesPerSector;
+
+            uint16_t clusterNum = fileCluster(file, file->filePtr / clusterSize); // Get the cluster number we're reading from.
+
+            unsigned int clusterOffset = file->filePtr % clusterSize;
+            unsigned int numReadIn = 0;
+            unsigned int amountLeftInCluster;
+
+            unsigned int messageLen = (unsigned int)*length;
+            Cluster* currCluster;
+
+            // Picking up where the last read left off doubles the read ahead, anything else stops it.
+            if(file->filePtr == file->nextReadPtr)
+            {
+                file->readAheadWindow = (file->readAheadWindow == 0) ? 1 : file->readAheadWindow * 2;
+
+                if(file->readAheadWindow > READ_AHEAD_MAX_CLUSTERS)
+                {
+                    file->readAheadWindow = READ_AHEAD_MAX_CLUSTERS;
+                }
+            }
+            else
+            {
+                file->readAheadWindow = 0;
+            }
+
+            grabShared();
+
+            while(numReadIn < (unsigned int)*length && file->filePtr != filesize && clusterNum < 0xFFF7)
+            {
+                currCluster = myClusterCache->find(clusterNum);
+                if(currCluster == NULL) // Not found.
+               	{
+                    // Loading needs the device, so trade our shared hold for an exclusive one.
+                    releaseLock();
+                    grabExclusive();
+
+                    myClusterCache->load(clusterNum);
+
+                    releaseLock();
+                    grabShared();
+
+                    // It may have been evicted again while we waited, so look it up afresh.
+                    continue;
+               	}
+
+                amountLeftInCluster = clusterSize - clusterOffset;
                	if(amountLeftInCluster > filesize - file->filePtr)
                 {
-                    amountLeftInCluster = filesize - file->filePtr;
+                    amountLeftInCluster = filesize - file->filePtr;
+                }
+
+                if(messageLen < amountLeftInCluster)
+               	{
+                    memcpy(data, (void*)(currCluster->data + clusterOffset), messageLen);
+
+                    numReadIn += messageLen;
+                    file->filePtr += messageLen;
+                    amountLeftInCluster -= messageLen;
+                    data = (uint8_t*)data + messageLen;
+                    clusterOffset += messageLen;
+                    messageLen = 0;
+                    break;
+
+                }
+                else // messageLen >= amountLeftInCluster.
+                {
+                    memcpy(data, (void*)(currCluster->data + clusterOffset), amountLeftInCluster);
+
+                    numReadIn += amountLeftInCluster;
+                    file->filePtr += amountLeftInCluster;
+                    messageLen -= amountLeftInCluster;
+                    clusterOffset += amountLeftInCluster;
+                    data = (uint8_t*)data + amountLeftInCluster;
+                    amountLeftInCluster = 0;
+                }
+
+                if(messageLen > 0) // Not done reading.
+                {
+                    if(amountLeftInCluster == 0)
+                    {
+                        if(myFileSystem->FatTable[clusterNum] >= 0xFFF7)
+                        {
+                            break;
+                        }
+                        clusterNum = myFileSystem->FatTable[clusterNum];
+                        clusterOffset = 0;
+                    }
+                }
+            }
+            releaseLock();
+
+            file->nextReadPtr = file->filePtr;
+
+            if(file->readAheadWindow != 0 && clusterNum >= 2 && clusterNum < 0xFFF7)
+            {
+                queueReadAhead(clusterNum, file->readAheadWindow);
+            }
+
+            *length = numReadIn;
+        }
+
+        MachineResumeSignals(&sigstate);
+       	return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMFileWrite(int filedescriptor, void* data, int* length)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(data == NULL || length == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+
+        if(filedescriptor < 3) // Standard input.
+        {
+            ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+
+            void* write_base;
+
+            // Get the 512 byte minimum, blocking until it gets freed if need be.
+            VMMemoryPoolAllocateWait(stackID, MAX_WRITE_SIZE, VM_TIMEOUT_INFINITE, &write_base);
+
+            int bytesWritten = 0;
+            int messageSize = *length;
+            int numIterations = (int)ceil((double)*length / (double)MAX_WRITE_SIZE);
+
+            for(int i = 0; i < numIterations; i++)
+            {
+                // Write up to 512 bytes of the message
+                if(messageSize >= MAX_WRITE_SIZE)
+                {
+                    memcpy(write_base, data, MAX_WRITE_SIZE);
+                    MachineFileWrite(filedescriptor, write_base, MAX_WRITE_SIZE, fileHandler, (void*)currentThread);
+                    data = (uint8_t*)data + MAX_WRITE_SIZE;
+                    messageSize -= MAX_WRITE_SIZE;
+                }
+                else
+                {
+                    memcpy(write_base, data, messageSize);
+                    MachineFileWrite(filedescriptor, write_base, messageSize, fileHandler, (void*)currentThread);
+                }
+
+                currentThread->setWaitingFor(WAITING_IO);
+                myScheduler->addToWaiting(currentThread);
+                myScheduler->scheduleNext();
+
+                if(currentThread->getResult() < 0)
+                {
+                    VMMemoryPoolDeallocate(stackID, write_base);
+
+                    MachineResumeSignals(&sigstate);
+                    return VM_STATUS_FAILURE;
+                }
+                else
+                {
+                    bytesWritten += currentThread->getResult();
+                }
+            }
+
+            *length = bytesWritten;
+
+            // Deallocate the memory we were using (wakes anyone waiting for it).
+            VMMemoryPoolDeallocate(stackID, write_base);
+        }
+        else // File descriptor >= 3
+        {
+            File* file = findOpenFile(filedescriptor);
+
+            if(file == NULL)
+            {
+                MachineResumeSignals(&sigstate);
+                return VM_STATUS_FAILURE;
+            }
+
+            uint16_t date = getCurrDate();
+            uint16_t time = getCurrTime();
+
+            *(uint16_t*)(file->entry + DIR_LAST_ACC_DATE) = date;
+
+            if((file->flags & O_RDONLY) != 0) // Trying to write from a read-only file.
+            {
+                MachineResumeSignals(&sigstate);
+                return VM_STATUS_FAILURE;
+            }
+
+            *(uint16_t*)(file->entry + DIR_WRITE_DATE) = date;
+            *(uint16_t*)(file->entry + DIR_WRITE_TIME) = time;
+
+            uint32_t filesize = *(uint32_t*)(file->entry + DIR_FILE_SIZE);
+            uint16_t clusterSize = myFileSystem->SectorsPerCluster * myFileSystem->BytesPerSector;
+            uint32_t clusterIndex = file->filePtr / clusterSize;
+
+            unsigned int clusterOffset = file->filePtr % clusterSize;
+            unsigned int numWritten = 0;
+            unsigned int amountLeftInCluster;
+
+            unsigned int messageLen = (unsigned int)*length;
+            Cluster* currCluster;
+
+            grabExclusive();
+
+            uint16_t clusterNum = fileCluster(file, clusterIndex); // Get the cluster number we're writing to.
+
+            // Right at the end of the last cluster the chain needs another one first.
+            if(clusterNum >= 0xFFF7 && clusterIndex > 0)
+            {
+                uint16_t lastCluster = fileCluster(file, clusterIndex - 1);
+
+                if(lastCluster < 0xFFF7)
+                {
+                    clusterNum = extendChain(lastCluster, messageLen);
+                }
+            }
+
+            while(numWritten < (unsigned int)*length && clusterNum < 0xFFF7)
+            {
+                currCluster = myClusterCache->load(clusterNum);
+                myClusterCache->markDirty(currCluster);
+
+                amountLeftInCluster = clusterSize - clusterOffset;
+
+                if(messageLen < amountLeftInCluster)
+                {
+                    memcpy((void*)(currCluster->data + clusterOffset), data, messageLen);
+
+                    numWritten += messageLen;
+                    file->filePtr += messageLen;
+                    amountLeftInCluster -= messageLen;
+                    data = (uint8_t*)data + messageLen;
+                    clusterOffset += messageLen;
+                    messageLen = 0;
+                    break;
+
+                }
+                else // messageLen >= amountLeftInCluster.
+                {
+                    memcpy((void*)(currCluster->data + clusterOffset), data, amountLeftInCluster);
+
+                    numWritten += amountLeftInCluster;
+                    file->filePtr += amountLeftInCluster;
+                    messageLen -= amountLeftInCluster;
+                    clusterOffset += amountLeftInCluster;
+                    data = (uint8_t*)data + amountLeftInCluster;
+                    amountLeftInCluster = 0;
+                }
+
+                if(messageLen > 0)
+                {
+                    if(amountLeftInCluster == 0)
+                    {
+                        if(myFileSystem->FatTable[clusterNum] >= 0xFFF7) // need to allocate another cluster
+                        {
+                            // If no free clusters remain, then break out.
+                            if(extendChain(clusterNum, messageLen) >= 0xFFF7)
+                            {
+                                break;
+                            }
+                        }
+                        clusterNum = myFileSystem->FatTable[clusterNum];
+                        clusterOffset = 0;
+                    }
+                }
+            }
+
+            // If the file pointer has gone passed the previous file size, update the file size.
+            if(file->filePtr > filesize)
+            {
+                *(uint32_t*)(file->entry + DIR_FILE_SIZE) = (uint32_t)file->filePtr;
+            }
+
+            syncEntry(file->entry, file->dentry);
+
+            releaseLock();
+
+            *length = numWritten;
+        }
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+
+    TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int* newoffset)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(filedescriptor < 3)
+        {
+            ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+
+            MachineFileSeek(filedescriptor, offset, whence, fileHandler, (void*)currentThread);
+
+            currentThread->setWaitingFor(WAITING_IO);
+            myScheduler->addToWaiting(currentThread);
+            myScheduler->scheduleNext();
+
+            if(currentThread->getResult() < 0)
+            {
+                MachineResumeSignals(&sigstate);
+                return VM_STATUS_FAILURE;
+            }
+
+            if(newoffset != NULL)
+            {
+                *newoffset = currentThread->getResult();
+            }
+        }
+        else
+        {
+            File* file = findOpenFile(filedescriptor);
+
+            if(file == NULL)
+            {
+                MachineResumeSignals(&sigstate);
+                return VM_STATUS_FAILURE;
+            }
+
+            uint32_t filesize = *(uint32_t*)(file->entry + DIR_FILE_SIZE);
+
+            if(whence == 1) // Current
+            {
+                file->filePtr += offset;
+            }
+            else if(whence == 2) // End
+            {
+                 file->filePtr = filesize;
+            }
+            else // Beginning.
+            {
+                 file->filePtr = offset;
+            }
+
+            if(file->filePtr < 0)
+            {
+                file->filePtr = 0;
+            }
+            else if((unsigned)file->filePtr > filesize)
+            {
+                file->filePtr = filesize;
+            }
+
+            *newoffset = file->filePtr;
+        }
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    // Reserves clusters for the first length bytes of the file, in one contiguous run where
+    // the disk allows. The file's size doesn't change, writes use the clusters as they get there.
+    TVMStatus VMFileAllocate(int filedescriptor, unsigned int length)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        File* file = findOpenFile(filedescriptor);
+
+        if(file == NULL || (file->flags & (O_WRONLY | O_RDWR)) == 0)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+
+        uint16_t clusterSize = myFileSystem->SectorsPerCluster * myFileSystem->BytesPerSector;
+        uint32_t wanted = (length + clusterSize - 1) / clusterSize;
+
+        TVMStatus status = VM_STATUS_SUCCESS;
+
+        grabExclusive();
+
+        // Maps the whole chain when it's too short, leaving its last cluster at the end of the extents.
+        if(wanted != 0 && fileCluster(file, wanted - 1) >= 0xFFF7)
+        {
+            if(file->extents.empty())
+            {
+                uint16_t firstCluster = myFileSystem->allocateClusters(NO_CLUSTER, wanted);
+
+                if(firstCluster >= 0xFFF7)
+                {
+                    status = VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+                }
+                else
+                {
+                    *(uint16_t*)(file->entry + DIR_FIRST_CLUS_LO) = firstCluster;
+
+                    syncEntry(file->entry, file->dentry);
+                }
+            }
+            else
+            {
+                FileExtent& last = file->extents.back();
+                uint32_t have = last.fileCluster + last.length;
+
+                if(myFileSystem->allocateClusters(last.firstCluster + last.length - 1, wanted - have) >= 0xFFF7)
+                {
+                    status = VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+                }
+            }
+        }
+
+        releaseLock();
+
+        MachineResumeSignals(&sigstate);
+        return status;
+    }
+
+    // Cuts the file down to length bytes and frees the clusters it no longer needs,
+    // including any reserved by VMFileAllocate past the new end.
+    TVMStatus VMFileTruncate(int filedescriptor, unsigned int length)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        File* file = findOpenFile(filedescriptor);
+
+        if(file == NULL || (file->flags & (O_WRONLY | O_RDWR)) == 0)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+
+        if(length > *(uint32_t*)(file->entry + DIR_FILE_SIZE))
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        uint16_t clusterSize = myFileSystem->SectorsPerCluster * myFileSystem->BytesPerSector;
+
+        // A file always keeps its first cluster.
+        uint32_t keep = (length + clusterSize - 1) / clusterSize;
+        if(keep == 0)
+        {
+            keep = 1;
+        }
+
+        grabExclusive();
+
+        uint16_t lastCluster = fileCluster(file, keep - 1);
+
+        if(lastCluster < 0xFFF7)
+        {
+            uint16_t rest = myFileSystem->FatTable[lastCluster];
+
+            if(rest >= 2 && rest < 0xFFF7)
+            {
+                myFileSystem->FatTable[lastCluster] = 0xFFFF;
+                myFileSystem->markFATDirty(lastCluster);
+
+                for(uint16_t cluster = rest; cluster >= 2 && cluster < 0xFFF7; cluster = myFileSystem->FatTable[cluster])
+                {
+                    myClusterCache->discard(cluster);
+                }
+
+                myFileSystem->freeChain(rest);
+            }
+        }
+
+        *(uint32_t*)(file->entry + DIR_FILE_SIZE) = length;
+
+        syncEntry(file->entry, file->dentry);
+
+        // Everyone with the file open loses the part of their extent map that was cut off.
+        for(unsigned int i = 0; i < openFiles.size(); i++)
+        {
+            if(openFiles[i]->entry == file->entry)
+            {
+                openFiles[i]->extents.clear();
+                openFiles[i]->extentHint = 0;
+
+                if(openFiles[i]->filePtr > length)
+                {
+                    openFiles[i]->filePtr = length;
                 }
+            }
+        }
+
+        releaseLock();
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+
+/*******************************************************************************************************
+                                       	Mutex Functions
+*******************************************************************************************************/
+
+    TVMStatus VMMutexCreate(TVMMutexIDRef mutexref)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(mutexref == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        *mutexref = myScheduler->createMutex();
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMMutexDelete(TVMMutexID mutex)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        Mutex* mtx = myScheduler->findMutex(mutex);
+
+        if(mtx == NULL) // Not found
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(mtx->isLocked())
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
+
+        myScheduler->deleteMutex(mutex);
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMMutexQuery(TVMMutexID mutex, TVMThreadIDRef ownerref)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(ownerref == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        Mutex* mtx = myScheduler->findMutex(mutex);
+
+        if(mtx == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        if(!(mtx->isLocked())) // unlocked.
+        {
+       	    *ownerref = VM_THREAD_ID_INVALID;
+        }
+
+        else
+        {
+            *ownerref = mtx->getOwner();
+        }
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMMutexAcquire(TVMMutexID mutex, TVMTick timeout)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        Mutex* mtx = myScheduler->findMutex(mutex);
+        if(mtx == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        ThreadControlBlock* curr = myScheduler->getCurrentThread();
+
+        if(mtx->tryLock(curr->getTID())) // Uncontended.
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_SUCCESS;
+        }
+        else if(timeout == VM_TIMEOUT_IMMEDIATE)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+        else
+        {
+            curr->setWaitingFor(WAITING_MUTEX);
+
+            if(timeout == VM_TIMEOUT_INFINITE)
+            {
+                curr->setInfiniteFlag(true);
+                curr->setTicks(-1);
+            }
+            else
+            {
+                curr->setTicks(timeout);
+            }
+
+            mtx->wantsMutex(curr); // Adds thread to mutex waiting queue.
+            myScheduler->addToWaiting(curr);
+
+            myScheduler->scheduleNext();
+
+            // The releasing thread hands the mutex over before waking us.
+            if(curr->getResult() != VM_STATUS_SUCCESS) // Didn't get Mutex.
+            {
+               MachineResumeSignals(&sigstate);
+               return VM_STATUS_FAILURE;
+            }
+        }
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMMutexRelease(TVMMutexID mutex)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        Mutex* mtx = myScheduler->findMutex(mutex);
+        if(mtx == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(!(mtx->isLocked()) || mtx->getOwner() != (myScheduler->getCurrentThread())->getTID())
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
+        else
+        {
+            // Release mutex.
+            ThreadControlBlock* newOwner = myScheduler->handOffMutex(mtx);
+            if(newOwner != NULL) // Someone got the mutex.
+            {
+                myScheduler->preemptFor(newOwner);
+            }
+        }
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMMutexHandle(TVMMutexID mutex, SVMMutexHandleRef handleref)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(handleref == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        Mutex* mtx = myScheduler->findMutex(mutex);
+
+        if(mtx == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+
+        handleref->DMutex = mutex;
+        handleref->DLockWord = &mtx->lockWord;
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+
+/*******************************************************************************************************
+                                       	Condition Functions
+*******************************************************************************************************/
+
+    TVMStatus VMConditionCreate(TVMConditionIDRef conditionref)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(conditionref == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
+
+        *conditionref = myScheduler->createCondition();
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMConditionDelete(TVMConditionID condition)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        Condition* cond = myScheduler->findCondition(condition);
+
+        if(cond == NULL) // Not found
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(cond->hasWaiters())
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
+
+        myScheduler->deleteCondition(condition);
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+    TVMStatus VMConditionWait(TVMConditionID condition, TVMMutexID mutex, TVMTick timeout)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        Condition* cond = myScheduler->findCondition(condition);
+        Mutex* mtx = myScheduler->findMutex(mutex);
+        if(cond == NULL || mtx == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+
+        ThreadControlBlock* curr = myScheduler->getCurrentThread();
+
+        // Caller must hold the mutex protecting the condition.
+        if(!(mtx->isLocked()) || mtx->getOwner() != curr->getTID())
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
+        else if(timeout == VM_TIMEOUT_IMMEDIATE)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+
+        curr->setWaitingFor(WAITING_CONDITION);
+
+        if(timeout == VM_TIMEOUT_INFINITE)
+        {
+            curr->setInfiniteFlag(true);
+            curr->setTicks(-1);
+        }
+        else
+        {
+            curr->setTicks(timeout);
+        }
+
+        // Queue on the condition before giving up the mutex so no signal is lost.
+        cond->wait(curr);
+        myScheduler->handOffMutex(mtx);
+        myScheduler->addToWaiting(curr);
+
+        myScheduler->scheduleNext();
 
-                if(messageLen < amountLeftInCluster)
-               	{
-                    memcpy(data, (void*)(currCluster->data + clusterOffset), messageLen);
+        // Result was set by whoever woke us (signal or timeout).
+        TVMStatus status = (TVMStatus)curr->getResult();
 
-                    numReadIn += messageLen;
-                    file->filePtr += messageLen;
-                    amountLeftInCluster -= messageLen;
-                    data = (uint8_t*)data + messageLen;
-                    clusterOffset += messageLen;
-                    messageLen = 0;
-                    break;
+        VMMutexAcquire(mutex, VM_TIMEOUT_INFINITE);
 
-                }
-                else // messageLen >= amountLeftInCluster.
-                {
-                    memcpy(data, (void*)(currCluster->data + clusterOffset), amountLeftInCluster);
+        MachineResumeSignals(&sigstate);
+        return status;
+    }
 
-                    numReadIn += amountLeftInCluster;
-                    file->filePtr += amountLeftInCluster;
-                    messageLen -= amountLeftInCluster;
-                    clusterOffset += amountLeftInCluster;
-                    data = (uint8_t*)data + amountLeftInCluster;
-                    amountLeftInCluster = 0;
-                }
+    TVMStatus VMConditionSignal(TVMConditionID condition)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
 
-                if(messageLen > 0) // Not done reading.
-                {
-                    if(amountLeftInCluster == 0)
-                    {
-                        if(myFileSystem->FatTable[clusterNum] >= 0xFFF7)
-                        {
-                            break;
-                        }
-                        clusterNum = myFileSystem->FatTable[clusterNum];
-                        clusterOffset = 0;
-                    }
-                }
-            }
-            releaseMutex();
+        Condition* cond = myScheduler->findCondition(condition);
+        if(cond == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
 
-            *length = numReadIn;
+        ThreadControlBlock* waiter = cond->getNextWaiter();
+        if(waiter != NULL)
+        {
+            myScheduler->wakeThread(waiter, VM_STATUS_SUCCESS);
+            myScheduler->preemptFor(waiter);
         }
 
         MachineResumeSignals(&sigstate);
-       	return VM_STATUS_SUCCESS;
+        return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMFileWrite(int filedescriptor, void* data, int* length)
+    TVMStatus VMConditionBroadcast(TVMConditionID condition)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        if(data == NULL || length == NULL)
+        Condition* cond = myScheduler->findCondition(condition);
+        if(cond == NULL)
         {
             MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_PARAMETER;
+            return VM_STATUS_ERROR_INVALID_ID;
         }
 
+        // Waiters come out highest priority first, so the first one is the one to preempt for.
+        ThreadControlBlock* first = cond->getNextWaiter();
+        if(first != NULL)
+        {
+            myScheduler->wakeThread(first, VM_STATUS_SUCCESS);
 
-        if(filedescriptor < 3) // Standard input.
+            ThreadControlBlock* waiter;
+            while((waiter = cond->getNextWaiter()) != NULL)
+            {
+                myScheduler->wakeThread(waiter, VM_STATUS_SUCCESS);
+            }
+            myScheduler->preemptFor(first);
+        }
+
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
+
+/*******************************************************************************************************
+                                       	Semaphore Functions
+*******************************************************************************************************/
+
+    TVMStatus VMSemaphoreCreate(TVMSemaphoreIDRef semaphoreref, unsigned int count)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(semaphoreref == NULL)
         {
-            ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
 
-            void* write_base;
+        *semaphoreref = myScheduler->createSemaphore(count);
 
-            // Try to allocate the 512 byte minimum.
-            TVMStatus status = VMMemoryPoolAllocate(stackID, MAX_WRITE_SIZE, &write_base);
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-            while(status != VM_STATUS_SUCCESS)
-            {
-                 // Block until memory gets freed.
-                 currentThread->setWaitingFor(WAITING_MEMORY);
+    TVMStatus VMSemaphoreDelete(TVMSemaphoreID semaphore)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
 
-                 myMemoryManager->addToMemoryQueue(currentThread);
+        Semaphore* sem = myScheduler->findSemaphore(semaphore);
 
-                 myScheduler->addToWaiting(currentThread);
-                 myScheduler->scheduleNext();
-                 status = VMMemoryPoolAllocate(stackID, MAX_WRITE_SIZE, &write_base);
-            }
+        if(sem == NULL) // Not found
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(sem->hasWaiters())
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
 
-            int bytesWritten = 0;
-            int messageSize = *length;
-            int numIterations = (int)ceil((double)*length / (double)MAX_WRITE_SIZE);
+        myScheduler->deleteSemaphore(semaphore);
 
-            for(int i = 0; i < numIterations; i++)
-            {
-                // Write up to 512 bytes of the message
-                if(messageSize >= MAX_WRITE_SIZE)
-                {
-                    memcpy(write_base, data, MAX_WRITE_SIZE);
-                    MachineFileWrite(filedescriptor, write_base, MAX_WRITE_SIZE, fileHandler, (void*)currentThread);
-                    data = (uint8_t*)data + MAX_WRITE_SIZE;
-                    messageSize -= MAX_WRITE_SIZE;
-                }
-                else
-                {
-                    memcpy(write_base, data, messageSize);
-                    MachineFileWrite(filedescriptor, write_base, messageSize, fileHandler, (void*)currentThread);
-                }
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-                currentThread->setWaitingFor(WAITING_IO);
-                myScheduler->addToWaiting(currentThread);
-                myScheduler->scheduleNext();
+    TVMStatus VMSemaphoreQuery(TVMSemaphoreID semaphore, unsigned int* countref)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
 
-                if(currentThread->getResult() < 0)
-                {
-                    VMMemoryPoolDeallocate(stackID, write_base);
+        if(countref == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        }
 
-                    // See if anyone is waiting for memory.
-                    ThreadControlBlock* nextThread = myMemoryManager->getNext();
+        Semaphore* sem = myScheduler->findSemaphore(semaphore);
 
-                    if(nextThread != NULL) // There was a thread waiting for memory.
-                    {
-                        myScheduler->removeFromWaiting(nextThread->getTID());
-                        myScheduler->addToReady(nextThread);
-                    }
+        if(sem == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
 
-                    MachineResumeSignals(&sigstate);
-                    return VM_STATUS_FAILURE;
-                }
-                else
-                {
-                    bytesWritten += currentThread->getResult();
-                }
-            }
+        *countref = sem->count;
 
-            *length = bytesWritten;
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-            // Deallocate the memory we were using.
-            VMMemoryPoolDeallocate(stackID, write_base);
+    TVMStatus VMSemaphoreAcquire(TVMSemaphoreID semaphore, TVMTick timeout)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
 
-            // See if anyone is waiting for memory.
-            ThreadControlBlock* nextThread = myMemoryManager->getNext();
+        Semaphore* sem = myScheduler->findSemaphore(semaphore);
+        if(sem == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
 
-            if(nextThread != NULL) // There was a thread waiting for memory.
-            {
-                myScheduler->removeFromWaiting(nextThread->getTID());
-                myScheduler->addToReady(nextThread);
-                if(nextThread->getPriority() > currentThread->getPriority())
-                {
-                    myScheduler->addToReady(myScheduler->getCurrentThread());
-                    myScheduler->scheduleNext();
-                }
-            }
+        if(sem->count > 0)
+        {
+            sem->count--;
         }
-        else // File descriptor >= 3
+        else if(timeout == VM_TIMEOUT_IMMEDIATE)
         {
-            File* file = findOpenFile(filedescriptor);
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_FAILURE;
+        }
+        else
+        {
+            ThreadControlBlock* curr = myScheduler->getCurrentThread();
+            curr->setWaitingFor(WAITING_SEMAPHORE);
 
-            if(file == NULL)
+            if(timeout == VM_TIMEOUT_INFINITE)
             {
-                MachineResumeSignals(&sigstate);
-                return VM_STATUS_FAILURE;
+                curr->setInfiniteFlag(true);
+                curr->setTicks(-1);
+            }
+            else
+            {
+                curr->setTicks(timeout);
             }
 
-            uint16_t date = getCurrDate();
-            uint16_t time = getCurrTime();
+            sem->wantsSemaphore(curr); // Adds thread to semaphore waiting queue.
+            myScheduler->addToWaiting(curr);
 
-            *(uint16_t*)(file->entry + DIR_LAST_ACC_DATE) = date;
+            myScheduler->scheduleNext();
 
-            if((file->flags & O_RDONLY) != 0) // Trying to write from a read-only file.
+            // VMSemaphoreRelease hands its unit straight to us, a timeout doesn't.
+            if(curr->getResult() != VM_STATUS_SUCCESS)
             {
                 MachineResumeSignals(&sigstate);
                 return VM_STATUS_FAILURE;
             }
+        }
 
-            *(uint16_t*)(file->entry + DIR_WRITE_DATE) = date;
-            *(uint16_t*)(file->entry + DIR_WRITE_TIME) = time;
-
-            uint16_t firstCluster = *(uint16_t*)(file->entry + DIR_FIRST_CLUS_LO);
-            uint32_t filesize = *(uint32_t*)(file->entry + DIR_FILE_SIZE);
-            uint16_t clusterSize = myFileSystem->SectorsPerCluster * myFileSystem->BytesPerSector;
-
-            uint16_t clusterNum = FatSearch(firstCluster, file->filePtr / clusterSize); // Get the cluster number we're reading from.
-
-            unsigned int clusterOffset = file->filePtr % clusterSize;
-            unsigned int numWritten = 0;
-            unsigned int amountLeftInCluster;
-
-            unsigned int messageLen = (unsigned int)*length;
-            Cluster* currCluster;
-
-            grabMutex();
-
-            while(numWritten < (unsigned int)*length)
-            {
-                currCluster = findCachedCluster(clusterNum);
-                if(currCluster == NULL) // Not found.
-                {
-                    currCluster = new Cluster; // Create a new cached cluster entry.
-                    createCachedCluster(currCluster, clusterNum);
-                    cachedClusters.push_back(currCluster);
-                }
-                amountLeftInCluster = clusterSize - clusterOffset;
-
-                if(messageLen < amountLeftInCluster)
-                {
-                    memcpy((void*)(currCluster->data + clusterOffset), data, messageLen);
-
-                    numWritten += messageLen;
-                    file->filePtr += messageLen;
-                    amountLeftInCluster -= messageLen;
-                    data = (uint8_t*)data + messageLen;
-                    clusterOffset += messageLen;
-                    messageLen = 0;
-                    break;
-
-                }
-                else // messageLen >= amountLeftInCluster.
-                {
-                    memcpy((void*)(currCluster->data + clusterOffset), data, amountLeftInCluster);
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-                    numWritten += amountLeftInCluster;
-                    file->filePtr += amountLeftInCluster;
-                    messageLen -= amountLeftInCluster;
-                    clusterOffset += amountLeftInCluster;
-                    data = (uint8_t*)data + amountLeftInCluster;
-                    amountLeftInCluster = 0;
-                }
+    TVMStatus VMSemaphoreRelease(TVMSemaphoreID semaphore)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
 
-                if(messageLen > 0)
-                {
-                    if(amountLeftInCluster == 0)
-                    {
-                        if(myFileSystem->FatTable[clusterNum] >= 0xFFF7) // need to allocate another cluster
-                        {
-                            // Find first free cluster in FAT Table.
-                            for(int i = 0; i < myFileSystem->FATSize16 * myFileSystem->BytesPerSector / 2; i ++)
-                            {
-                                if(myFileSystem->FatTable[i] == 0x0000) // Free.
-                                {
-                                     myFileSystem->FatTable[clusterNum] = i;
-                                     myFileSystem->FatTable[i] = 0xFFFF;
-                                     break;
-                                }
-                            }
+        Semaphore* sem = myScheduler->findSemaphore(semaphore);
+        if(sem == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
 
-                            // If no free clusters remain, then break out.
-                            if(myFileSystem->FatTable[clusterNum] >= 0xFFF)
-                            {
-                                break;
-                            }
-                        }
-                        clusterNum = myFileSystem->FatTable[clusterNum];
-                        clusterOffset = 0;
-                    }
-                }
-            }
+        ThreadControlBlock* waiter = sem->getNextWaiter();
+        if(waiter != NULL) // Pass the unit directly to the waiter.
+        {
+            myScheduler->wakeThread(waiter, VM_STATUS_SUCCESS);
+            myScheduler->preemptFor(waiter);
+        }
+        else
+        {
+            sem->count++;
+        }
 
-            releaseMutex();
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-            // If the file pointer has gone passed the previous file size, update the file size.
-            if(file->filePtr > filesize)
-            {
-                *(uint32_t*)(file->entry + DIR_FILE_SIZE) = (uint32_t)file->filePtr;
-            }
+/*******************************************************************************************************
+                                       	Reader-Writer Lock Functions
+*******************************************************************************************************/
 
-            *length = numWritten;
+    TVMStatus VMRWLockCreate(TVMRWLockIDRef rwlockref)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        if(rwlockref == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
+        *rwlockref = myScheduler->createRWLock();
+
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-
-    TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int* newoffset)
+    TVMStatus VMRWLockDelete(TVMRWLockID rwlock)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        if(filedescriptor < 3)
+        RWLock* lock = myScheduler->findRWLock(rwlock);
+
+        if(lock == NULL) // Not found
         {
-            ThreadControlBlock* currentThread = myScheduler->getCurrentThread();
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(lock->isLocked() || lock->hasWaiters())
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
 
-            MachineFileSeek(filedescriptor, offset, whence, fileHandler, (void*)currentThread);
+        myScheduler->deleteRWLock(rwlock);
 
-            currentThread->setWaitingFor(WAITING_IO);
-            myScheduler->addToWaiting(currentThread);
-            myScheduler->scheduleNext();
+        MachineResumeSignals(&sigstate);
+        return VM_STATUS_SUCCESS;
+    }
 
-            if(currentThread->getResult() < 0)
-            {
-                MachineResumeSignals(&sigstate);
-                return VM_STATUS_FAILURE;
-            }
+    // Shared by VMRWLockAcquireRead and VMRWLockAcquireWrite, signals must be suspended.
+    TVMStatus acquireRWLock(TVMRWLockID rwlock, TVMTick timeout, bool exclusive)
+    {
+        RWLock* lock = myScheduler->findRWLock(rwlock);
+        if(lock == NULL)
+        {
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
 
-            if(newoffset != NULL)
-            {
-                *newoffset = currentThread->getResult();
-            }
+        ThreadControlBlock* curr = myScheduler->getCurrentThread();
+
+        if(exclusive && lock->canWrite())
+        {
+            lock->writer = curr->getTID();
+        }
+        else if(!exclusive && lock->canRead(curr->getPriority()))
+        {
+            lock->readers.push_back(curr->getTID());
+        }
+        else if(timeout == VM_TIMEOUT_IMMEDIATE)
+        {
+            return VM_STATUS_FAILURE;
         }
         else
         {
-            File* file = findOpenFile(filedescriptor);
+            curr->setWaitingFor(WAITING_RWLOCK);
 
-            if(file == NULL)
+            if(timeout == VM_TIMEOUT_INFINITE)
             {
-                MachineResumeSignals(&sigstate);
-                return VM_STATUS_FAILURE;
+                curr->setInfiniteFlag(true);
+                curr->setTicks(-1);
             }
-
-            uint32_t filesize = *(uint32_t*)(file->entry + DIR_FILE_SIZE);
-
-            if(whence == 1) // Current
+            else
             {
-                file->filePtr += offset;
+                curr->setTicks(timeout);
             }
-            else if(whence == 2) // End
+
+            if(exclusive)
             {
-                 file->filePtr = filesize;
+                lock->wantsWrite(curr);
             }
-            else // Beginning.
+            else
             {
-                 file->filePtr = offset;
+                lock->wantsRead(curr);
             }
+            myScheduler->addToWaiting(curr);
 
-            if(file->filePtr < 0)
-            {
-                file->filePtr = 0;
-            }
-            else if((unsigned)file->filePtr > filesize)
+            myScheduler->scheduleNext();
+
+            // The releasing thread grants the lock to us before waking us.
+            if(curr->getResult() != VM_STATUS_SUCCESS)
             {
-                file->filePtr = filesize;
+                return VM_STATUS_FAILURE;
             }
+        }
+        return VM_STATUS_SUCCESS;
+    }
 
-            *newoffset = file->filePtr;
+    TVMStatus VMRWLockAcquireRead(TVMRWLockID rwlock, TVMTick timeout)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        TVMStatus status = acquireRWLock(rwlock, timeout, false);
+
+        MachineResumeSignals(&sigstate);
+        return status;
+    }
+
+    TVMStatus VMRWLockAcquireWrite(TVMRWLockID rwlock, TVMTick timeout)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        TVMStatus status = acquireRWLock(rwlock, timeout, true);
+
+        MachineResumeSignals(&sigstate);
+        return status;
+    }
+
+    TVMStatus VMRWLockRelease(TVMRWLockID rwlock)
+    {
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        RWLock* lock = myScheduler->findRWLock(rwlock);
+        if(lock == NULL)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_ID;
+        }
+        else if(!lock->release(myScheduler->getCurrentThread()->getTID()))
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INVALID_STATE;
+        }
+
+        ThreadControlBlock* woken = myScheduler->grantRWLock(lock);
+        if(woken != NULL)
+        {
+            myScheduler->preemptFor(woken);
         }
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-
 /*******************************************************************************************************
-                                       	Mutex Functions
+                                       	Channel Functions
 *******************************************************************************************************/
 
-    TVMStatus VMMutexCreate(TVMMutexIDRef mutexref)
+    TVMStatus VMChannelCreate(unsigned int capacity, TVMChannelIDRef channelref)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        if(mutexref == NULL)
+        if(channelref == NULL || capacity == 0)
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
 
-        *mutexref = myScheduler->createMutex();
+        TVMChannelID channel = myScheduler->createChannel(capacity);
+
+        if(channel == VM_CHANNEL_ID_INVALID)
+        {
+            MachineResumeSignals(&sigstate);
+            return VM_STATUS_ERROR_INSUFFICIENT_RESOURCES;
+        }
+
+        *channelref = channel;
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMMutexDelete(TVMMutexID mutex)
+    TVMStatus VMChannelDelete(TVMChannelID channel)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        Mutex* mtx = myScheduler->findMutex(mutex);
+        Channel* chnl = myScheduler->findChannel(channel);
 
-        if(mtx == NULL) // Not found
+        if(chnl == NULL) // Not found
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_ID;
         }
-        else if(mtx->isLocked)
+        else if(chnl->hasWaiters())
         {
             MachineResumeSignals(&sigstate);
             return VM_STATUS_ERROR_INVALID_STATE;
         }
 
-        myScheduler->deleteMutex(mutex);
+        myScheduler->deleteChannel(channel);
 
         MachineResumeSignals(&sigstate);
         return VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMMutexQuery(TVMMutexID mutex, TVMThreadIDRef ownerref)
+    // Marks the current thread as in a channel send or receive. Deleted channels aren't
+    // freed while it is, so it can look one up and use it with signals enabled.
+    ThreadControlBlock* enterChannel()
+    {
+        ThreadControlBlock* curr = myScheduler->getCurrentThread();
+        curr->setInChannel(true);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+        return curr;
+    }
+
+    void leaveChannel(ThreadControlBlock* curr)
+    {
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        curr->setInChannel(false);
+
+        if(myScheduler->hasRetiredChannels())
+        {
+            TMachineSignalState sigstate;
+            MachineSuspendSignals(&sigstate);
+            myScheduler->reapChannels();
+            MachineResumeSignals(&sigstate);
+        }
+    }
+
+    // Wakes the best thread blocked on the other end of the channel.
+    void wakeChannelWaiter(Channel* chnl, bool receiver)
     {
         TMachineSignalState sigstate;
         MachineSuspendSignals(&sigstate);
 
-        if(ownerref == NULL)
+        ThreadControlBlock* waiter = receiver ? chnl->getNextReceiver() : chnl->getNextSender();
+        if(waiter != NULL)
         {
-            MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_PARAMETER;
+            myScheduler->wakeThread(waiter, VM_STATUS_SUCCESS);
+            myScheduler->preemptFor(waiter);
         }
 
-        Mutex* mtx = myScheduler->findMutex(mutex);
+        MachineResumeSignals(&sigstate);
+    }
 
-        if(mtx == NULL)
+    // Blocks until the other end makes progress or deadline passes, signals must be
+    // suspended. Returns false if the deadline passed first.
+    bool waitOnChannel(Channel* chnl, TVMTick timeout, TVMTick deadline, bool sending)
+    {
+        ThreadControlBlock* curr = myScheduler->getCurrentThread();
+        curr->setWaitingFor(WAITING_CHANNEL);
+
+        if(timeout == VM_TIMEOUT_INFINITE)
         {
-            MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_ID;
+            curr->setInfiniteFlag(true);
+            curr->setTicks(-1);
         }
-        if(!(mtx->isLocked)) // unlocked.
+        else
         {
-       	    *ownerref = VM_THREAD_ID_INVALID;
+            // A woken thread that lost the race only waits for what's left of its timeout.
+            int left = (int)(deadline - tickCount);
+            if(left <= 0)
+            {
+                return false;
+            }
+
+            curr->setTicks(left);
         }
 
+        if(sending)
+        {
+            chnl->wantsSend(curr);
+        }
         else
         {
-            *ownerref = mtx->owner;
+            chnl->wantsReceive(curr);
         }
+        myScheduler->addToWaiting(curr);
 
-        MachineResumeSignals(&sigstate);
-        return VM_STATUS_SUCCESS;
+        myScheduler->scheduleNext();
+
+        return curr->getResult() == VM_STATUS_SUCCESS;
     }
 
-    TVMStatus VMMutexAcquire(TVMMutexID mutex, TVMTick timeout)
+    TVMStatus VMChannelSend(TVMChannelID channel, void* message, TVMTick timeout)
     {
-        TMachineSignalState sigstate;
-        MachineSuspendSignals(&sigstate);
+        ThreadControlBlock* curr = enterChannel();
 
-        Mutex* mtx = myScheduler->findMutex(mutex);
-        if(mtx == NULL)
+        Channel* chnl = myScheduler->findChannel(channel);
+        if(chnl == NULL)
         {
-            MachineResumeSignals(&sigstate);
+            leaveChannel(curr);
             return VM_STATUS_ERROR_INVALID_ID;
         }
-        ThreadControlBlock* curr = myScheduler->getCurrentThread();
 
-        if(!(mtx->isLocked))
+        // Fast path, there was room: only enter the scheduler if a receiver is asleep.
+        if(chnl->trySend(message))
         {
-            curr->mHeld.push_back(mtx->mid);
-            mtx->isLocked = true;
-            mtx->owner = curr->getTID();
+            if(chnl->waitingReceivers != 0)
+            {
+                wakeChannelWaiter(chnl, true);
+            }
+
+            leaveChannel(curr);
+            return VM_STATUS_SUCCESS;
         }
         else if(timeout == VM_TIMEOUT_IMMEDIATE)
         {
-            MachineResumeSignals(&sigstate);
+            leaveChannel(curr);
             return VM_STATUS_FAILURE;
         }
-        else
-        {
-            curr->setWaitingFor(WAITING_MUTEX);
 
-            if(timeout == VM_TIMEOUT_INFINITE)
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
+
+        TVMTick deadline = tickCount + timeout;
+        TVMStatus status = VM_STATUS_SUCCESS;
+
+        // A woken sender can still lose the free slot to another sender, in
+        // which case it waits again for the rest of its timeout.
+        while(!chnl->trySend(message))
+        {
+            if(chnl->deleted)
             {
-                curr->setInfiniteFlag(true);
-                curr->setTicks(-1);
+                status = VM_STATUS_ERROR_INVALID_ID;
+                break;
             }
-            else
+            else if(!waitOnChannel(chnl, timeout, deadline, true))
             {
-                curr->setTicks(timeout);
+                status = VM_STATUS_FAILURE;
+                break;
             }
+        }
 
-            mtx->wantsMutex(curr); // Adds thread to mutex waiting queue.
-            myScheduler->addToWaiting(curr);
-
-            myScheduler->scheduleNext();
-
-            mtx->stopWaiting(curr->getTID());
-            if(mtx->owner != curr->getTID()) // Didn't get Mutex.
-            {
-               MachineResumeSignals(&sigstate);
-               return VM_STATUS_FAILURE;
-            }
+        if(status == VM_STATUS_SUCCESS && chnl->waitingReceivers != 0)
+        {
+            wakeChannelWaiter(chnl, true);
         }
+
         MachineResumeSignals(&sigstate);
-        return VM_STATUS_SUCCESS;
+        leaveChannel(curr);
+        return status;
     }
 
-    TVMStatus VMMutexRelease(TVMMutexID mutex)
+    TVMStatus VMChannelReceive(TVMChannelID channel, void** messageref, TVMTick timeout)
     {
-        TMachineSignalState sigstate;
-        MachineSuspendSignals(&sigstate);
-
-        Mutex* mtx = myScheduler->findMutex(mutex);
-        if(mtx == NULL)
+        if(messageref == NULL)
         {
-            MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_ID;
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
         }
-        else if(!(mtx->isLocked) || mtx->owner != (myScheduler->getCurrentThread())->getTID())
+
+        ThreadControlBlock* curr = enterChannel();
+
+        Channel* chnl = myScheduler->findChannel(channel);
+        if(chnl == NULL)
         {
-            MachineResumeSignals(&sigstate);
-            return VM_STATUS_ERROR_INVALID_STATE;
+            leaveChannel(curr);
+            return VM_STATUS_ERROR_INVALID_ID;
         }
-        else
+
+        // Fast path, a message was waiting: only enter the scheduler if a sender is asleep.
+        if(chnl->tryReceive(messageref))
         {
-            // Release mutex.
-            ThreadControlBlock* thread = myScheduler->findThread(mtx->owner);
-            for(unsigned int i = 0; i < thread->mHeld.size(); i++)
+            if(chnl->waitingSenders != 0)
             {
-                if(thread->mHeld[i] == mtx->mid)
-                {
-                    thread->mHeld.erase(thread->mHeld.begin() + i);
-                }
+                wakeChannelWaiter(chnl, false);
             }
 
-            mtx->isLocked = false;
-            mtx->owner = 0;
+            leaveChannel(curr);
+            return VM_STATUS_SUCCESS;
+        }
+        else if(timeout == VM_TIMEOUT_IMMEDIATE)
+        {
+            leaveChannel(curr);
+            return VM_STATUS_FAILURE;
+        }
+
+        TMachineSignalState sigstate;
+        MachineSuspendSignals(&sigstate);
 
+        TVMTick deadline = tickCount + timeout;
+        TVMStatus status = VM_STATUS_SUCCESS;
 
-            ThreadControlBlock* newOwner = mtx->getNextOwner();
-            if(newOwner != NULL) // Someone got the mutex.
+        while(!chnl->tryReceive(messageref))
+        {
+            if(chnl->deleted)
             {
-                myScheduler->removeFromWaiting(newOwner->getTID()); // Remove from waiting queue.
-                myScheduler->addToReady(newOwner); // That thread is ready to run.
-                if(newOwner->getPriority() > myScheduler->getCurrentThread()->getPriority())
-                {
-                    myScheduler->addToReady(myScheduler->getCurrentThread());
-                    myScheduler->scheduleNext();
-                }
+                status = VM_STATUS_ERROR_INVALID_ID;
+                break;
+            }
+            else if(!waitOnChannel(chnl, timeout, deadline, false))
+            {
+                status = VM_STATUS_FAILURE;
+                break;
             }
         }
 
+        if(status == VM_STATUS_SUCCESS && chnl->waitingSenders != 0)
+        {
+            wakeChannelWaiter(chnl, false);
+        }
+
         MachineResumeSignals(&sigstate);
-        return VM_STATUS_SUCCESS;
+        leaveChannel(curr);
+        return status;
     }
 }
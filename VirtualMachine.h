@@ -24,10 +24,25 @@ extern "C" {
 #define VM_THREAD_ID_INVALID                    ((TVMThreadID)-1)
                                                 
 #define VM_MUTEX_ID_INVALID                     ((TVMMutexID)-1)
+#define VM_MUTEX_LOCK_WAITERS                   0x80000000U
+#define VM_CONDITION_ID_INVALID                 ((TVMConditionID)-1)
+#define VM_SEMAPHORE_ID_INVALID                 ((TVMSemaphoreID)-1)
+#define VM_RWLOCK_ID_INVALID                    ((TVMRWLockID)-1)
+#define VM_CHANNEL_ID_INVALID                   ((TVMChannelID)-1)
                                                 
 #define VM_TIMEOUT_INFINITE                     ((TVMTick)0)
 #define VM_TIMEOUT_IMMEDIATE                    ((TVMTick)-1)
 
+#define VM_WAIT_REASON_IO                       0
+#define VM_WAIT_REASON_MUTEX                    1
+#define VM_WAIT_REASON_SLEEP                    2
+#define VM_WAIT_REASON_MEMORY                   3
+#define VM_WAIT_REASON_CONDITION                4
+#define VM_WAIT_REASON_SEMAPHORE                5
+#define VM_WAIT_REASON_RWLOCK                   6
+#define VM_WAIT_REASON_CHANNEL                  7
+#define VM_WAIT_REASON_COUNT                    8
+
 #define VM_FILE_SYSTEM_MAX_PATH                 256
 #define VM_FILE_SYSTEM_SFN_SIZE                 13
 #define VM_FILE_SYSTEM_LFN_SIZE                 VM_FILE_SYSTEM_MAX_PATH
@@ -45,10 +60,56 @@ typedef unsigned int TVMStatus, *TVMStatusRef;
 typedef unsigned int TVMTick, *TVMTickRef;
 typedef unsigned int TVMThreadID, *TVMThreadIDRef;
 typedef unsigned int TVMMutexID, *TVMMutexIDRef;
+typedef unsigned int TVMConditionID, *TVMConditionIDRef;
+typedef unsigned int TVMSemaphoreID, *TVMSemaphoreIDRef;
+typedef unsigned int TVMRWLockID, *TVMRWLockIDRef;
+typedef unsigned int TVMChannelID, *TVMChannelIDRef;
 typedef unsigned int TVMThreadPriority, *TVMThreadPriorityRef;  
 typedef unsigned int TVMThreadState, *TVMThreadStateRef;  
 typedef unsigned int TVMMemoryPoolID, *TVMMemoryPoolIDRef;
 
+// All times are in ticks.
+typedef struct{
+    TVMTick DRunTicks;                          // Time spent running.
+    TVMTick DReadyTicks;                        // Time spent in a ready queue.
+    TVMTick DMaxReadyLatency;                   // Longest single wait in a ready queue.
+    unsigned int DDispatches;                   // Times the thread was switched to.
+    unsigned int DVoluntarySwitches;            // Switched out because it blocked or finished.
+    unsigned int DInvoluntarySwitches;          // Switched out while still ready (preempted).
+    TVMTick DWaitTicks[VM_WAIT_REASON_COUNT];   // Time blocked, indexed by VM_WAIT_REASON_*.
+} SVMThreadStats, *SVMThreadStatsRef;
+
+typedef struct{
+    TVMTick DTicks;                             // Ticks since VMStart.
+    TVMTick DIdleTicks;                         // Ticks where the idle thread was running.
+    unsigned int DContextSwitches;
+    unsigned int DPreemptions;                  // Switches away from a thread that was still ready.
+    unsigned int DThreads;                      // Threads that aren't dead (including idle).
+    unsigned int DReadyThreads;
+    unsigned int DWaitingThreads[VM_WAIT_REASON_COUNT];
+} SVMSchedulerStats, *SVMSchedulerStatsRef;
+
+// Request sizes are counted in classes: class c holds requests of up to 16 << c
+// bytes (more than the one below), the last one also everything bigger.
+#define VM_MEMORY_POOL_STATS_CLASSES            16
+
+typedef struct{
+    TVMMemorySize DSize;
+    TVMMemorySize DFree;                        // Same as VMMemoryPoolQuery.
+    TVMMemorySize DLargestFree;                 // Biggest single block that could be allocated now.
+    unsigned int DFreeSegments;
+    TVMMemorySize DHighWater;                   // Most bytes ever in use at once.
+    unsigned int DAllocations;                  // Successful allocations since the pool was created.
+    unsigned int DFailedAllocations;
+    unsigned int DClassAllocations[VM_MEMORY_POOL_STATS_CLASSES];
+    TVMMemorySize DClassBytes[VM_MEMORY_POOL_STATS_CLASSES]; // Bytes requested, per class.
+} SVMMemoryPoolStats, *SVMMemoryPoolStatsRef;
+
+typedef struct{
+    TVMMutexID DMutex;
+    volatile unsigned int *DLockWord;
+} SVMMutexHandle, *SVMMutexHandleRef;
+
 typedef struct{
     unsigned int DYear;
     unsigned char DMonth;
@@ -70,7 +131,10 @@ typedef struct{
 } SVMDirectoryEntry, *SVMDirectoryEntryRef;
 
 extern const TVMMemoryPoolID VM_MEMORY_POOL_ID_SYSTEM;
+extern volatile TVMThreadID VMCurrentThreadID;
 #define VM_MEMORY_POOL_ID_INVALID               ((TVMMemoryPoolID)-1)
+#define VM_MEMORY_POOL_GRANULE_MINIMUM          ((TVMMemorySize)16)
+#define VM_MEMORY_POOL_GRANULE_DEFAULT          ((TVMMemorySize)64)
 
 typedef void (*TVMMainEntry)(int, char*[]);
 typedef void (*TVMThreadEntry)(void *);
@@ -87,11 +151,21 @@ TVMStatus VMThreadTerminate(TVMThreadID thread);
 TVMStatus VMThreadID(TVMThreadIDRef threadref);
 TVMStatus VMThreadState(TVMThreadID thread, TVMThreadStateRef stateref);
 TVMStatus VMThreadSleep(TVMTick tick);
+TVMStatus VMThreadStats(TVMThreadID thread, SVMThreadStatsRef statsref);
+TVMStatus VMSchedulerStats(SVMSchedulerStatsRef statsref);
 
 TVMStatus VMMemoryPoolCreate(void *base, TVMMemorySize size, TVMMemoryPoolIDRef memory);
+TVMStatus VMMemoryPoolCreateGranule(void *base, TVMMemorySize size, TVMMemorySize granule, TVMMemoryPoolIDRef memory);
+TVMStatus VMMemoryPoolCreateArena(void *base, TVMMemorySize size, TVMMemoryPoolIDRef memory);
+TVMStatus VMMemoryPoolCreateFixed(void *base, TVMMemorySize size, TVMMemorySize objectsize, TVMMemoryPoolIDRef memory);
+TVMStatus VMMemoryPoolReset(TVMMemoryPoolID memory);
 TVMStatus VMMemoryPoolDelete(TVMMemoryPoolID memory);
 TVMStatus VMMemoryPoolQuery(TVMMemoryPoolID memory, TVMMemorySizeRef bytesleft);
+TVMStatus VMMemoryPoolStats(TVMMemoryPoolID memory, SVMMemoryPoolStatsRef statsref);
 TVMStatus VMMemoryPoolAllocate(TVMMemoryPoolID memory, TVMMemorySize size, void **pointer);
+TVMStatus VMMemoryPoolAllocateWait(TVMMemoryPoolID memory, TVMMemorySize size, TVMTick timeout, void **pointer);
+TVMStatus VMMemoryPoolAllocateAligned(TVMMemoryPoolID memory, TVMMemorySize size, TVMMemorySize alignment, void **pointer);
+TVMStatus VMMemoryPoolReallocate(TVMMemoryPoolID memory, void *pointer, TVMMemorySize size, void **newpointer);
 TVMStatus VMMemoryPoolDeallocate(TVMMemoryPoolID memory, void *pointer);       
 
 TVMStatus VMMutexCreate(TVMMutexIDRef mutexref);
@@ -99,6 +173,47 @@ TVMStatus VMMutexDelete(TVMMutexID mutex);
 TVMStatus VMMutexQuery(TVMMutexID mutex, TVMThreadIDRef ownerref);
 TVMStatus VMMutexAcquire(TVMMutexID mutex, TVMTick timeout);     
 TVMStatus VMMutexRelease(TVMMutexID mutex);
+TVMStatus VMMutexHandle(TVMMutexID mutex, SVMMutexHandleRef handleref);
+
+// Uncontended acquire/release through a handle from VMMutexHandle is a single
+// compare-and-swap on the mutex's lock word; anything else falls back to
+// VMMutexAcquire/VMMutexRelease. The handle is invalid once the mutex is deleted.
+static inline TVMStatus VMMutexAcquireInline(SVMMutexHandleRef handle, TVMTick timeout){
+    if(__sync_bool_compare_and_swap(handle->DLockWord, 0, VMCurrentThreadID)){
+        return VM_STATUS_SUCCESS;
+    }
+    return VMMutexAcquire(handle->DMutex, timeout);
+}
+
+static inline TVMStatus VMMutexReleaseInline(SVMMutexHandleRef handle){
+    if(__sync_bool_compare_and_swap(handle->DLockWord, VMCurrentThreadID, 0)){
+        return VM_STATUS_SUCCESS;
+    }
+    return VMMutexRelease(handle->DMutex);
+}
+
+TVMStatus VMConditionCreate(TVMConditionIDRef conditionref);
+TVMStatus VMConditionDelete(TVMConditionID condition);
+TVMStatus VMConditionWait(TVMConditionID condition, TVMMutexID mutex, TVMTick timeout);
+TVMStatus VMConditionSignal(TVMConditionID condition);
+TVMStatus VMConditionBroadcast(TVMConditionID condition);
+
+TVMStatus VMSemaphoreCreate(TVMSemaphoreIDRef semaphoreref, unsigned int count);
+TVMStatus VMSemaphoreDelete(TVMSemaphoreID semaphore);
+TVMStatus VMSemaphoreQuery(TVMSemaphoreID semaphore, unsigned int *countref);
+TVMStatus VMSemaphoreAcquire(TVMSemaphoreID semaphore, TVMTick timeout);
+TVMStatus VMSemaphoreRelease(TVMSemaphoreID semaphore);
+
+TVMStatus VMRWLockCreate(TVMRWLockIDRef rwlockref);
+TVMStatus VMRWLockDelete(TVMRWLockID rwlock);
+TVMStatus VMRWLockAcquireRead(TVMRWLockID rwlock, TVMTick timeout);
+TVMStatus VMRWLockAcquireWrite(TVMRWLockID rwlock, TVMTick timeout);
+TVMStatus VMRWLockRelease(TVMRWLockID rwlock);
+
+TVMStatus VMChannelCreate(unsigned int capacity, TVMChannelIDRef channelref);
+TVMStatus VMChannelDelete(TVMChannelID channel);
+TVMStatus VMChannelSend(TVMChannelID channel, void *message, TVMTick timeout);
+TVMStatus VMChannelReceive(TVMChannelID channel, void **messageref, TVMTick timeout);
 
 #define VMPrint(format, ...)        VMFilePrint ( 1,  format, ##__VA_ARGS__)
 #define VMPrintError(format, ...)   VMFilePrint ( 2,  format, ##__VA_ARGS__)
@@ -108,6 +223,8 @@ TVMStatus VMFileClose(int filedescriptor);
 TVMStatus VMFileRead(int filedescriptor, void *data, int *length);
 TVMStatus VMFileWrite(int filedescriptor, void *data, int *length);
 TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int *newoffset);
+TVMStatus VMFileAllocate(int filedescriptor, unsigned int length);
+TVMStatus VMFileTruncate(int filedescriptor, unsigned int length);
 TVMStatus VMFilePrint(int filedescriptor, const char *format, ...);
 
 TVMStatus VMDateTime(SVMDateTimeRef curdatetime);